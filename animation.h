@@ -0,0 +1,330 @@
+/* Animations: what moves from one frame to the next.
+ *
+ * An animation file has one transform per line, blank lines and lines
+ * starting with # are ignored:
+ *
+ *	frames N
+ *	sphere I dx dy dz
+ *	box I dx dy dz
+ *	light I dx dy dz
+ *	turn sphere|box|light I cx cy cz ax ay az deg
+ *	key F sphere|box|light I x y z
+ *	key F camera ex ey ez lx ly lz
+ *
+ * Frame 0 is the scene as it is. Every following frame moves sphere,
+ * box or light I of the scene by (dx, dy, dz) once more, and a turn
+ * turns it once more by deg degrees about the axis (ax, ay, az) through
+ * (cx, cy, cz), in the order of the file. Boxes stay aligned with the
+ * axes, only their centre turns.
+ *
+ * Keys give where something is on frame F instead: a sphere or light
+ * at (x, y, z), a box with its centre there, or the camera at
+ * (ex, ey, ez) looking at (lx, ly, lz). Between its keys it moves along
+ * a straight line, before the first and after the last it stays put. A
+ * key for every frame spells out the whole path. Something with keys is
+ * not moved or turned as well.
+ *
+ * Objects only move, none appear or disappear, so the BVH of the first
+ * frame can be refitted instead of built again.
+ */
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "geometry.h"
+
+#define ANIM_SPHERE 0
+#define ANIM_BOX 1
+#define ANIM_LIGHT 2
+#define ANIM_CAMERA 3
+
+typedef struct{
+	int kind;	/* ANIM_SPHERE, ANIM_BOX or ANIM_LIGHT */
+	int index;
+	vector step;	/* how far it moves every frame */
+	bool turn;	/* it turns instead, by angle about axis through centre */
+	vector centre, axis;	/* axis is of length 1 */
+	float cosA, sinA;	/* of the angle it turns every frame */
+}animMove;
+
+/* Where something is on a frame */
+typedef struct{
+	int kind;	/* one of ANIM_*, ANIM_CAMERA has no index */
+	int index;
+	int frame;
+	vector pos;
+	vector at;	/* where the camera looks */
+}animKey;
+
+typedef struct{
+	int frames;
+	animMove *moves;
+	int nmoves;
+	animKey *keys;	/* in order of kind, index and frame */
+	int nkeys;
+}animation;
+
+static const char *animKindNames[] = {"sphere", "box", "light", "camera"};
+
+static int animKind(char *name){
+	int k;
+
+	for(k = 0; k <= ANIM_CAMERA; k++)
+		if(strcmp(name, animKindNames[k]) == 0)
+			return k;
+	return -1;
+}
+
+static int animKeyOrder(const void *a, const void *b){
+	const animKey *p = a, *q = b;
+
+	if(p->kind != q->kind) return p->kind - q->kind;
+	if(p->index != q->index) return p->index - q->index;
+	return p->frame - q->frame;
+}
+
+/* Turn v by the angle of m about its axis through its centre */
+static inline vector animTurn(animMove *m, vector *v){
+	vector d = vectorSub(v, &m->centre);
+	vector kxd = vectorCross(&m->axis, &d);
+	float kd = vectorDot(&m->axis, &d) * (1 - m->cosA);
+	vector r = {d.x * m->cosA + kxd.x * m->sinA + m->axis.x * kd + m->centre.x,
+		d.y * m->cosA + kxd.y * m->sinA + m->axis.y * kd + m->centre.y,
+		d.z * m->cosA + kxd.z * m->sinA + m->axis.z * kd + m->centre.z};
+	return r;
+}
+
+/* Read an animation file. Returns 0 on success, otherwise prints where
+ * the file is wrong and returns -1.
+ */
+static int animLoad(animation *a, char *path){
+	char buf[1024], keyword[16], kind[16];
+	int line = 0;
+	FILE *f = fopen(path, "r");
+
+	memset(a, 0, sizeof(*a));
+	if(f == NULL){
+		perror(path);
+		return -1;
+	}
+	while(fgets(buf, sizeof(buf), f) != NULL){
+		animMove m;
+		animKey k;
+		float deg;
+		char extra;
+		line++;
+		if(sscanf(buf, " %15s", keyword) != 1 || keyword[0] == '#') continue;
+
+		if(strcmp(keyword, "frames") == 0){
+			if(sscanf(buf, " frames %d %c", &a->frames, &extra) != 1 || a->frames < 1){
+				fprintf(stderr, "%s:%d: frames needs a positive count\n", path, line);
+				goto fail;
+			}
+			continue;
+		}
+		if(strcmp(keyword, "key") == 0){
+			memset(&k, 0, sizeof(k));
+			if(sscanf(buf, " key %d %15s", &k.frame, kind) != 2 || k.frame < 0 ||
+					(k.kind = animKind(kind)) < 0){
+				fprintf(stderr, "%s:%d: key needs a frame and sphere, box, light or camera\n",
+					path, line);
+				goto fail;
+			}
+			if(k.kind == ANIM_CAMERA ? sscanf(buf, " %*s %*d %*s %f %f %f %f %f %f %c", &k.pos.x,
+					&k.pos.y, &k.pos.z, &k.at.x, &k.at.y, &k.at.z, &extra) != 6 :
+					sscanf(buf, " %*s %*d %*s %d %f %f %f %c", &k.index, &k.pos.x, &k.pos.y,
+					&k.pos.z, &extra) != 4 || k.index < 0){
+				fprintf(stderr, "%s:%d: a key of the %s needs %s\n", path, line, kind,
+					k.kind == ANIM_CAMERA ? "ex ey ez lx ly lz" : "an index and x y z");
+				goto fail;
+			}
+			animKey *keys = realloc(a->keys, (a->nkeys + 1) * sizeof(animKey));
+			if(keys == NULL){
+				fprintf(stderr, "%s: out of memory\n", path);
+				goto fail;
+			}
+			a->keys = keys;
+			a->keys[a->nkeys++] = k;
+			continue;
+		}
+		memset(&m, 0, sizeof(m));
+		if(strcmp(keyword, "turn") == 0){
+			if(sscanf(buf, " turn %15s %d %f %f %f %f %f %f %f %c", kind, &m.index, &m.centre.x,
+					&m.centre.y, &m.centre.z, &m.axis.x, &m.axis.y, &m.axis.z, &deg, &extra) != 9 ||
+					(m.kind = animKind(kind)) < 0 || m.kind == ANIM_CAMERA || m.index < 0 ||
+					vectorDot(&m.axis, &m.axis) == 0){
+				fprintf(stderr, "%s:%d: turn needs sphere, box or light, an index, cx cy cz, "
+					"an axis ax ay az and degrees\n", path, line);
+				goto fail;
+			}
+			m.turn = true;
+			m.axis = vectorNormalize(&m.axis);
+			m.cosA = cosf(deg * (float)M_PI / 180);
+			m.sinA = sinf(deg * (float)M_PI / 180);
+		}else{
+			m.kind = animKind(keyword);
+			if(m.kind < 0 || m.kind == ANIM_CAMERA){
+				fprintf(stderr, "%s:%d: unknown keyword\n", path, line);
+				goto fail;
+			}
+			if(sscanf(buf, " %*s %d %f %f %f %c", &m.index, &m.step.x, &m.step.y, &m.step.z,
+					&extra) != 4 || m.index < 0){
+				fprintf(stderr, "%s:%d: %s needs an index and dx dy dz\n", path, line, keyword);
+				goto fail;
+			}
+		}
+		animMove *moves = realloc(a->moves, (a->nmoves + 1) * sizeof(animMove));
+		if(moves == NULL){
+			fprintf(stderr, "%s: out of memory\n", path);
+			goto fail;
+		}
+		a->moves = moves;
+		a->moves[a->nmoves++] = m;
+	}
+	if(ferror(f)){
+		perror(path);
+		goto fail;
+	}
+	if(a->frames == 0){
+		fprintf(stderr, "%s: no frames line\n", path);
+		goto fail;
+	}
+	qsort(a->keys, a->nkeys, sizeof(animKey), animKeyOrder);
+	fclose(f);
+	return 0;
+
+fail:
+	fclose(f);
+	free(a->moves);
+	free(a->keys);
+	a->moves = NULL;
+	a->keys = NULL;
+	return -1;
+}
+
+/* Check that everything the animation moves is in the scene, and that
+ * nothing with keys is moved as well
+ */
+static int animCheck(animation *a, char *path, int nspheres, int nboxes, int nlights){
+	int i, j;
+
+	for(i = 0; i < a->nmoves + a->nkeys; i++){
+		int kind = i < a->nmoves ? a->moves[i].kind : a->keys[i - a->nmoves].kind;
+		int index = i < a->nmoves ? a->moves[i].index : a->keys[i - a->nmoves].index;
+		int n = kind == ANIM_SPHERE ? nspheres : (kind == ANIM_BOX ? nboxes : nlights);
+		if(kind != ANIM_CAMERA && index >= n){
+			fprintf(stderr, "%s: the scene has no %s %d\n", path, animKindNames[kind], index);
+			return -1;
+		}
+	}
+	for(i = 0; i < a->nmoves; i++)
+		for(j = 0; j < a->nkeys; j++)
+			if(a->keys[j].kind == a->moves[i].kind && a->keys[j].index == a->moves[i].index){
+				fprintf(stderr, "%s: %s %d has keys and is moved as well\n", path,
+					animKindNames[a->moves[i].kind], a->moves[i].index);
+				return -1;
+			}
+	return 0;
+}
+
+/* Where the keys k[0] to k[n - 1] of one thing put it on frame f */
+static void animKeyAt(animKey *k, int n, int f, vector *pos, vector *at){
+	int i;
+
+	for(i = 0; i < n - 1 && k[i + 1].frame <= f; i++)
+		;
+	if(i == n - 1 || f <= k[i].frame){
+		*pos = k[i].pos;
+		*at = k[i].at;
+		return;
+	}
+	float u = (float)(f - k[i].frame) / (k[i + 1].frame - k[i].frame);
+	vector dp = vectorSub(&k[i + 1].pos, &k[i].pos), da = vectorSub(&k[i + 1].at, &k[i].at);
+	dp = vectorScale(u, &dp);
+	da = vectorScale(u, &da);
+	*pos = vectorAdd(&k[i].pos, &dp);
+	*at = vectorAdd(&k[i].at, &da);
+}
+
+/* Put what has keys where they say it is on frame f, and if f is not
+ * the first frame move and turn everything else on by one frame
+ */
+static void animStep(animation *a, int f, sphere *spheres, box *boxes, light *lights){
+	int i, n;
+
+	for(i = 0; f > 0 && i < a->nmoves; i++){
+		animMove *m = &a->moves[i];
+		vector *p = m->kind == ANIM_SPHERE ? &spheres[m->index].pos :
+			m->kind == ANIM_LIGHT ? &lights[m->index].pos : NULL;
+		vector d = m->step;
+		if(p != NULL){
+			*p = m->turn ? animTurn(m, p) : vectorAdd(p, &d);
+			continue;
+		}
+		box *b = &boxes[m->index];
+		if(m->turn){
+			vector c = {(b->min.x + b->max.x) / 2, (b->min.y + b->max.y) / 2, (b->min.z + b->max.z) / 2};
+			vector t = animTurn(m, &c);
+			d = vectorSub(&t, &c);
+		}
+		b->min = vectorAdd(&b->min, &d);
+		b->max = vectorAdd(&b->max, &d);
+	}
+	for(i = 0; i < a->nkeys; i += n){
+		animKey *k = &a->keys[i];
+		vector pos, at;
+		for(n = 1; i + n < a->nkeys && k[n].kind == k->kind && k[n].index == k->index; n++)
+			;
+		animKeyAt(k, n, f, &pos, &at);
+		if(k->kind == ANIM_SPHERE)
+			spheres[k->index].pos = pos;
+		else if(k->kind == ANIM_LIGHT)
+			lights[k->index].pos = pos;
+		else if(k->kind == ANIM_BOX){
+			box *b = &boxes[k->index];
+			vector c = {(b->min.x + b->max.x) / 2, (b->min.y + b->max.y) / 2, (b->min.z + b->max.z) / 2};
+			vector d = vectorSub(&pos, &c);
+			b->min = vectorAdd(&b->min, &d);
+			b->max = vectorAdd(&b->max, &d);
+		}
+	}
+}
+
+/* Where the camera is and looks on frame f. Returns false if it has no
+ * keys and stays as the command line put it.
+ */
+static bool animCamera(animation *a, int f, vector *eye, vector *at){
+	int i, n;
+
+	for(i = 0; i < a->nkeys && a->keys[i].kind != ANIM_CAMERA; i++)
+		;
+	for(n = 0; i + n < a->nkeys && a->keys[i + n].kind == ANIM_CAMERA; n++)
+		;
+	if(n == 0) return false;
+	animKeyAt(&a->keys[i], n, f, eye, at);
+	return true;
+}
+
+/* Does the animation move any light? */
+static bool animMovesLights(animation *a){
+	int i;
+
+	for(i = 0; i < a->nmoves; i++)
+		if(a->moves[i].kind == ANIM_LIGHT)
+			return true;
+	for(i = 0; i < a->nkeys; i++)
+		if(a->keys[i].kind == ANIM_LIGHT)
+			return true;
+	return false;
+}
+
+static void animFree(animation *a){
+	free(a->moves);
+	free(a->keys);
+}
+
+#endif
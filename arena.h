@@ -0,0 +1,179 @@
+/* Arena allocator.
+ *
+ * An arena hands out memory by moving a pointer through large blocks
+ * taken from the system with mmap(), and frees it all at once: reset
+ * goes back to the start in O(1) and keeps the blocks, so whatever is
+ * built again in the arena reuses memory whose pages are already
+ * mapped. Things that live and die together go in the same arena: the
+ * scene, the BVH and what is laid out in its order, the light grid, the
+ * scratch of one render thread.
+ *
+ * Every allocation is aligned to a cache line, so arrays in different
+ * arenas, or of different threads, never share one. Blocks double in
+ * size as an arena grows, and an allocation larger than the next block
+ * gets one of its own; blocks of ARENA_HUGE or more are aligned to it
+ * and advised to be backed by huge pages, which takes the TLB misses out
+ * of walking big arrays. The most an arena ever held is kept for
+ * arenaPrint().
+ *
+ * An arena is not locked: one thread allocates from it at a time.
+ */
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+
+/* Alignment of every allocation */
+#define ARENA_ALIGN 64
+
+/* Size of the first block unless arenaInit() is given one */
+#define ARENA_BLOCK (64 << 10)
+
+/* Blocks of this size or more get huge pages where the system has them */
+#define ARENA_HUGE (2 << 20)
+
+/* Doubling from ARENA_BLOCK, this many blocks hold more than any machine */
+#define ARENA_BLOCKS 48
+
+typedef struct{
+	const char *name;
+	char *blocks[ARENA_BLOCKS];
+	size_t sizes[ARENA_BLOCKS];
+	int nblocks;		/* mapped */
+	int current;		/* block being allocated from */
+	size_t used;		/* bytes of it taken */
+	size_t bytes;		/* taken in all blocks */
+	size_t peak;		/* most bytes ever taken */
+	size_t mapped;
+	int huge;		/* blocks advised to use huge pages */
+	size_t next;		/* size of the next block unless one is asked for */
+}__attribute__((aligned(64))) arena;
+
+/* Where an arena was, to go back to with arenaRelease() */
+typedef struct{
+	int block;
+	size_t used;
+	size_t bytes;
+}arenaMark;
+
+/* Set up an empty arena, its first block will be at least first bytes */
+static void arenaInit(arena *a, const char *name, size_t first){
+	memset(a, 0, sizeof(*a));
+	a->name = name;
+	a->next = first > 0 ? first : ARENA_BLOCK;
+}
+
+/* Map a block of at least size bytes, aligned to ARENA_HUGE if it is
+ * that large. Returns NULL if there is no memory.
+ */
+static char *arenaMap(size_t size, bool *huge){
+	*huge = false;
+	if(size < ARENA_HUGE){
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		return p == MAP_FAILED ? NULL : p;
+	}
+	/* Map a huge page more and cut off what is outside the alignment */
+	char *p = mmap(NULL, size + ARENA_HUGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p == MAP_FAILED) return NULL;
+	char *start = (char *)(((uintptr_t)p + ARENA_HUGE - 1) & ~(uintptr_t)(ARENA_HUGE - 1));
+	if(start > p) munmap(p, start - p);
+	munmap(start + size, p + ARENA_HUGE - start);
+#ifdef MADV_HUGEPAGE
+	*huge = madvise(start, size, MADV_HUGEPAGE) == 0;
+#endif
+	return start;
+}
+
+/* size bytes aligned to ARENA_ALIGN, NULL if there is no memory. The
+ * memory is not cleared.
+ */
+static void *arenaAlloc(arena *a, size_t size){
+	size = (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if(size == 0) size = ARENA_ALIGN;
+	if(a->current >= a->nblocks || a->used + size > a->sizes[a->current]){
+		/* Go on to the next block that is large enough, or map one */
+		int b = a->current < a->nblocks ? a->current + 1 : a->current;
+		while(b < a->nblocks && a->sizes[b] < size) b++;
+		if(b == a->nblocks){
+			if(b == ARENA_BLOCKS) return NULL;
+			/* A request larger than the next block gets a block of
+			 * its own, which does not change how the others grow
+			 */
+			size_t want = a->next;
+			if(want < size) want = size;
+			else a->next *= 2;
+			if(want >= ARENA_HUGE) want = (want + ARENA_HUGE - 1) / ARENA_HUGE * ARENA_HUGE;
+			bool huge;
+			char *p = arenaMap(want, &huge);
+			if(p == NULL) return NULL;
+			a->blocks[b] = p;
+			a->sizes[b] = want;
+			a->mapped += want;
+			a->huge += huge;
+			a->nblocks++;
+		}
+		a->current = b;
+		a->used = 0;
+	}
+	void *p = a->blocks[a->current] + a->used;
+	a->used += size;
+	a->bytes += size;
+	if(a->bytes > a->peak) a->peak = a->bytes;
+	return p;
+}
+
+/* Like arenaAlloc(), cleared to zero */
+static void *arenaCalloc(arena *a, size_t size){
+	void *p = arenaAlloc(a, size);
+	if(p != NULL) memset(p, 0, size);
+	return p;
+}
+
+static arenaMark arenaGetMark(arena *a){
+	arenaMark m = {a->current, a->used, a->bytes};
+	return m;
+}
+
+/* Free everything allocated since m was taken */
+static void arenaRelease(arena *a, arenaMark m){
+	a->current = m.block;
+	a->used = m.used;
+	a->bytes = m.bytes;
+}
+
+/* Make p, the last allocation of the arena, size bytes long */
+static void arenaShrink(arena *a, void *p, size_t size){
+	size_t end = (char *)p - a->blocks[a->current] + (size + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+	if(end < a->used){
+		a->bytes -= a->used - end;
+		a->used = end;
+	}
+}
+
+/* Free everything, keeping the blocks for what comes next */
+static void arenaReset(arena *a){
+	a->current = 0;
+	a->used = 0;
+	a->bytes = 0;
+}
+
+/* Give the blocks back to the system */
+static void arenaFree(arena *a){
+	int i;
+	for(i = 0; i < a->nblocks; i++)
+		munmap(a->blocks[i], a->sizes[i]);
+	a->nblocks = 0;
+	arenaReset(a);
+}
+
+static inline void arenaPrint(FILE *f, arena *a){
+	fprintf(f, "arena %s: %.1f kB at most, %.1f kB mapped in %d blocks, %d with huge pages\n",
+		a->name, a->peak / 1024.0, a->mapped / 1024.0, a->nblocks, a->huge);
+}
+
+#endif
@@ -0,0 +1,473 @@
+/* Micro-benchmarks for the hot kernels of the renderers
+ *
+ * Every benchmark runs one kernel over a seeded random set of rays and
+ * primitives, so runs on the same machine see the same work. After some
+ * warmup batches each repetition times one batch; the spread over the
+ * repetitions is reported as percentiles of ns per operation. The result
+ * is JSON on stdout so runs can be compared by a script:
+ *
+ *	gcc -O2 -o bench bench.c -lm
+ *	./bench [--reps N] [--warmup N] [--size N] [--seed N] [--filter TEXT]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "geometry.h"
+#include "bvh.h"
+#include "packet.h"
+
+/* Spheres a packet is tested against in the packet benchmarks */
+#define BENCH_PACKET_SPHERES 64
+
+/* Spheres in the scene of the BVH benchmark */
+#define BENCH_BVH_SPHERES 10000
+
+/* The random inputs, shared by all benchmarks */
+typedef struct{
+	int size;		/* operations per batch */
+	vector *a, *b;
+	ray *rays;
+	sphere *spheres;
+	box *boxes;
+	vector *inverses;	/* rayInverse() of rays */
+	vector *normals;
+	material *materials;
+	light lights[3];
+	sphereSoA soa;
+	arena soaMem;		/* the arrays of soa */
+	rayPacket *packets;
+	packetKernel *kernel;
+	bvh accel;
+	sphere *scene;
+	mesh tris;		/* MESH_LANES unconnected triangles per operation */
+}benchData;
+
+/* Run one batch of d->size operations. The result depends on every
+ * operation so the compiler cannot drop any of them.
+ */
+typedef float benchFunc(benchData *d);
+
+typedef struct{
+	char *name;
+	benchFunc *run;
+	int raysPerOp;		/* 0 if the kernel traces no rays */
+	char *kernel;		/* packet kernel for packetSelect(), or NULL */
+}benchmark;
+
+float benchVectorDot(benchData *d){
+	float sum = 0;
+	int i;
+	for(i = 0; i < d->size; i++)
+		sum += vectorDot(&d->a[i], &d->b[i]);
+	return sum;
+}
+
+float benchVectorSub(benchData *d){
+	vector sum = {0, 0, 0};
+	int i;
+	for(i = 0; i < d->size; i++){
+		vector v = vectorSub(&d->a[i], &d->b[i]);
+		sum = vectorAdd(&sum, &v);
+	}
+	return sum.x + sum.y + sum.z;
+}
+
+float benchVectorScale(benchData *d){
+	vector sum = {0, 0, 0};
+	int i;
+	for(i = 0; i < d->size; i++){
+		vector v = vectorScale(d->b[i].x, &d->a[i]);
+		sum = vectorSub(&sum, &v);
+	}
+	return sum.x + sum.y + sum.z;
+}
+
+float benchVectorAdd(benchData *d){
+	vector sum = {0, 0, 0};
+	int i;
+	for(i = 0; i < d->size; i++){
+		vector v = vectorAdd(&d->a[i], &d->b[i]);
+		sum = vectorSub(&v, &sum);
+	}
+	return sum.x + sum.y + sum.z;
+}
+
+float benchRaySphere(benchData *d){
+	float sum = 0;
+	int i;
+	for(i = 0; i < d->size; i++){
+		float t = 20000.0f;
+		if(intersectRaySphere(&d->rays[i], &d->spheres[i], &t))
+			sum += t;
+	}
+	return sum;
+}
+
+float benchRayBox(benchData *d){
+	float sum = 0;
+	int i;
+	for(i = 0; i < d->size; i++){
+		float t = 20000.0f;
+		if(intersectRayBox(&d->rays[i], &d->inverses[i], &d->boxes[i], &t))
+			sum += t;
+	}
+	return sum;
+}
+
+float benchLambert(benchData *d){
+	colour c = {0, 0, 0};
+	int i;
+	for(i = 0; i < d->size; i++)
+		shadeLambert(d->lights, 3, &d->a[i], &d->normals[i], &d->materials[i % 3], 1.0f, &c,
+			NULL, NULL);
+	return c.red + c.green + c.blue;
+}
+
+/* One packet of 8 rays against BENCH_PACKET_SPHERES spheres per operation */
+float benchPacket(benchData *d){
+	float sum = 0;
+	int i, k;
+	for(i = 0; i < d->size; i++){
+		packetHit h;
+		packetHitInit(&h);
+		d->kernel(&d->soa, 0, d->soa.count, &d->packets[i % 1024], &h);
+		for(k = 0; k < PACKET_SIZE; k++)
+			sum += h.t[k];
+	}
+	return sum;
+}
+
+/* The closest of BENCH_BVH_SPHERES spheres through the BVH */
+float benchBvh(benchData *d){
+	float sum = 0;
+	long tests = 0;
+	int i;
+	for(i = 0; i < d->size; i++){
+		float t = 20000.0f;
+		if(bvhClosestHit(&d->accel, d->scene, NULL, NULL, NULL, &d->rays[i], &t, &tests) >= 0)
+			sum += t;
+	}
+	return sum;
+}
+
+/* MESH_LANES triangles one at a time */
+float benchTriangle(benchData *d){
+	float sum = 0;
+	int i, j;
+	for(i = 0; i < d->size; i++){
+		meshRay m;
+		meshRaySetup(&d->rays[i], &m);
+		for(j = 0; j < MESH_LANES; j++){
+			float t = meshTest(&d->tris, MESH_LANES * i + j, &m, 20000.0f);
+			if(t < INFINITY) sum += t;
+		}
+	}
+	return sum;
+}
+
+/* The same MESH_LANES triangles at once */
+float benchTriangle4(benchData *d){
+	float sum = 0;
+	int i, j;
+	for(i = 0; i < d->size; i++){
+		int tris[MESH_LANES];
+		float t[MESH_LANES];
+		meshRay m;
+		meshRaySetup(&d->rays[i], &m);
+		for(j = 0; j < MESH_LANES; j++)
+			tris[j] = MESH_LANES * i + j;
+		meshTest4(&d->tris, tris, MESH_LANES, &m, 20000.0f, t);
+		for(j = 0; j < MESH_LANES; j++)
+			if(t[j] < INFINITY) sum += t[j];
+	}
+	return sum;
+}
+
+float randomFloat(unsigned int *seed, float lo, float hi){
+	return lo + (hi - lo) * rand_r(seed) / RAND_MAX;
+}
+
+vector randomVector(unsigned int *seed, float lo, float hi){
+	vector v;
+	v.x = randomFloat(seed, lo, hi);
+	v.y = randomFloat(seed, lo, hi);
+	v.z = randomFloat(seed, lo, hi);
+	return v;
+}
+
+/* A ray from the image plane z = -2000 towards a point of the scene, so
+ * about half of them hit the primitive they are paired with
+ */
+ray randomRay(unsigned int *seed){
+	ray r;
+	r.start.x = randomFloat(seed, 0, 1000);
+	r.start.y = randomFloat(seed, 0, 1000);
+	r.start.z = -2000;
+	vector to = randomVector(seed, 0, 1000);
+	r.dir = vectorSub(&to, &r.start);
+	float len = sqrtf(vectorDot(&r.dir, &r.dir));
+	r.dir = vectorScale(1.0f / len, &r.dir);
+	return r;
+}
+
+void *benchAlloc(size_t n){
+	void *p = malloc(n);
+	if(p == NULL){
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+void benchSetup(benchData *d, int size, unsigned int seed){
+	int i, k;
+
+	d->size = size;
+	d->a = benchAlloc(size * sizeof(vector));
+	d->b = benchAlloc(size * sizeof(vector));
+	d->normals = benchAlloc(size * sizeof(vector));
+	d->rays = benchAlloc(size * sizeof(ray));
+	d->spheres = benchAlloc(size * sizeof(sphere));
+	d->inverses = benchAlloc(size * sizeof(vector));
+	d->boxes = benchAlloc(size * sizeof(box));
+	d->tris.ntris = MESH_LANES * size;
+	d->tris.nverts = 3 * d->tris.ntris;
+	d->tris.tris = benchAlloc(d->tris.nverts * sizeof(int));
+	d->tris.verts = benchAlloc((d->tris.nverts + 1) * sizeof(vector));
+	for(i = 0; i < size; i++){
+		d->a[i] = randomVector(&seed, -1000, 1000);
+		d->b[i] = randomVector(&seed, -1000, 1000);
+
+		vector n = randomVector(&seed, -1, 1);
+		float len = sqrtf(vectorDot(&n, &n));
+		d->normals[i] = len > 0 ? vectorScale(1.0f / len, &n) : (vector){0, 0, -1};
+
+		d->rays[i] = randomRay(&seed);
+		d->inverses[i] = rayInverse(&d->rays[i].dir);
+
+		d->spheres[i].pos = randomVector(&seed, 0, 1000);
+		d->spheres[i].radius = randomFloat(&seed, 50, 250);
+		d->spheres[i].material = 0;
+
+		vector pos = randomVector(&seed, 0, 1000);
+		float length = randomFloat(&seed, 100, 500);
+		float width = randomFloat(&seed, 100, 500);
+		float height = randomFloat(&seed, 100, 500);
+		d->boxes[i] = boxFromCube(&pos, length, width, height, 0);
+
+		/* Triangles of about the size of the spheres */
+		for(k = 0; k < MESH_LANES; k++){
+			int v = 3 * (MESH_LANES * i + k), j;
+			vector centre = randomVector(&seed, 0, 1000);
+			for(j = 0; j < 3; j++){
+				vector corner = randomVector(&seed, -250, 250);
+				d->tris.verts[v + j] = vectorAdd(&centre, &corner);
+				d->tris.tris[v + j] = v + j;
+			}
+		}
+	}
+
+	d->materials = benchAlloc(3 * sizeof(material));
+	for(i = 0; i < 3; i++){
+		d->materials[i].diffuse.red = randomFloat(&seed, 0, 1);
+		d->materials[i].diffuse.green = randomFloat(&seed, 0, 1);
+		d->materials[i].diffuse.blue = randomFloat(&seed, 0, 1);
+		d->materials[i].reflection = randomFloat(&seed, 0, 1);
+		d->lights[i].pos = randomVector(&seed, -3000, 3000);
+		d->lights[i].intensity.red = randomFloat(&seed, 0, 1);
+		d->lights[i].intensity.green = randomFloat(&seed, 0, 1);
+		d->lights[i].intensity.blue = randomFloat(&seed, 0, 1);
+		d->lights[i].radius = 0;
+	}
+
+	arenaInit(&d->soaMem, "soa", 0);
+	soaInit(&d->soa, BENCH_PACKET_SPHERES, &d->soaMem);
+	for(i = 0; i < BENCH_PACKET_SPHERES; i++){
+		d->soa.x[i] = d->spheres[i % size].pos.x;
+		d->soa.y[i] = d->spheres[i % size].pos.y;
+		d->soa.z[i] = d->spheres[i % size].pos.z;
+		d->soa.radius[i] = d->spheres[i % size].radius / 4;
+		d->soa.id[i] = i;
+	}
+
+	/* Packets of neighbouring primary rays, as the renderer makes them */
+	d->packets = aligned_alloc(32, 1024 * sizeof(rayPacket));
+	if(d->packets == NULL){
+		fprintf(stderr, "bench: out of memory\n");
+		exit(1);
+	}
+	for(i = 0; i < 1024; i++){
+		float x = randomFloat(&seed, 0, 1000), y = randomFloat(&seed, 0, 1000);
+		rayPacket *p = &d->packets[i];
+		p->count = PACKET_SIZE;
+		for(k = 0; k < PACKET_SIZE; k++){
+			p->ox[k] = x + k;
+			p->oy[k] = y;
+			p->oz[k] = -2000;
+			p->dx[k] = 0;
+			p->dy[k] = 0;
+			p->dz[k] = 1;
+		}
+	}
+
+	d->scene = benchAlloc(BENCH_BVH_SPHERES * sizeof(sphere));
+	for(i = 0; i < BENCH_BVH_SPHERES; i++){
+		d->scene[i].pos = randomVector(&seed, 0, 1000);
+		d->scene[i].radius = randomFloat(&seed, 2, 8);
+		d->scene[i].material = 0;
+	}
+	vector viewLo = {0, 0, -2000}, viewHi = {1000, 1000, -2000};
+	bvhBuild(&d->accel, d->scene, BENCH_BVH_SPHERES, NULL, 0, NULL, NULL, &viewLo, &viewHi);
+}
+
+void benchFree(benchData *d){
+	free(d->a);
+	free(d->b);
+	free(d->normals);
+	free(d->rays);
+	free(d->spheres);
+	free(d->inverses);
+	free(d->boxes);
+	meshFree(&d->tris);
+	free(d->materials);
+	arenaFree(&d->soaMem);
+	free(d->packets);
+	free(d->scene);
+	bvhFree(&d->accel);
+}
+
+int compareDouble(const void *a, const void *b){
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted values */
+double percentile(double *sorted, int n, double p){
+	int rank = (int)ceil(p / 100 * n);
+	if(rank < 1) rank = 1;
+	return sorted[rank - 1];
+}
+
+double now(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+volatile float benchSink;
+
+/* Time one benchmark and print its JSON object */
+void benchRun(benchmark *b, benchData *d, int warmup, int reps, double *ns, int first){
+	int i;
+	double total = 0;
+
+	for(i = 0; i < warmup; i++)
+		benchSink += b->run(d);
+	for(i = 0; i < reps; i++){
+		double start = now();
+		benchSink += b->run(d);
+		ns[i] = (now() - start) / d->size;
+		total += ns[i];
+	}
+	qsort(ns, reps, sizeof(double), compareDouble);
+
+	double p50 = percentile(ns, reps, 50);
+	printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"ns_per_op\": {\"min\": %.3f, \"p50\": %.3f, "
+		"\"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f, \"mean\": %.3f}, \"ops_per_sec\": %.0f",
+		first ? "" : ",", b->name, d->size, ns[0], p50, percentile(ns, reps, 90),
+		percentile(ns, reps, 99), ns[reps - 1], total / reps, 1e9 / p50);
+	if(b->raysPerOp > 0)
+		printf(", \"rays_per_sec\": %.0f", 1e9 / p50 * b->raysPerOp);
+	printf("}");
+}
+
+void usage(char *prog){
+	fprintf(stderr, "usage: %s [--reps N] [--warmup N] [--size N] [--seed N] [--filter TEXT]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+	int reps = 51;
+	int warmup = 5;
+	int size = 1 << 14;
+	unsigned int seed = 12345;
+	char *filter = NULL;
+
+	static struct option options[] = {
+		{"reps", required_argument, NULL, 'n'},
+		{"warmup", required_argument, NULL, 'w'},
+		{"size", required_argument, NULL, 'z'},
+		{"seed", required_argument, NULL, 'S'},
+		{"filter", required_argument, NULL, 'f'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt;
+	while((opt = getopt_long(argc, argv, "n:w:z:S:f:", options, NULL)) != -1){
+		switch(opt){
+		case 'n':
+			reps = atoi(optarg);
+			break;
+		case 'w':
+			warmup = atoi(optarg);
+			break;
+		case 'z':
+			size = atoi(optarg);
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 10);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(reps < 1 || warmup < 0 || size < 1) usage(argv[0]);
+
+	benchmark benchmarks[] = {
+		{"vectorDot", benchVectorDot, 0, NULL},
+		{"vectorSub", benchVectorSub, 0, NULL},
+		{"vectorScale", benchVectorScale, 0, NULL},
+		{"vectorAdd", benchVectorAdd, 0, NULL},
+		{"intersectRaySphere", benchRaySphere, 1, NULL},
+		{"intersectRayBox", benchRayBox, 1, NULL},
+		{"meshTest/4 triangles", benchTriangle, 1, NULL},
+		{"meshTest4/4 triangles", benchTriangle4, 1, NULL},
+		{"shadeLambert/3 lights", benchLambert, 0, NULL},
+		{"intersectPacketScalar/64 spheres", benchPacket, PACKET_SIZE, "scalar"},
+		{"intersectPacketSSE/64 spheres", benchPacket, PACKET_SIZE, "sse"},
+		{"intersectPacketAVX2/64 spheres", benchPacket, PACKET_SIZE, "avx2"},
+		{"bvhClosestHit/10000 spheres", benchBvh, 1, NULL},
+	};
+	int nbench = sizeof(benchmarks) / sizeof(benchmarks[0]);
+
+	benchData d;
+	benchSetup(&d, size, seed);
+	double *ns = benchAlloc(reps * sizeof(double));
+
+	printf("{\n  \"seed\": %u, \"reps\": %d, \"warmup\": %d, \"size\": %d,\n  \"benchmarks\": [",
+		seed, reps, warmup, size);
+	int i, first = 1;
+	for(i = 0; i < nbench; i++){
+		benchmark *b = &benchmarks[i];
+		if(filter != NULL && strstr(b->name, filter) == NULL) continue;
+
+		/* Kernels this CPU does not have are left out */
+		if(b->kernel != NULL){
+			d.kernel = packetSelect(b->kernel, NULL);
+			if(d.kernel == NULL) continue;
+		}
+		benchRun(b, &d, warmup, reps, ns, first);
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+
+	free(ns);
+	benchFree(&d);
+	return 0;
+}
@@ -0,0 +1,700 @@
+/* Bounding volume hierarchy over spheres, boxes, triangles and instances.
+ *
+ * The tree is built with the surface area heuristic evaluated over a
+ * fixed number of bins per axis, then stored as a flat array of 32 byte
+ * nodes. The two children of a node are always stored next to each other
+ * starting at an even index, and the array is 64 byte aligned, so both
+ * children share one cache line and are fetched together when the parent
+ * is visited. Node 1 is never used to get that alignment.
+ *
+ * Primitives are named by a reference that packs their kind and their
+ * index in the scene arrays. References sort like the brute force scan
+ * visits primitives (all spheres, then all boxes, then all triangles,
+ * then all instances), which is what makes ties between equally distant
+ * hits come out the same as the scan.
+ */
+#ifndef BVH_H
+#define BVH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+#include <time.h>
+
+#include "geometry.h"
+#include "arena.h"
+#include "mesh.h"
+
+/* Kinds of primitives */
+#define PRIM_SPHERE 0
+#define PRIM_BOX 1
+#define PRIM_TRIANGLE 2
+#define PRIM_INSTANCE 3
+#define PRIM_KINDS 4
+
+#define PRIM_INDEX_BITS 28
+#define PRIM_REF(kind, index) (((kind) << PRIM_INDEX_BITS) | (index))
+#define PRIM_KIND(ref) ((ref) >> PRIM_INDEX_BITS)
+#define PRIM_INDEX(ref) ((ref) & ((1 << PRIM_INDEX_BITS) - 1))
+
+/* Triangles of the mesh, 0 for none */
+#define MESH_TRIS(m) ((m) != NULL ? (m)->ntris : 0)
+
+/* Instances of the scene, 0 for none. instance.h, which is included at
+ * the end, defines what a BVH needs to trace into them.
+ */
+typedef struct instanceSet instanceSet;
+static inline int instanceCount(instanceSet *set);
+static inline void instanceGetBounds(instanceSet *set, int i, vector *lo, vector *hi);
+static inline void instanceClosestHit(instanceSet *set, int i, ray *r, vector *inv, float *t,
+		int *best, long *tests);
+static inline int instanceAnyHit(instanceSet *set, int i, ray *r, vector *inv, float tmax,
+		long *tests);
+static inline bool instanceBlocks(instanceSet *set, int ref, ray *r, vector *inv, float tmax);
+#define INSTANCES(set) ((set) != NULL ? instanceCount(set) : 0)
+
+/* Number of bins the SAH is evaluated over and the largest leaf we make */
+#define BVH_BINS 16
+#define BVH_MAX_LEAF 4
+
+/* Traversal stack depth. Deeper than BVH_SAH_DEPTH the builder stops
+ * using the SAH and halves the primitive range instead, which bounds the depth of
+ * the tree by BVH_SAH_DEPTH + 28 < BVH_STACK.
+ */
+#define BVH_STACK 64
+#define BVH_SAH_DEPTH 32
+
+/* Primitive bounds are padded so rounding never lets the slab test cull
+ * a hit that the intersection kernel reports. Boxes get BVH_PAD of their
+ * size and position. The sphere kernel solves a quadratic whose rounding
+ * error grows with the square of the distance to the ray origin, it can
+ * report hits up to about eps * reach^2 / radius outside the sphere, so
+ * spheres get BVH_SPHERE_PAD times that on top.
+ */
+#define BVH_PAD 1e-4f
+#define BVH_SPHERE_PAD 4.0f
+
+typedef struct{
+	vector min;
+	int first;	/* leaf: first entry in prims, interior: left child */
+	vector max;
+	int count;	/* number of primitives, 0 for interior nodes */
+}bvhNode;
+
+typedef struct{
+	bvhNode *nodes;	/* 64 byte aligned, root is node 0 */
+	int nnodes;	/* nodes in use, including the unused node 1 */
+	int *prims;	/* primitive references in leaf order */
+	int nprims;
+	double buildMs;
+	float cost;	/* bvhCost() when it was built */
+	arena mem;	/* nodes and prims, and whatever is laid out in their order */
+}bvh;
+
+/* Scratch data of the builder */
+typedef struct{
+	vector *lo, *hi, *centre;	/* per primitive, by reference slot */
+	int *idx;			/* slots in leaf order */
+	bvhNode *nodes;
+	int nnodes;
+}bvhBuilder;
+
+typedef struct{
+	vector lo, hi;
+	int count;
+}bvhBin;
+
+static inline void boundsEmpty(vector *lo, vector *hi){
+	lo->x = lo->y = lo->z = INFINITY;
+	hi->x = hi->y = hi->z = -INFINITY;
+}
+
+static inline void boundsGrow(vector *lo, vector *hi, vector *plo, vector *phi){
+	lo->x = fminf(lo->x, plo->x); hi->x = fmaxf(hi->x, phi->x);
+	lo->y = fminf(lo->y, plo->y); hi->y = fmaxf(hi->y, phi->y);
+	lo->z = fminf(lo->z, plo->z); hi->z = fmaxf(hi->z, phi->z);
+}
+
+static inline float boundsArea(vector *lo, vector *hi){
+	float dx = hi->x - lo->x, dy = hi->y - lo->y, dz = hi->z - lo->z;
+	if(dx < 0 || dy < 0 || dz < 0) return 0;
+	return 2 * (dx * dy + dy * dz + dz * dx);
+}
+
+static inline float vectorAxis(vector *v, int axis){
+	return axis == 0 ? v->x : (axis == 1 ? v->y : v->z);
+}
+
+/* The reference of primitive slot i of a scene, which counts spheres,
+ * then boxes, then triangles, and back
+ */
+static inline int bvhSlotRef(int i, int nspheres, int nboxes, int ntris){
+	if(i < nspheres) return PRIM_REF(PRIM_SPHERE, i);
+	if(i < nspheres + nboxes) return PRIM_REF(PRIM_BOX, i - nspheres);
+	if(i < nspheres + nboxes + ntris) return PRIM_REF(PRIM_TRIANGLE, i - nspheres - nboxes);
+	return PRIM_REF(PRIM_INSTANCE, i - nspheres - nboxes - ntris);
+}
+
+static inline int bvhRefSlot(int ref, int nspheres, int nboxes, int ntris){
+	int kind = PRIM_KIND(ref);
+	return PRIM_INDEX(ref) + (kind > PRIM_SPHERE ? nspheres : 0) + (kind > PRIM_BOX ? nboxes : 0) +
+		(kind > PRIM_TRIANGLE ? ntris : 0);
+}
+
+/* Pad a primitive's bounds by at least extra, see BVH_PAD */
+static void bvhPad(vector *lo, vector *hi, float extra){
+	float px = BVH_PAD * (fabsf(lo->x) + fabsf(hi->x) + (hi->x - lo->x)) + extra;
+	float py = BVH_PAD * (fabsf(lo->y) + fabsf(hi->y) + (hi->y - lo->y)) + extra;
+	float pz = BVH_PAD * (fabsf(lo->z) + fabsf(hi->z) + (hi->z - lo->z)) + extra;
+	lo->x -= px; lo->y -= py; lo->z -= pz;
+	hi->x += px; hi->y += py; hi->z += pz;
+}
+
+/* Build node from the slots idx[start..end), recursing into its children */
+static void bvhMakeNode(bvhBuilder *bb, int node, int start, int end, int depth){
+	bvhNode *n = &bb->nodes[node];
+	vector clo, chi;
+	int i, axis, b;
+	int count = end - start;
+
+	boundsEmpty(&n->min, &n->max);
+	boundsEmpty(&clo, &chi);
+	for(i = start; i < end; i++){
+		int k = bb->idx[i];
+		boundsGrow(&n->min, &n->max, &bb->lo[k], &bb->hi[k]);
+		boundsGrow(&clo, &chi, &bb->centre[k], &bb->centre[k]);
+	}
+
+	n->first = start;
+	n->count = count;
+	if(count == 1) return;
+
+	/* Find the cheapest split over all axes and bin boundaries */
+	float leafCost = (float)count;
+	float bestCost = INFINITY;
+	int bestAxis = -1, bestBin = 0;
+	float parentArea = boundsArea(&n->min, &n->max);
+
+	for(axis = 0; axis < 3 && depth < BVH_SAH_DEPTH; axis++){
+		float cmin = vectorAxis(&clo, axis), cmax = vectorAxis(&chi, axis);
+		if(cmax <= cmin) continue;
+
+		bvhBin bins[BVH_BINS];
+		for(b = 0; b < BVH_BINS; b++){
+			boundsEmpty(&bins[b].lo, &bins[b].hi);
+			bins[b].count = 0;
+		}
+		float scale = BVH_BINS / (cmax - cmin);
+		for(i = start; i < end; i++){
+			int k = bb->idx[i];
+			b = (int)((vectorAxis(&bb->centre[k], axis) - cmin) * scale);
+			if(b >= BVH_BINS) b = BVH_BINS - 1;
+			bins[b].count++;
+			boundsGrow(&bins[b].lo, &bins[b].hi, &bb->lo[k], &bb->hi[k]);
+		}
+
+		/* Sweep from the right to get the cost of every right side */
+		float rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		vector lo, hi;
+		int c = 0;
+		boundsEmpty(&lo, &hi);
+		for(b = BVH_BINS - 1; b > 0; b--){
+			boundsGrow(&lo, &hi, &bins[b].lo, &bins[b].hi);
+			c += bins[b].count;
+			rightArea[b] = boundsArea(&lo, &hi);
+			rightCount[b] = c;
+		}
+
+		c = 0;
+		boundsEmpty(&lo, &hi);
+		for(b = 0; b < BVH_BINS - 1; b++){
+			boundsGrow(&lo, &hi, &bins[b].lo, &bins[b].hi);
+			c += bins[b].count;
+			if(c == 0 || rightCount[b + 1] == 0) continue;
+			float cost = 1.0f + (boundsArea(&lo, &hi) * c
+				+ rightArea[b + 1] * rightCount[b + 1]) / parentArea;
+			if(cost < bestCost){
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	int mid;
+	if(bestAxis < 0){
+		/* All centroids coincide or the tree is already too deep,
+		 * split in the middle if we must.
+		 */
+		if(count <= BVH_MAX_LEAF) return;
+		mid = start + count / 2;
+	}else{
+		if(bestCost >= leafCost && count <= BVH_MAX_LEAF) return;
+
+		float cmin = vectorAxis(&clo, bestAxis), cmax = vectorAxis(&chi, bestAxis);
+		float scale = BVH_BINS / (cmax - cmin);
+		int lo = start, hi = end - 1;
+		while(lo <= hi){
+			int k = bb->idx[lo];
+			b = (int)((vectorAxis(&bb->centre[k], bestAxis) - cmin) * scale);
+			if(b >= BVH_BINS) b = BVH_BINS - 1;
+			if(b <= bestBin)
+				lo++;
+			else{
+				bb->idx[lo] = bb->idx[hi];
+				bb->idx[hi--] = k;
+			}
+		}
+		mid = lo;
+	}
+
+	int left = bb->nnodes;
+	bb->nnodes += 2;
+	n->first = left;
+	n->count = 0;
+	bvhMakeNode(bb, left, start, mid, depth + 1);
+	bvhMakeNode(bb, left + 1, mid, end, depth + 1);
+}
+
+/* Bounds of primitive slot i of the scene, see bvhSlotRef() */
+static void bvhPrimBounds(sphere *spheres, int nspheres, box *boxes, int nboxes, mesh *msh,
+		instanceSet *inst, int i, vector *lo, vector *hi){
+	if(i < nspheres){
+		sphere *s = &spheres[i];
+		lo->x = s->pos.x - s->radius; hi->x = s->pos.x + s->radius;
+		lo->y = s->pos.y - s->radius; hi->y = s->pos.y + s->radius;
+		lo->z = s->pos.z - s->radius; hi->z = s->pos.z + s->radius;
+	}else if(i < nspheres + nboxes){
+		*lo = boxes[i - nspheres].min;
+		*hi = boxes[i - nspheres].max;
+	}else if(i < nspheres + nboxes + MESH_TRIS(msh))
+		meshBounds(msh, i - nspheres - nboxes, lo, hi);
+	else
+		instanceGetBounds(inst, i - nspheres - nboxes - MESH_TRIS(msh), lo, hi);
+}
+
+/* Padded bounds of every primitive slot of the scene into lo and hi.
+ * Rays start on the surface of the primitives or inside the box
+ * viewLo..viewHi (the camera), which bounds how far the padding has to
+ * reach.
+ */
+static void bvhPaddedBounds(sphere *spheres, int nspheres, box *boxes, int nboxes, mesh *msh,
+		instanceSet *inst, vector *viewLo, vector *viewHi, vector *plo, vector *phi){
+	int n = nspheres + nboxes + MESH_TRIS(msh) + INSTANCES(inst);
+	int i;
+
+	/* The longest distance between a ray origin and a primitive */
+	vector slo, shi;
+	boundsEmpty(&slo, &shi);
+	if(viewLo != NULL)
+		boundsGrow(&slo, &shi, viewLo, viewHi);
+	for(i = 0; i < n; i++){
+		vector lo, hi;
+		bvhPrimBounds(spheres, nspheres, boxes, nboxes, msh, inst, i, &lo, &hi);
+		boundsGrow(&slo, &shi, &lo, &hi);
+	}
+	vector diag = vectorSub(&shi, &slo);
+	float reach2 = n > 0 ? vectorDot(&diag, &diag) : 0;
+
+	for(i = 0; i < n; i++){
+		float extra = 1e-6f + 4 * FLT_EPSILON * sqrtf(reach2);
+		bvhPrimBounds(spheres, nspheres, boxes, nboxes, msh, inst, i, &plo[i], &phi[i]);
+		if(i < nspheres && spheres[i].radius > 0)
+			extra += BVH_SPHERE_PAD * FLT_EPSILON * reach2 / spheres[i].radius;
+		bvhPad(&plo[i], &phi[i], extra);
+	}
+}
+
+/* Expected cost of a ray through the tree relative to the root, by the
+ * surface area heuristic. Refitting lets it grow as primitives move.
+ */
+static float bvhCost(bvh *b){
+	float root = boundsArea(&b->nodes[0].min, &b->nodes[0].max);
+	float cost = 0;
+	int i;
+
+	if(root <= 0) return 0;
+	for(i = 0; i < b->nnodes; i++){
+		bvhNode *n = &b->nodes[i];
+		if(i == 1) continue;
+		cost += boundsArea(&n->min, &n->max) * (n->count > 0 ? n->count : 1);
+	}
+	return cost / root;
+}
+
+/* Build the hierarchy again in the memory of the last build, which is
+ * all freed. See bvhBuild().
+ */
+static void bvhRebuild(bvh *b, sphere *spheres, int nspheres, box *boxes, int nboxes, mesh *msh,
+		instanceSet *inst, vector *viewLo, vector *viewHi){
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int n = nspheres + nboxes + MESH_TRIS(msh) + INSTANCES(inst);
+	int i;
+	bvhBuilder bb;
+
+	/* A binary tree with at most one primitive per leaf has 2n - 1 nodes,
+	 * plus the unused node 1. The nodes are cut down to those used once
+	 * the scratch of the builder after them is gone.
+	 */
+	size_t maxNodes = 2 * (size_t)n + 2;
+	arenaReset(&b->mem);
+	b->prims = arenaAlloc(&b->mem, (n + 1) * sizeof(int));
+	bb.nodes = arenaAlloc(&b->mem, maxNodes * sizeof(bvhNode));
+	arenaMark scratch = arenaGetMark(&b->mem);
+	bb.lo = arenaAlloc(&b->mem, (n + 1) * sizeof(vector));
+	bb.hi = arenaAlloc(&b->mem, (n + 1) * sizeof(vector));
+	bb.centre = arenaAlloc(&b->mem, (n + 1) * sizeof(vector));
+	bb.idx = arenaAlloc(&b->mem, (n + 1) * sizeof(int));
+	if(bb.lo == NULL || bb.hi == NULL || bb.centre == NULL || bb.idx == NULL
+			|| b->prims == NULL || bb.nodes == NULL){
+		fprintf(stderr, "bvhBuild: out of memory\n");
+		exit(1);
+	}
+
+	bvhPaddedBounds(spheres, nspheres, boxes, nboxes, msh, inst, viewLo, viewHi, bb.lo, bb.hi);
+	for(i = 0; i < n; i++){
+		bb.centre[i].x = 0.5f * (bb.lo[i].x + bb.hi[i].x);
+		bb.centre[i].y = 0.5f * (bb.lo[i].y + bb.hi[i].y);
+		bb.centre[i].z = 0.5f * (bb.lo[i].z + bb.hi[i].z);
+		bb.idx[i] = i;
+	}
+
+	bb.nnodes = 2;
+	if(n > 0)
+		bvhMakeNode(&bb, 0, 0, n, 0);
+	else{
+		boundsEmpty(&bb.nodes[0].min, &bb.nodes[0].max);
+		bb.nodes[0].first = 0;
+		bb.nodes[0].count = 0;
+	}
+	memset(&bb.nodes[1], 0, sizeof(bvhNode));
+
+	/* The references in leaf order */
+	for(i = 0; i < n; i++)
+		b->prims[i] = bvhSlotRef(bb.idx[i], nspheres, nboxes, MESH_TRIS(msh));
+
+	/* Leaves usually hold several primitives, keep only the nodes used */
+	arenaRelease(&b->mem, scratch);
+	arenaShrink(&b->mem, bb.nodes, bb.nnodes * sizeof(bvhNode));
+	b->nodes = bb.nodes;
+	b->nnodes = bb.nnodes;
+	b->nprims = n;
+	b->cost = bvhCost(b);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	b->buildMs = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) * 1e-6;
+}
+
+/* Build the hierarchy over all spheres, boxes, triangles and instances of
+ * a scene, msh NULL if it has no triangles and inst NULL if it has no
+ * instances. Rays start on the surface of the primitives or inside the
+ * box viewLo..viewHi (the camera), which bounds how far the padding has
+ * to reach. The tree is kept in an arena of its own, b->mem.
+ */
+static void bvhBuild(bvh *b, sphere *spheres, int nspheres, box *boxes, int nboxes, mesh *msh,
+		instanceSet *inst, vector *viewLo, vector *viewHi){
+	arenaInit(&b->mem, "bvh", 0);
+	bvhRebuild(b, spheres, nspheres, boxes, nboxes, msh, inst, viewLo, viewHi);
+}
+
+/* Fit the bounds of every node to primitives that have moved, keeping
+ * the tree as it is. The scene must have the same primitives the tree
+ * was built over. Children always come after their parent, so walking
+ * the nodes backwards fits the children first. Returns bvhCost() of the
+ * refitted tree, which the caller can compare with b->cost to decide
+ * when a new build pays off.
+ */
+static inline float bvhRefit(bvh *b, sphere *spheres, int nspheres, box *boxes, int nboxes, mesh *msh,
+		instanceSet *inst, vector *viewLo, vector *viewHi){
+	int n = nspheres + nboxes + MESH_TRIS(msh) + INSTANCES(inst);
+	arenaMark scratch = arenaGetMark(&b->mem);
+	vector *lo = arenaAlloc(&b->mem, (n + 1) * sizeof(vector));
+	vector *hi = arenaAlloc(&b->mem, (n + 1) * sizeof(vector));
+	int i, k;
+
+	if(lo == NULL || hi == NULL){
+		fprintf(stderr, "bvhRefit: out of memory\n");
+		exit(1);
+	}
+	bvhPaddedBounds(spheres, nspheres, boxes, nboxes, msh, inst, viewLo, viewHi, lo, hi);
+
+	for(i = b->nnodes - 1; i >= 0; i--){
+		bvhNode *node = &b->nodes[i];
+		if(i == 1) continue;
+		if(node->count > 0){
+			boundsEmpty(&node->min, &node->max);
+			for(k = node->first; k < node->first + node->count; k++){
+				int slot = bvhRefSlot(b->prims[k], nspheres, nboxes, MESH_TRIS(msh));
+				boundsGrow(&node->min, &node->max, &lo[slot], &hi[slot]);
+			}
+		}else if(b->nprims > 0){
+			bvhNode *left = &b->nodes[node->first];
+			node->min = left->min;
+			node->max = left->max;
+			boundsGrow(&node->min, &node->max, &left[1].min, &left[1].max);
+		}
+	}
+	arenaRelease(&b->mem, scratch);
+	return bvhCost(b);
+}
+
+static void bvhFree(bvh *b){
+	arenaFree(&b->mem);
+}
+
+/* Bytes used by the nodes and the reference array */
+static inline size_t bvhBytes(bvh *b){
+	return b->nnodes * sizeof(bvhNode) + b->nprims * sizeof(int);
+}
+
+/* Slab test of a ray against a node. On a hit tnear is where the ray
+ * enters the box. tmax is inclusive so equally distant hits are not lost.
+ * rayInverse() keeps NaN out of the slabs, so the plain min() and max()
+ * compile to single instructions where fminf() would be a libm call.
+ */
+static inline bool bvhHitNode(bvhNode *n, vector *o, vector *inv, float tmax, float *tnear){
+	float tx1 = (n->min.x - o->x) * inv->x, tx2 = (n->max.x - o->x) * inv->x;
+	float ty1 = (n->min.y - o->y) * inv->y, ty2 = (n->max.y - o->y) * inv->y;
+	float tz1 = (n->min.z - o->z) * inv->z, tz2 = (n->max.z - o->z) * inv->z;
+
+	float t0 = max(max(min(tx1, tx2), min(ty1, ty2)), min(tz1, tz2));
+	float t1 = min(min(max(tx1, tx2), max(ty1, ty2)), max(tz1, tz2));
+
+	*tnear = t0;
+	return t0 <= t1 && t1 >= 0 && t0 <= tmax;
+}
+
+/* The next float above a positive finite x, like nextafterf(x, INFINITY)
+ * without the library call.
+ */
+static inline float bvhNextUp(float x){
+	union{ float f; unsigned int u; } v;
+	v.f = x;
+	v.u++;
+	return v.f;
+}
+
+/* Take a hit at tt on primitive ref if it is nearer than *t, or at
+ * exactly *t and the primitive comes first in scan order.
+ */
+static inline void bvhTakeHit(float tt, int ref, float *t, int *best){
+	if(tt < *t || (tt == *t && ref < *best)){
+		*t = tt;
+		*best = ref;
+	}
+}
+
+/* Test one sphere or box, see bvhTakeHit() */
+static inline void bvhTestPrim(sphere *spheres, box *boxes, int ref, ray *r, vector *inv,
+		float *t, int *best){
+	float tt = bvhNextUp(*t);
+	bool hit;
+
+	if(PRIM_KIND(ref) == PRIM_SPHERE)
+		hit = intersectRaySphere(r, &spheres[PRIM_INDEX(ref)], &tt);
+	else
+		hit = intersectRayBox(r, inv, &boxes[PRIM_INDEX(ref)], &tt);
+
+	if(hit) bvhTakeHit(tt, ref, t, best);
+}
+
+/* Test the n <= MESH_LANES triangles tris, as references, at once, see
+ * bvhTakeHit()
+ */
+static inline void bvhTestTriangles(mesh *msh, int *tris, int n, meshRay *m, float *t, int *best){
+	float tt[MESH_LANES];
+	int idx[MESH_LANES];
+	int j;
+
+	for(j = 0; j < n; j++)
+		idx[j] = PRIM_INDEX(tris[j]);
+	meshTest4(msh, idx, n, m, bvhNextUp(*t), tt);
+	for(j = 0; j < n; j++)
+		if(tt[j] < INFINITY) bvhTakeHit(tt[j], tris[j], t, best);
+}
+
+/* Test the count primitives at refs, the triangles among them MESH_LANES
+ * at a time. spheres NULL leaves the spheres out. The primitives tested
+ * inside instances are added to *tests.
+ */
+static inline void bvhTestLeaf(sphere *spheres, box *boxes, mesh *msh, instanceSet *inst, int *refs,
+		int count, ray *r, vector *inv, meshRay *m, float *t, int *best, long *tests){
+	int tris[MESH_LANES];
+	int i, n = 0;
+
+	for(i = 0; i < count; i++){
+		if(PRIM_KIND(refs[i]) == PRIM_SPHERE){
+			if(spheres != NULL)
+				bvhTestPrim(spheres, boxes, refs[i], r, inv, t, best);
+		}else if(PRIM_KIND(refs[i]) == PRIM_BOX)
+			bvhTestPrim(spheres, boxes, refs[i], r, inv, t, best);
+		else if(PRIM_KIND(refs[i]) == PRIM_INSTANCE)
+			instanceClosestHit(inst, PRIM_INDEX(refs[i]), r, inv, t, best, tests);
+		else{
+			tris[n++] = refs[i];
+			if(n == MESH_LANES){
+				bvhTestTriangles(msh, tris, n, m, t, best);
+				n = 0;
+			}
+		}
+	}
+	if(n > 0) bvhTestTriangles(msh, tris, n, m, t, best);
+}
+
+/* Find the closest primitive hit by r that is nearer than *t. Returns its
+ * reference and updates *t, or returns -1 if nothing is hit. The result is
+ * the same as testing every primitive in scan order. The number of
+ * primitives tested is added to *tests.
+ */
+static int bvhClosestHit(bvh *b, sphere *spheres, box *boxes, mesh *msh, instanceSet *inst, ray *r,
+		float *t, long *tests){
+	int stack[BVH_STACK];
+	float stackNear[BVH_STACK];
+	int sp = 0;
+	int best = -1;
+	int node = 0;
+	float tnear;
+	vector inv = rayInverse(&r->dir);
+	meshRay m;
+
+	if(b->nprims == 0 || !bvhHitNode(&b->nodes[0], &r->start, &inv, *t, &tnear))
+		return -1;
+	if(msh != NULL) meshRaySetup(r, &m);
+
+	for(;;){
+		bvhNode *n = &b->nodes[node];
+		if(n->count > 0){
+			*tests += n->count;
+			bvhTestLeaf(spheres, boxes, msh, inst, &b->prims[n->first], n->count, r, &inv, &m, t,
+				&best, tests);
+		}else{
+			float tl, tr;
+			bool hl = bvhHitNode(&b->nodes[n->first], &r->start, &inv, *t, &tl);
+			bool hr = bvhHitNode(&b->nodes[n->first + 1], &r->start, &inv, *t, &tr);
+			if(hl && hr){
+				/* Visit the nearer child first, the other one waits */
+				if(tr < tl){
+					stackNear[sp] = tl;
+					stack[sp++] = n->first;
+					node = n->first + 1;
+				}else{
+					stackNear[sp] = tr;
+					stack[sp++] = n->first + 1;
+					node = n->first;
+				}
+				continue;
+			}
+			if(hl){ node = n->first; continue; }
+			if(hr){ node = n->first + 1; continue; }
+		}
+
+		/* Pop the next node the ray enters before the closest hit so far */
+		for(;;){
+			if(sp == 0) return best;
+			sp--;
+			if(stackNear[sp] <= *t){
+				node = stack[sp];
+				break;
+			}
+		}
+	}
+}
+
+/* Collect into leaves the leaf nodes of b that reach into the frustum,
+ * at most max of them. Returns how many there are, or -1 if there are
+ * more than max.
+ */
+static inline int bvhFrustumLeaves(bvh *b, frustum *f, int *leaves, int max){
+	int stack[BVH_STACK];
+	int sp = 0, n = 0;
+
+	if(b->nprims == 0) return 0;
+	stack[sp++] = 0;
+	while(sp > 0){
+		bvhNode *node = &b->nodes[stack[--sp]];
+		if(frustumMissesBox(f, &node->min, &node->max)) continue;
+		if(node->count > 0){
+			if(n == max) return -1;
+			leaves[n++] = node - b->nodes;
+		}else{
+			stack[sp++] = node->first + 1;
+			stack[sp++] = node->first;
+		}
+	}
+	return n;
+}
+
+/* Does primitive ref block r before tmax? m is r set up for triangles.
+ * A primitive inside an instance is named as a hit names it.
+ */
+static inline bool bvhBlocks(sphere *spheres, box *boxes, mesh *msh, instanceSet *inst, int ref,
+		ray *r, vector *inv, meshRay *m, float tmax){
+	float t = tmax;
+	if(PRIM_KIND(ref) == PRIM_SPHERE)
+		return intersectRaySphere(r, &spheres[PRIM_INDEX(ref)], &t);
+	if(PRIM_KIND(ref) == PRIM_BOX)
+		return intersectRayBox(r, inv, &boxes[PRIM_INDEX(ref)], &t);
+	if(PRIM_KIND(ref) == PRIM_TRIANGLE)
+		return meshTest(msh, PRIM_INDEX(ref), m, tmax) < INFINITY;
+	return instanceBlocks(inst, ref, r, inv, tmax);
+}
+
+/* Find any primitive hit by r closer than tmax, made for shadow rays.
+ * Returns the reference of the first one found or -1. It stops at the
+ * first hit and does not keep track of the closest one, nodes are only
+ * visited front to back so a blocker tends to be found early. inv is
+ * rayInverse() of the direction, shadow rays usually have it already.
+ * The number of primitives tested is added to *tests.
+ */
+static int bvhAnyHit(bvh *b, sphere *spheres, box *boxes, mesh *msh, instanceSet *inst, ray *r,
+		vector *inv, float tmax, long *tests){
+	int stack[BVH_STACK];
+	int sp = 0;
+	int node = 0;
+	float tnear;
+	meshRay m;
+
+	if(b->nprims == 0 || !bvhHitNode(&b->nodes[0], &r->start, inv, tmax, &tnear))
+		return -1;
+	if(msh != NULL) meshRaySetup(r, &m);
+
+	for(;;){
+		bvhNode *n = &b->nodes[node];
+		if(n->count > 0){
+			int i;
+			for(i = n->first; i < n->first + n->count; i++){
+				int ref = b->prims[i];
+				if(PRIM_KIND(ref) == PRIM_INSTANCE){
+					ref = instanceAnyHit(inst, PRIM_INDEX(ref), r, inv, tmax, tests);
+					if(ref >= 0) return ref;
+					continue;
+				}
+				(*tests)++;
+				if(bvhBlocks(spheres, boxes, msh, inst, ref, r, inv, &m, tmax))
+					return ref;
+			}
+		}else{
+			float tl, tr;
+			bool hl = bvhHitNode(&b->nodes[n->first], &r->start, inv, tmax, &tl);
+			bool hr = bvhHitNode(&b->nodes[n->first + 1], &r->start, inv, tmax, &tr);
+			if(hl && hr){
+				stack[sp++] = tr < tl ? n->first : n->first + 1;
+				node = tr < tl ? n->first + 1 : n->first;
+				continue;
+			}
+			if(hl){ node = n->first; continue; }
+			if(hr){ node = n->first + 1; continue; }
+		}
+		if(sp == 0) return -1;
+		node = stack[--sp];
+	}
+}
+
+#include "instance.h"
+
+#endif
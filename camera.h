@@ -0,0 +1,183 @@
+/* Cameras: where the primary ray through a point of the image starts
+ * and where it goes.
+ *
+ * Image points are in pixels, (0, 0) is the top left corner of the image
+ * and (width, height) the bottom right one. The default camera is the
+ * original orthographic view: parallel rays along z from the plane
+ * z = -2000, one scene unit per pixel at the default size. A pinhole
+ * camera sends rays from one point through a field of view, and a thin
+ * lens camera starts them anywhere on a disc around that point, all
+ * aimed at the same spot on the plane in focus, which blurs everything
+ * in front of and behind that plane.
+ *
+ * Rays through a rectangle of the image lie in a frustum the camera can
+ * give, so whole tiles can be checked against the scene at once.
+ */
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "geometry.h"
+
+typedef struct{
+	bool perspective;	/* false for the orthographic view */
+	float scaleX, scaleY;	/* orthographic: scene units per pixel */
+	vector pos;		/* perspective: centre of the lens */
+	vector corner;		/* where the ray through (0, 0) meets the focus plane, from pos */
+	vector dx, dy;		/* a step of one pixel on the focus plane */
+	vector lensU, lensV;	/* axes of the lens, as long as its radius */
+	bool lens;		/* the lens has an aperture, rays start off pos */
+	int width, height;
+}camera;
+
+/* The orthographic view of viewW by viewH scene units for an image of
+ * width by height pixels
+ */
+static void cameraOrtho(camera *c, int width, int height, float viewW, float viewH){
+	c->perspective = false;
+	c->lens = false;
+	c->scaleX = viewW / width;
+	c->scaleY = viewH / height;
+	c->width = width;
+	c->height = height;
+}
+
+/* A camera at pos looking at at, with up pointing to the top of the
+ * image and a vertical field of view of fov degrees. aperture is the
+ * radius of the lens, 0 for a pinhole, and focus how far the plane in
+ * focus is, 0 for the distance to at. Returns false if the view has no
+ * direction or up is along it.
+ */
+static bool cameraLookAt(camera *c, vector *pos, vector *at, vector *up, float fov,
+		float aperture, float focus, int width, int height){
+	vector w = vectorSub(at, pos);
+	float dist = sqrtf(vectorDot(&w, &w));
+
+	if(dist == 0 || !(fov > 0 && fov < 180) || aperture < 0 || focus < 0)
+		return false;
+	w = vectorScale(1.0f / dist, &w);
+	vector right = vectorCross(&w, up);
+	if(vectorDot(&right, &right) == 0)
+		return false;
+	right = vectorNormalize(&right);
+	vector top = vectorCross(&right, &w);
+
+	if(focus == 0) focus = dist;
+	float halfH = focus * tanf(fov * (float)M_PI / 360);
+	float halfW = halfH * width / height;
+
+	c->perspective = true;
+	c->pos = *pos;
+	c->dx = vectorScale(2 * halfW / width, &right);
+	c->dy = vectorScale(-2 * halfH / height, &top);
+	c->corner = vectorScale(focus, &w);
+	vector r = vectorScale(halfW, &right), t = vectorScale(halfH, &top);
+	c->corner = vectorSub(&c->corner, &r);
+	c->corner = vectorAdd(&c->corner, &t);
+	c->lens = aperture > 0;
+	c->lensU = vectorScale(aperture, &right);
+	c->lensV = vectorScale(aperture, &top);
+	c->width = width;
+	c->height = height;
+	return true;
+}
+
+/* A number in [0, 1) from the point (x, y) of the image. The lens
+ * samples must be the same every time a point is traced, or a pixel
+ * traced again after an edit would come out different.
+ */
+static inline float cameraHash(float x, float y, uint32_t salt){
+	union{ float f; uint32_t u; } a, b;
+	a.f = x;
+	b.f = y;
+	uint32_t h = a.u * 0x9e3779b1u ^ (b.u + salt) * 0x85ebca77u;
+	h ^= h >> 15;
+	h *= 0x2c1b3c6du;
+	h ^= h >> 12;
+	h *= 0x297a2d39u;
+	h ^= h >> 15;
+	return (h >> 8) * (1.0f / 16777216);
+}
+
+/* The primary ray through point (x, y) of the image. Perspective rays
+ * have a direction of length one, as intersectRaySphere() expects.
+ */
+static inline void cameraRay(camera *c, float x, float y, ray *r){
+	if(!c->perspective){
+		r->start.x = x * c->scaleX;
+		r->start.y = y * c->scaleY;
+		r->start.z = -2000;
+		r->dir.x = 0;
+		r->dir.y = 0;
+		r->dir.z = 1;
+		return;
+	}
+
+	vector sx = vectorScale(x, &c->dx), sy = vectorScale(y, &c->dy);
+	vector d = vectorAdd(&c->corner, &sx);
+	d = vectorAdd(&d, &sy);
+	r->start = c->pos;
+	if(c->lens){
+		/* A point spread evenly over the disc of the lens */
+		float radius = sqrtf(cameraHash(x, y, 0));
+		float angle = 2 * (float)M_PI * cameraHash(x, y, 1);
+		vector u = vectorScale(radius * cosf(angle), &c->lensU);
+		vector v = vectorScale(radius * sinf(angle), &c->lensV);
+		vector off = vectorAdd(&u, &v);
+		r->start = vectorAdd(&r->start, &off);
+		d = vectorSub(&d, &off);
+	}
+	r->dir = vectorNormalize(&d);
+}
+
+/* The box every primary ray starts in */
+static void cameraBounds(camera *c, vector *lo, vector *hi){
+	if(!c->perspective){
+		lo->x = 0;
+		lo->y = 0;
+		lo->z = -2000;
+		hi->x = c->width * c->scaleX;
+		hi->y = c->height * c->scaleY;
+		hi->z = -2000;
+		return;
+	}
+	vector e = {fabsf(c->lensU.x) + fabsf(c->lensV.x), fabsf(c->lensU.y) + fabsf(c->lensV.y),
+		fabsf(c->lensU.z) + fabsf(c->lensV.z)};
+	*lo = vectorSub(&c->pos, &e);
+	*hi = vectorAdd(&c->pos, &e);
+}
+
+/* The frustum holding the rays through the rectangle (x0, y0)..(x1, y1)
+ * of the image. Its sides go through the rays of the corners, each made
+ * from one ray and a point of the next. Returns false for a thin lens,
+ * whose rays through a rectangle do not share a frustum this simple.
+ */
+static bool cameraFrustum(camera *c, float x0, float y0, float x1, float y1, frustum *f){
+	float xs[4] = {x0, x1, x1, x0}, ys[4] = {y0, y0, y1, y1};
+	ray corners[4], centre;
+	int i;
+
+	if(c->lens) return false;
+	for(i = 0; i < 4; i++)
+		cameraRay(c, xs[i], ys[i], &corners[i]);
+	cameraRay(c, 0.5f * (x0 + x1), 0.5f * (y0 + y1), &centre);
+	vector inside = vectorAdd(&centre.start, &centre.dir);
+
+	for(i = 0; i < 4; i++){
+		ray *a = &corners[i], *b = &corners[(i + 1) % 4];
+		vector p = vectorAdd(&b->start, &b->dir);
+		p = vectorSub(&p, &a->start);
+		f->n[i] = vectorCross(&a->dir, &p);
+		f->d[i] = vectorDot(&f->n[i], &a->start);
+		if(vectorDot(&f->n[i], &inside) < f->d[i]){
+			f->n[i] = vectorScale(-1, &f->n[i]);
+			f->d[i] = -f->d[i];
+		}
+	}
+	return true;
+}
+
+#endif
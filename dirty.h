@@ -0,0 +1,170 @@
+/* Dirty regions: which pixels an edit of the scene can change.
+ *
+ * While a frame is rendered every pixel records what its path depended
+ * on: the primitive its primary ray hit, a signature of every other
+ * primitive the path hit or was shadowed by, and the points where its
+ * reflected rays hit, which give its reflected and shadow rays. When a
+ * primitive moves, only pixels whose path touched it where it was, or
+ * whose rays pass through where it is now, can come out differently.
+ * Everything else is left as it is, so the cost of an edit follows the
+ * area it changes, not the frame.
+ */
+#ifndef DIRTY_H
+#define DIRTY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "geometry.h"
+#include "bvh.h"
+#include "lights.h"
+
+/* Reflected rays whose hit points a record holds, longer paths are
+ * traced again after every edit
+ */
+#define RECORD_BOUNCES 2
+
+/* What the path of one pixel depended on */
+typedef struct{
+	int hit;		/* primitive the primary ray hit, -1 for none */
+	float t;		/* how far along the primary ray */
+	uint64_t sig;		/* recordBit() of the other primitives hit or blocking a light */
+	vector bounce[RECORD_BOUNCES];	/* where the reflected rays hit */
+	vector escape;		/* direction of the reflected ray that hit nothing */
+	unsigned char bounces;	/* reflected rays that hit something */
+	bool escapes;		/* the last reflected ray hit nothing */
+	bool overflow;		/* the path was too long to record */
+}pixelRecord;
+
+/* A primitive that moved, with the bounds of where it is now */
+typedef struct{
+	int ref;
+	vector lo, hi;
+	light *lights;		/* shadow rays go from every hit point to these */
+	int nlights;
+	lightGrid *grid;	/* the lights that reach a point, NULL for all */
+	bool shadows;
+}sceneEdit;
+
+/* Bit of a primitive in the 64 bit path signature. Primitives sharing a
+ * bit only make the signature claim more pixels than it has to.
+ */
+static inline uint64_t recordBit(int ref){
+	return (uint64_t)1 << ((uint32_t)ref * 0x9e3779b1u >> 26);
+}
+
+static inline void recordClear(pixelRecord *rec){
+	rec->hit = -1;
+	rec->t = INFINITY;
+	rec->sig = 0;
+	rec->bounces = 0;
+	rec->escapes = false;
+	rec->overflow = false;
+}
+
+/* Add a reflected ray r that hit primitive hit at t, or nothing */
+static inline void recordRay(pixelRecord *rec, ray *r, int hit, float t){
+	if(hit < 0){
+		rec->escapes = true;
+		rec->escape = r->dir;
+		return;
+	}
+	rec->sig |= recordBit(hit);
+	if(rec->bounces == RECORD_BOUNCES){
+		rec->overflow = true;
+		return;
+	}
+	vector d = vectorScale(t, &r->dir);
+	rec->bounce[rec->bounces++] = vectorAdd(&r->start, &d);
+}
+
+/* Is a + s d for s in [0, tmax] outside lo..hi along one axis? */
+static inline bool spanMisses(float a, float d, float tmax, float lo, float hi){
+	float b = d == 0 ? a : a + d * tmax;
+	return fmaxf(a, b) < lo || fminf(a, b) > hi;
+}
+
+/* Does a + s d for s in [0, tmax] pass through the box lo..hi? Most
+ * segments miss it on one of the axes, which needs no division.
+ */
+static inline bool segmentHitsBox(vector *a, vector *d, float tmax, vector *lo, vector *hi){
+	if(spanMisses(a->x, d->x, tmax, lo->x, hi->x) || spanMisses(a->y, d->y, tmax, lo->y, hi->y) ||
+			spanMisses(a->z, d->z, tmax, lo->z, hi->z))
+		return false;
+
+	vector inv = rayInverse(d);
+	float t0 = 0, t1 = tmax, ta, tb;
+
+	ta = (lo->x - a->x) * inv.x;
+	tb = (hi->x - a->x) * inv.x;
+	t0 = fmaxf(t0, fminf(ta, tb));
+	t1 = fminf(t1, fmaxf(ta, tb));
+	ta = (lo->y - a->y) * inv.y;
+	tb = (hi->y - a->y) * inv.y;
+	t0 = fmaxf(t0, fminf(ta, tb));
+	t1 = fminf(t1, fmaxf(ta, tb));
+	ta = (lo->z - a->z) * inv.z;
+	tb = (hi->z - a->z) * inv.z;
+	t0 = fmaxf(t0, fminf(ta, tb));
+	t1 = fminf(t1, fmaxf(ta, tb));
+	return t0 <= t1;
+}
+
+/* Describe primitive ref of the scene, already moved, as an edit */
+static void editMake(sceneEdit *e, sphere *spheres, int nspheres, box *boxes, int nboxes, mesh *msh,
+		instanceSet *inst, int ref, light *lights, int nlights, lightGrid *grid, bool shadows){
+	int i = bvhRefSlot(ref, nspheres, nboxes, MESH_TRIS(msh));
+
+	e->ref = ref;
+	bvhPrimBounds(spheres, nspheres, boxes, nboxes, msh, inst, i, &e->lo, &e->hi);
+	bvhPad(&e->lo, &e->hi, 0);
+	e->lights = lights;
+	e->nlights = nlights;
+	e->grid = grid;
+	e->shadows = shadows;
+}
+
+/* Can the edit change the pixel of rec? primary is the ray the camera
+ * traces for the pixel.
+ */
+static inline bool recordDirty(pixelRecord *rec, ray *primary, sceneEdit *e){
+	vector d;
+	vector points[RECORD_BOUNCES + 1];
+	lightIter it;
+	int i, j;
+
+	/* It touched the primitive where it was */
+	if(rec->hit == e->ref || (rec->sig & recordBit(e->ref)) || rec->overflow)
+		return true;
+
+	/* One of its rays passes where it is now */
+	if(segmentHitsBox(&primary->start, &primary->dir, rec->t, &e->lo, &e->hi))
+		return true;
+	if(rec->hit < 0)
+		return false;
+
+	d = vectorScale(rec->t, &primary->dir);
+	points[0] = vectorAdd(&primary->start, &d);
+	for(i = 0; i < rec->bounces; i++){
+		points[i + 1] = rec->bounce[i];
+		d = vectorSub(&points[i + 1], &points[i]);
+		if(segmentHitsBox(&points[i], &d, 1, &e->lo, &e->hi))
+			return true;
+	}
+	if(rec->escapes && segmentHitsBox(&points[rec->bounces], &rec->escape, INFINITY,
+			&e->lo, &e->hi))
+		return true;
+	if(e->shadows)
+		for(i = 0; i <= rec->bounces; i++){
+			lightIterStart(&it, e->grid, e->nlights, &points[i]);
+			while((j = lightIterNext(&it)) >= 0){
+				d = vectorSub(&e->lights[j].pos, &points[i]);
+				if(segmentHitsBox(&points[i], &d, 1, &e->lo, &e->hi))
+					return true;
+			}
+		}
+	return false;
+}
+
+#endif
@@ -0,0 +1,310 @@
+/* Types and intersection routines shared by the renderers */
+#ifndef GEOMETRY_H
+#define GEOMETRY_H
+
+#include <stdbool.h> /* Needed for boolean datatype */
+#include <math.h>
+
+/* The vector structure */
+typedef struct{
+	float x,y,z;
+}vector;
+
+/* The sphere */
+typedef struct{
+	vector pos;
+	float  radius;
+	int material;
+}sphere;
+
+/* An axis-aligned box. Its bounds are computed once when the scene is
+ * loaded and only read from then on, so any number of threads can test
+ * rays against it.
+ */
+typedef struct{
+	vector min;
+	vector max;
+	int material;
+}box;
+
+/* The ray */
+typedef struct{
+	vector start;
+	vector dir;
+}ray;
+
+/* Colour */
+typedef struct{
+	float red, green, blue;
+}colour;
+
+/* Material Definition */
+typedef struct{
+	colour diffuse;
+	float reflection;
+}material;
+
+/* Lightsource definition. A light with a radius lights only points
+ * closer than that, fading out smoothly towards it; without one (0) it
+ * reaches everywhere at full strength.
+ */
+typedef struct{
+	vector pos;
+	colour intensity;
+	float radius;
+}light;
+
+/* A convex region bounded by four planes, such as the rays through a
+ * tile of the image. A point p is inside when dot(n[i], p) >= d[i] for
+ * every plane i.
+ */
+typedef struct{
+	vector n[4];
+	float d[4];
+}frustum;
+
+/* Subtract two vectors and return the resulting vector */
+static inline vector vectorSub(vector *v1, vector *v2){
+	vector result = {v1->x - v2->x, v1->y - v2->y, v1->z - v2->z };
+	return result;
+}
+
+/* Multiply two vectors and return the resulting scalar (dot product) */
+static inline float vectorDot(vector *v1, vector *v2){
+	return v1->x * v2->x + v1->y * v2->y + v1->z * v2->z;
+}
+
+/* Calculate Vector x Scalar and return resulting Vector*/
+static inline vector vectorScale(float c, vector *v){
+	vector result = {v->x * c, v->y * c, v->z * c };
+	return result;
+}
+
+/* Add two vectors and return the resulting vector */
+static inline vector vectorAdd(vector *v1, vector *v2){
+	vector result = {v1->x + v2->x, v1->y + v2->y, v1->z + v2->z };
+	return result;
+}
+
+/* Cross product of two vectors */
+static inline vector vectorCross(vector *v1, vector *v2){
+	vector result = {v1->y * v2->z - v1->z * v2->y, v1->z * v2->x - v1->x * v2->z,
+		v1->x * v2->y - v1->y * v2->x};
+	return result;
+}
+
+/* Scale v to length one, a zero vector stays as it is */
+static inline vector vectorNormalize(vector *v){
+	float len = vectorDot(v, v);
+	if(len == 0) return *v;
+	return vectorScale(1.0f / sqrtf(len), v);
+}
+
+/*min and max are two helper functions needed for the slab tests*/
+static inline float min(float x, float y)
+{
+	if (x<y){return x;}
+	return y;
+}
+static inline float max(float x, float y)
+{
+	if (x>y){return x;}
+	return y;
+}
+
+/* Is anything in the way of r, the ray towards lights[light], before it
+ * has gone dist? Used to cast shadows, ctx is whatever the caller passed
+ * to shadeLambert().
+ */
+typedef bool shadowFunc(void *ctx, int light, ray *r, float dist);
+
+/* How much of a light is left at squared distance d2 from it: falls
+ * from 1 to 0 at its radius and is 0 beyond, 1 everywhere if it has no
+ * radius
+ */
+static inline float lightFalloff(light *l, float d2){
+	if(l->radius <= 0) return 1;
+	float w = 1 - d2 / (l->radius * l->radius);
+	return w > 0 ? w * w : 0;
+}
+
+/* Add the Lambert diffuse light reaching point p with normal n from
+ * lights[j] to c, weighted by coef. Nothing is added if the light is behind
+ * the surface, out of reach, or shadow finds it blocked, unless shadow is
+ * NULL.
+ */
+static inline void shadeLight(light *lights, int j, vector *p, vector *n,
+		material *m, float coef, colour *c, shadowFunc *shadow, void *ctx){
+	light currentLight = lights[j];
+	vector dist = vectorSub(&currentLight.pos, p);
+	if(vectorDot(n, &dist) <= 0.0f) return;
+	float d2 = vectorDot(&dist,&dist);
+	float falloff = lightFalloff(&currentLight, d2);
+	if(falloff <= 0.0f) return;
+	float t = sqrtf(d2);
+	if(t <= 0.0f) return;
+
+	ray lightRay;
+	lightRay.start = *p;
+	lightRay.dir = vectorScale((1/t), &dist);
+	if(shadow != NULL && shadow(ctx, j, &lightRay, t)) return;
+
+	/* Lambert diffusion */
+	float lambert = vectorDot(&lightRay.dir, n) * coef;
+	if(currentLight.radius > 0) lambert *= falloff;
+
+	c->red += lambert * currentLight.intensity.red * m->diffuse.red;
+	c->green += lambert * currentLight.intensity.green * m->diffuse.green;
+	c->blue += lambert * currentLight.intensity.blue * m->diffuse.blue;
+}
+
+/* Add the Lambert diffuse light reaching point p with normal n from every
+ * light to c, weighted by coef, see shadeLight()
+ */
+static inline void shadeLambert(light *lights, int nlights, vector *p, vector *n,
+		material *m, float coef, colour *c, shadowFunc *shadow, void *ctx){
+	int j;
+	for(j=0; j < nlights; j++)
+		shadeLight(lights, j, p, n, m, coef, c, shadow, ctx);
+}
+
+/* Check if the ray and sphere intersect */
+static inline bool intersectRaySphere(ray *r, sphere *s, float *t){
+
+	bool retval = false;
+
+	/* A = d.d, the vector dot product of the direction */
+	float A = vectorDot(&r->dir, &r->dir);
+
+	/* We need a vector representing the distance between the start of
+	 * the ray and the position of the circle.
+	 * This is the term (p0 - c)
+	 */
+	vector dist = vectorSub(&r->start, &s->pos);
+
+	/* 2d.(p0 - c) */
+	float B = 2 * vectorDot(&r->dir, &dist);
+
+	/* (p0 - c).(p0 - c) - r^2 */
+	float C = vectorDot(&dist, &dist) - (s->radius * s->radius);
+
+	/* Solving the discriminant */
+	float discr = B * B - 4 * A * C;
+
+	/* If the discriminant is negative, there are no real roots.
+	 * Return false in that case as the ray misses the sphere.
+	 * Return true in all other cases (can be one or two intersections)
+	 * t represents the distance between the start of the ray and
+	 * the point on the sphere where it intersects.
+	 */
+	if(discr < 0)
+		retval = false;
+	else{
+		float sqrtdiscr = sqrtf(discr);
+		float t0 = (-B + sqrtdiscr)/(2);
+		float t1 = (-B - sqrtdiscr)/(2);
+
+		/* We want the closest one */
+		if(t0 > t1)
+			t0 = t1;
+
+		/* Verify t1 larger than 0 and less than the original t */
+		if((t0 > 0.001f) && (t0 < *t)){
+			*t = t0;
+			retval = true;
+		}else
+			retval = false;
+	}
+
+return retval;
+}
+
+/* The box of a cube given by its centre and its size along x, y and z */
+static inline box boxFromCube(vector *pos, float length, float width, float height, int material){
+	box b;
+	b.min.x = pos->x - 0.5*length;
+	b.max.x = pos->x + 0.5*length;
+	b.min.y = pos->y - 0.5*width;
+	b.max.y = pos->y + 0.5*width;
+	b.min.z = pos->z - 0.5*height;
+	b.max.z = pos->z + 0.5*height;
+	b.material = material;
+	return b;
+}
+
+/* Inverse of a ray direction for the slab tests. Zero components get a
+ * huge finite value instead of infinity so a slab never computes 0 * inf,
+ * and the plain min() and max() can be used instead of fminf() and fmaxf().
+ */
+static inline vector rayInverse(vector *d){
+	vector inv;
+	inv.x = d->x != 0 ? 1.0f / d->x : copysignf(1e30f, d->x);
+	inv.y = d->y != 0 ? 1.0f / d->y : copysignf(1e30f, d->y);
+	inv.z = d->z != 0 ? 1.0f / d->z : copysignf(1e30f, d->z);
+	return inv;
+}
+
+/* Distances along the ray to the three slabs of the box, where the ray
+ * enters each of them.
+ */
+static inline vector boxEntry(ray *r, vector *inv, box *b){
+	float tx1 = (b->min.x - r->start.x) * inv->x, tx2 = (b->max.x - r->start.x) * inv->x;
+	float ty1 = (b->min.y - r->start.y) * inv->y, ty2 = (b->max.y - r->start.y) * inv->y;
+	float tz1 = (b->min.z - r->start.z) * inv->z, tz2 = (b->max.z - r->start.z) * inv->z;
+	vector e = {min(tx1, tx2), min(ty1, ty2), min(tz1, tz2)};
+	return e;
+}
+
+/*
+The slab test: the ray is inside the box where it is between all three pairs
+of planes at once. inv is rayInverse() of the direction, computed once per ray.
+There are no branches, min() and max() compile to single instructions.
+Like intersectRaySphere() it only reports hits in front of the ray that are
+closer than *t.
+*/
+static inline bool intersectRayBox(ray *r, vector *inv, box *b, float *t){
+	float tx1 = (b->min.x - r->start.x) * inv->x, tx2 = (b->max.x - r->start.x) * inv->x;
+	float ty1 = (b->min.y - r->start.y) * inv->y, ty2 = (b->max.y - r->start.y) * inv->y;
+	float tz1 = (b->min.z - r->start.z) * inv->z, tz2 = (b->max.z - r->start.z) * inv->z;
+
+	float tNear = max(max(min(tx1, tx2), min(ty1, ty2)), min(tz1, tz2));
+	float tFar = min(min(max(tx1, tx2), max(ty1, ty2)), max(tz1, tz2));
+
+	bool hit = (tFar >= tNear) & (tNear > 0.001f) & (tNear < *t);
+	*t = hit ? tNear : *t;
+	return hit;
+}
+
+/* Normal of the face a ray hit the box through: the ray entered the box
+ * through the slab it entered last, and the face looks back at the ray.
+ */
+static inline vector boxNormal(ray *r, vector *inv, box *b){
+	vector e = boxEntry(r, inv, b);
+	vector n = {0, 0, 0};
+
+	if(e.x >= e.y && e.x >= e.z)
+		n.x = r->dir.x > 0 ? -1 : 1;
+	else if(e.y >= e.z)
+		n.y = r->dir.y > 0 ? -1 : 1;
+	else
+		n.z = r->dir.z > 0 ? -1 : 1;
+	return n;
+}
+
+/* Is the box lo..hi entirely outside the frustum? It is if the corner of
+ * the box furthest along the normal of some plane is still behind it.
+ * Boxes that are only cut by the planes near an edge of the frustum
+ * count as inside, the test never misses one that is.
+ */
+static inline bool frustumMissesBox(frustum *f, vector *lo, vector *hi){
+	int i;
+	for(i = 0; i < 4; i++){
+		vector *n = &f->n[i];
+		vector far = {n->x > 0 ? hi->x : lo->x, n->y > 0 ? hi->y : lo->y, n->z > 0 ? hi->z : lo->z};
+		if(vectorDot(n, &far) < f->d[i])
+			return true;
+	}
+	return false;
+}
+
+#endif
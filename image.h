@@ -0,0 +1,615 @@
+/* Image output.
+ *
+ * Images are written as PPM, PNG or QOI, picked by the extension of the
+ * file name. PPM is the raw pixels and costs nothing to write. PNG and
+ * QOI are a tenth of the size or less for rendered scenes, whose
+ * backgrounds and flat shading compress well. PFM holds the linear
+ * colours themselves as floats, for compositing, and is written with
+ * imageWriteFloats() instead.
+ *
+ * The rows handed to imageWriteRows() are cut into segments that are
+ * encoded on separate threads and written one after the other:
+ *
+ * PNG	every segment is filtered and deflated as a stream of its own.
+ *	All but the last end with a sync flush rather than a final block,
+ *	so their concatenation is one valid deflate stream, the way pigz
+ *	does it. Each segment goes out as an IDAT chunk of its own, and
+ *	the Adler-32 of the zlib stream is combined from theirs.
+ * QOI	the state of a QOI decoder at any pixel follows from the pixels
+ *	before it: the previous pixel, and in the index the last pixel
+ *	seen with each hash. A segment starts from the pixel before it
+ *	and an index it knows nothing of, so it only uses index entries
+ *	it has filled itself, and ends any run at its end. Its chunks then
+ *	decode the same after the segment before as they would alone.
+ *
+ * Segments cost a little compression at their starts, which is why they
+ * are at least IMAGE_SEGMENT_ROWS rows.
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <zlib.h>
+
+/* Fewest rows worth encoding on a thread of their own */
+#define IMAGE_SEGMENT_ROWS 32
+
+/* deflate level and strategy of PNG files. Filtered renders are mostly
+ * runs of zeros: run-length matches alone make smaller files than the
+ * default strategy at level 1, and take no longer.
+ */
+#define IMAGE_PNG_LEVEL 1
+#define IMAGE_PNG_STRATEGY Z_RLE
+
+typedef enum{
+	IMAGE_PPM,
+	IMAGE_PNG,
+	IMAGE_QOI,
+	IMAGE_PFM
+}imageFormat;
+
+/* An image file written a band of rows at a time, so the whole image
+ * never has to be in memory. The header goes out first and every band is
+ * appended as soon as it is finished.
+ */
+typedef struct{
+	FILE *f;
+	imageFormat format;
+	int width;
+	int height;
+	int rows;	/* rows written so far */
+	int threads;	/* to encode a band on */
+	unsigned char *last;	/* the last row written, for the rows after it */
+	uLong adler;	/* PNG: Adler-32 of the filtered rows so far */
+	long header;	/* PFM: bytes before the rows */
+}imageStream;
+
+/* One segment of rows of a band, and what encoding it made */
+typedef struct{
+	imageStream *p;
+	unsigned char *rows;	/* first row of the segment */
+	unsigned char *above;	/* the row before it, NULL for the first of the image */
+	int nrows;
+	bool final;		/* PNG: the segment ends the image */
+	unsigned char *out;
+	size_t size;
+	uLong adler;
+	size_t filtered;	/* PNG: bytes of filtered rows */
+	bool threaded;		/* encoded on a thread of its own */
+	int error;
+}imageSegment;
+
+/* The format of filename from its extension, PPM unless it is known */
+static imageFormat imageFormatOf(char *filename){
+	char *dot = strrchr(filename, '.');
+
+	if(dot != NULL && strcasecmp(dot, ".png") == 0) return IMAGE_PNG;
+	if(dot != NULL && strcasecmp(dot, ".qoi") == 0) return IMAGE_QOI;
+	if(dot != NULL && strcasecmp(dot, ".pfm") == 0) return IMAGE_PFM;
+	return IMAGE_PPM;
+}
+
+static void imagePut32(unsigned char *b, uint32_t v){
+	b[0] = v >> 24;
+	b[1] = v >> 16;
+	b[2] = v >> 8;
+	b[3] = v;
+}
+
+/* Write a PNG chunk, returns 0 on success */
+static int pngChunk(FILE *f, const char *type, unsigned char *data, size_t n){
+	unsigned char b[8];
+	uLong crc = crc32(crc32(0, NULL, 0), (const Bytef *)type, 4);
+
+	if(n > 0) crc = crc32(crc, data, n);
+	imagePut32(b, n);
+	memcpy(b + 4, type, 4);
+	if(fwrite(b, 1, 8, f) != 8 || (n > 0 && fwrite(data, 1, n, f) != n)) return -1;
+	imagePut32(b, crc);
+	return fwrite(b, 1, 4, f) == 4 ? 0 : -1;
+}
+
+static inline int pngPaeth(int a, int b, int c){
+	int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+	int bc = pb <= pc ? b : c;
+	return pa <= pb && pa <= pc ? a : bc;
+}
+
+/* The filter of PNG row type given the row above, or 0 for none, at byte i */
+static inline unsigned char pngFilterByte(int type, unsigned char *row, unsigned char *above, int i){
+	int a = i >= 3 ? row[i - 3] : 0;
+	int b = above[i];
+	int c = i >= 3 ? above[i - 3] : 0;
+
+	switch(type){
+	case 0: return row[i];
+	case 1: return row[i] - a;
+	case 2: return row[i] - b;
+	case 3: return row[i] - ((a + b) >> 1);
+	default: return row[i] - pngPaeth(a, b, c);
+	}
+}
+
+/* Filter row, given the row above (a row of zeros for none), into out:
+ * the filter byte, then n bytes. The filter whose bytes, taken as signed,
+ * add up to the least is kept, as libpng does. The sums of all five come
+ * from one pass over the row, and only the one kept is written.
+ */
+static void pngFilterRow(unsigned char *row, unsigned char *above, int n, unsigned char *out){
+	long sum[5] = {0, 0, 0, 0, 0};
+	int type, best = 0, i;
+
+	/* The first pixel has nothing to its left */
+	for(i = 0; i < 3 && i < n; i++){
+		int x = row[i], b = above[i];
+		sum[0] += abs((signed char)x);
+		sum[1] += abs((signed char)x);
+		sum[2] += abs((signed char)(x - b));
+		sum[3] += abs((signed char)(x - (b >> 1)));
+		sum[4] += abs((signed char)(x - b));
+	}
+	for(; i < n; i++){
+		int x = row[i], a = row[i - 3], b = above[i], c = above[i - 3];
+		sum[0] += abs((signed char)x);
+		sum[1] += abs((signed char)(x - a));
+		sum[2] += abs((signed char)(x - b));
+		sum[3] += abs((signed char)(x - ((a + b) >> 1)));
+		sum[4] += abs((signed char)(x - pngPaeth(a, b, c)));
+	}
+	for(type = 1; type < 5; type++)
+		if(sum[type] < sum[best]) best = type;
+	out[0] = best;
+	for(i = 0; i < n; i++)
+		out[i + 1] = pngFilterByte(best, row, above, i);
+}
+
+/* Filter and deflate a segment into a raw deflate stream that ends with
+ * a sync flush, or a final block for the last one
+ */
+static void pngEncode(imageSegment *g){
+	int n = 3 * g->p->width;
+	size_t stride = n + 1;
+	unsigned char *filtered = malloc(stride * g->nrows), *zeros = calloc(n, 1);
+	z_stream z;
+	int y;
+
+	g->out = NULL;
+	memset(&z, 0, sizeof(z));
+	if(filtered == NULL || zeros == NULL ||
+			deflateInit2(&z, IMAGE_PNG_LEVEL, Z_DEFLATED, -15, 8, IMAGE_PNG_STRATEGY) != Z_OK){
+		free(filtered);
+		free(zeros);
+		g->error = ENOMEM;
+		return;
+	}
+	for(y = 0; y < g->nrows; y++)
+		pngFilterRow(g->rows + (size_t)n * y, y > 0 ? g->rows + (size_t)n * (y - 1) :
+			g->above != NULL ? g->above : zeros, n, filtered + stride * y);
+	free(zeros);
+	g->filtered = stride * g->nrows;
+	g->adler = adler32(adler32(0, NULL, 0), filtered, g->filtered);
+
+	size_t bound = deflateBound(&z, g->filtered) + 16;
+	g->out = malloc(bound);
+	if(g->out == NULL){
+		g->error = ENOMEM;
+	}else{
+		z.next_in = filtered;
+		z.avail_in = g->filtered;
+		z.next_out = g->out;
+		z.avail_out = bound;
+		if(deflate(&z, g->final ? Z_FINISH : Z_SYNC_FLUSH) == Z_STREAM_ERROR || z.avail_in != 0)
+			g->error = EIO;
+		g->size = bound - z.avail_out;
+	}
+	deflateEnd(&z);
+	free(filtered);
+}
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+
+/* Encode a segment as QOI chunks that follow on from the pixel before
+ * it, see the top of the file
+ */
+static void qoiEncode(imageSegment *g){
+	size_t npixels = (size_t)g->p->width * g->nrows;
+	unsigned char *px = g->rows, *end = g->rows + 3 * npixels, *o;
+	unsigned char prev[3] = {0, 0, 0}, index[64][3];
+	uint64_t known = 0;
+	int run = 0;
+
+	/* At most 4 bytes a pixel, for a pixel that needs QOI_OP_RGB */
+	o = g->out = malloc(4 * npixels);
+	if(o == NULL){
+		g->error = ENOMEM;
+		return;
+	}
+	if(g->above != NULL)
+		memcpy(prev, g->above + 3 * (g->p->width - 1), 3);
+	for(; px < end; px += 3){
+		if(px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]){
+			if(++run == 62){
+				*o++ = QOI_OP_RUN | (run - 1);
+				run = 0;
+			}
+			continue;
+		}
+		if(run > 0){
+			*o++ = QOI_OP_RUN | (run - 1);
+			run = 0;
+		}
+		/* Alpha is always 255 */
+		int h = (px[0] * 3 + px[1] * 5 + px[2] * 7 + 255 * 11) % 64;
+		if(known >> h & 1 && index[h][0] == px[0] && index[h][1] == px[1] && index[h][2] == px[2]){
+			*o++ = QOI_OP_INDEX | h;
+		}else{
+			signed char dr = px[0] - prev[0], dg = px[1] - prev[1], db = px[2] - prev[2];
+			signed char drg = dr - dg, dbg = db - dg;
+			known |= (uint64_t)1 << h;
+			memcpy(index[h], px, 3);
+			if(dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1){
+				*o++ = QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2);
+			}else if(drg >= -8 && drg <= 7 && dg >= -32 && dg <= 31 && dbg >= -8 && dbg <= 7){
+				*o++ = QOI_OP_LUMA | (dg + 32);
+				*o++ = (drg + 8) << 4 | (dbg + 8);
+			}else{
+				*o++ = QOI_OP_RGB;
+				*o++ = px[0];
+				*o++ = px[1];
+				*o++ = px[2];
+			}
+		}
+		memcpy(prev, px, 3);
+	}
+	if(run > 0)
+		*o++ = QOI_OP_RUN | (run - 1);
+	g->size = o - g->out;
+}
+
+static void *imageSegmentMain(void *arg){
+	imageSegment *g = arg;
+
+	if(g->p->format == IMAGE_PNG)
+		pngEncode(g);
+	else
+		qoiEncode(g);
+	return NULL;
+}
+
+/* Open filename and write the header. Bands are encoded on up to threads
+ * threads. Returns 0 on success.
+ */
+static int imageBegin(imageStream *p, char *filename, int width, int height, int threads){
+	int ok = 1;
+
+	p->f = fopen(filename, "wb");
+	if(p->f == NULL) return -1;
+	p->format = imageFormatOf(filename);
+	p->width = width;
+	p->height = height;
+	p->rows = 0;
+	p->threads = threads > 0 ? threads : 1;
+	p->last = NULL;
+	p->adler = adler32(0, NULL, 0);
+	p->header = 0;
+	if(p->format == IMAGE_PNG || p->format == IMAGE_QOI){
+		p->last = malloc((size_t)3 * width);
+		if(p->last == NULL){
+			fclose(p->f);
+			return -1;
+		}
+	}
+
+	if(p->format == IMAGE_PPM){
+		ok = fprintf(p->f, "P6 %d %d %d\n", width, height, 255) >= 0;
+	}else if(p->format == IMAGE_PNG){
+		/* 8 bit RGB, no interlacing. The zlib header of the image data,
+		 * deflate with a 32k window at the fastest level, goes out as a
+		 * chunk of its own.
+		 */
+		unsigned char ihdr[13] = {0, 0, 0, 0, 0, 0, 0, 0, 8, 2, 0, 0, 0};
+		unsigned char zlibHeader[2] = {0x78, 0x01};
+		imagePut32(ihdr, width);
+		imagePut32(ihdr + 4, height);
+		ok = fwrite("\x89PNG\r\n\x1a\n", 1, 8, p->f) == 8 && pngChunk(p->f, "IHDR", ihdr, 13) == 0 &&
+			pngChunk(p->f, "IDAT", zlibHeader, 2) == 0;
+	}else if(p->format == IMAGE_QOI){
+		unsigned char h[14] = {'q', 'o', 'i', 'f', 0, 0, 0, 0, 0, 0, 0, 0, 3, 0};
+		imagePut32(h + 4, width);
+		imagePut32(h + 8, height);
+		ok = fwrite(h, 1, 14, p->f) == 14;
+	}else{
+		/* Floats in the byte order of this machine, which the sign of
+		 * the scale gives: negative for little endian
+		 */
+		uint16_t order = 1;
+		ok = fprintf(p->f, "PF\n%d %d\n%s\n", width, height,
+			*(unsigned char *)&order == 1 ? "-1.0" : "1.0") >= 0;
+		p->header = ftell(p->f);
+	}
+	if(!ok){
+		fclose(p->f);
+		free(p->last);
+		return -1;
+	}
+	return 0;
+}
+
+/* Append rows of 3 byte pixels, returns 0 on success */
+static int imageWriteRows(imageStream *p, unsigned char *rows, int nrows){
+	size_t rowBytes = (size_t)3 * p->width;
+	int nseg = nrows / IMAGE_SEGMENT_ROWS, i, error = 0;
+
+	if(p->format == IMAGE_PFM){
+		errno = EINVAL;
+		return -1;
+	}
+	if(p->format == IMAGE_PPM){
+		size_t n = rowBytes * nrows;
+		if(fwrite(rows, 1, n, p->f) != n) return -1;
+		p->rows += nrows;
+		return 0;
+	}
+	if(nrows <= 0) return 0;
+
+	if(nseg > p->threads) nseg = p->threads;
+	if(nseg < 1) nseg = 1;
+	imageSegment *segs = calloc(nseg, sizeof(imageSegment));
+	pthread_t *threads = malloc(nseg * sizeof(pthread_t));
+	if(segs == NULL || threads == NULL){
+		free(segs);
+		free(threads);
+		errno = ENOMEM;
+		return -1;
+	}
+	for(i = 0; i < nseg; i++){
+		imageSegment *g = &segs[i];
+		int y0 = (int)((long)nrows * i / nseg), y1 = (int)((long)nrows * (i + 1) / nseg);
+		g->p = p;
+		g->rows = rows + rowBytes * y0;
+		g->nrows = y1 - y0;
+		g->above = y0 > 0 ? g->rows - rowBytes : p->rows > 0 ? p->last : NULL;
+		g->final = p->rows + y1 == p->height;
+	}
+
+	/* The calling thread encodes the first segment */
+	for(i = 1; i < nseg; i++)
+		segs[i].threaded = pthread_create(&threads[i], NULL, imageSegmentMain, &segs[i]) == 0;
+	imageSegmentMain(&segs[0]);
+	for(i = 1; i < nseg; i++){
+		if(segs[i].threaded)
+			pthread_join(threads[i], NULL);
+		else
+			imageSegmentMain(&segs[i]);
+	}
+
+	for(i = 0; i < nseg; i++){
+		imageSegment *g = &segs[i];
+		if(g->error != 0 && error == 0) error = g->error;
+		if(error == 0 && p->format == IMAGE_PNG){
+			p->adler = adler32_combine(p->adler, g->adler, g->filtered);
+			if(pngChunk(p->f, "IDAT", g->out, g->size) != 0) error = errno ? errno : EIO;
+		}else if(error == 0 && fwrite(g->out, 1, g->size, p->f) != g->size)
+			error = errno ? errno : EIO;
+		free(g->out);
+	}
+	free(segs);
+	free(threads);
+	if(error != 0){
+		errno = error;
+		return -1;
+	}
+	memcpy(p->last, rows + rowBytes * (nrows - 1), rowBytes);
+	p->rows += nrows;
+	return 0;
+}
+
+/* Append rows of 3 float pixels to a PFM file, returns 0 on success.
+ * PFM goes from the bottom row up, so each band goes before the one
+ * above it, at the place the size of the image gives.
+ */
+static int imageWriteFloats(imageStream *p, float *rows, int nrows){
+	size_t rowBytes = (size_t)3 * p->width * sizeof(float);
+	int y;
+
+	if(p->format != IMAGE_PFM){
+		errno = EINVAL;
+		return -1;
+	}
+	if(nrows <= 0) return 0;
+	if(fseek(p->f, p->header + (long)(p->height - p->rows - nrows) * rowBytes, SEEK_SET) != 0)
+		return -1;
+	for(y = nrows - 1; y >= 0; y--)
+		if(fwrite(rows + (size_t)3 * p->width * y, 1, rowBytes, p->f) != rowBytes) return -1;
+	p->rows += nrows;
+	return 0;
+}
+
+/* Write the trailer and close the file, returns 0 if every row made it
+ * to disk
+ */
+static int imageEnd(imageStream *p){
+	int ok = p->rows == p->height;
+
+	if(ok && p->format == IMAGE_PNG){
+		unsigned char adler[4];
+		imagePut32(adler, p->adler);
+		ok = pngChunk(p->f, "IDAT", adler, 4) == 0 && pngChunk(p->f, "IEND", NULL, 0) == 0;
+	}else if(ok && p->format == IMAGE_QOI){
+		static const unsigned char qoiEnd[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+		ok = fwrite(qoiEnd, 1, 8, p->f) == 8;
+	}
+	free(p->last);
+	if(fclose(p->f) != 0) ok = 0;
+	return ok ? 0 : -1;
+}
+
+/* Give up on an image part way through: close the file as far as it was
+ * written and free what the stream holds
+ */
+static void imageAbort(imageStream *p){
+	free(p->last);
+	fclose(p->f);
+}
+
+/* Frames of an animation waiting to be written. The renderer fills one
+ * buffer while a writer thread saves the ones before it, so tracing a
+ * frame overlaps with writing the last. There are FRAME_QUEUE buffers;
+ * the renderer only waits when all of them are still being written.
+ */
+#define FRAME_QUEUE 3
+#define FRAME_NAME 4096
+
+typedef struct{
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int width;
+	int height;
+	unsigned char *buffers[FRAME_QUEUE];
+	char names[FRAME_QUEUE][FRAME_NAME];
+	int head;		/* oldest frame not written yet */
+	int count;		/* frames handed over and not written yet */
+	bool closing;		/* no more frames will come */
+	int error;		/* errno of the first frame that failed, 0 if none */
+	char failed[FRAME_NAME];	/* and its name */
+	double waited;		/* seconds the renderer spent waiting for a buffer */
+	int threads;		/* to encode a frame on */
+}frameQueue;
+
+/* Write a whole frame, encoded on up to threads threads. Returns 0 on
+ * success.
+ */
+static int imageSave(char *filename, unsigned char *pixels, int width, int height, int threads){
+	imageStream p;
+	if(imageBegin(&p, filename, width, height, threads) != 0) return -1;
+	if(imageWriteRows(&p, pixels, height) != 0){
+		imageAbort(&p);
+		return -1;
+	}
+	return imageEnd(&p);
+}
+
+static void *frameWriterMain(void *arg){
+	frameQueue *q = arg;
+
+	pthread_mutex_lock(&q->lock);
+	for(;;){
+		while(q->count == 0 && !q->closing)
+			pthread_cond_wait(&q->changed, &q->lock);
+		if(q->count == 0) break;
+		int slot = q->head;
+		pthread_mutex_unlock(&q->lock);
+
+		/* The renderer never touches a buffer that is queued */
+		int failed = imageSave(q->names[slot], q->buffers[slot], q->width, q->height,
+			q->threads) != 0;
+
+		pthread_mutex_lock(&q->lock);
+		if(failed && q->error == 0){
+			q->error = errno ? errno : EIO;
+			strcpy(q->failed, q->names[slot]);
+		}
+		q->head = (q->head + 1) % FRAME_QUEUE;
+		q->count--;
+		pthread_cond_broadcast(&q->changed);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return NULL;
+}
+
+/* Allocate the buffers and start the writer, which encodes frames on up
+ * to threads threads. Returns 0 on success.
+ */
+static int frameQueueStart(frameQueue *q, int width, int height, int threads){
+	int i;
+
+	memset(q, 0, sizeof(*q));
+	q->width = width;
+	q->height = height;
+	q->threads = threads;
+	for(i = 0; i < FRAME_QUEUE; i++){
+		q->buffers[i] = malloc((size_t)3 * width * height);
+		if(q->buffers[i] == NULL) goto fail;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->changed, NULL);
+	if(pthread_create(&q->writer, NULL, frameWriterMain, q) != 0){
+		pthread_mutex_destroy(&q->lock);
+		pthread_cond_destroy(&q->changed);
+		goto fail;
+	}
+	return 0;
+
+fail:
+	for(i = 0; i < FRAME_QUEUE; i++)
+		free(q->buffers[i]);
+	return -1;
+}
+
+/* The buffer to render the next frame into. Waits while every buffer
+ * is still queued.
+ */
+static unsigned char *frameQueueNext(frameQueue *q){
+	struct timespec t0, t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	pthread_mutex_lock(&q->lock);
+	while(q->count == FRAME_QUEUE)
+		pthread_cond_wait(&q->changed, &q->lock);
+	unsigned char *buffer = q->buffers[(q->head + q->count) % FRAME_QUEUE];
+	pthread_mutex_unlock(&q->lock);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	q->waited += (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+	return buffer;
+}
+
+/* Hand the buffer from frameQueueNext() to the writer, to be saved as
+ * filename
+ */
+static void frameQueuePush(frameQueue *q, char *filename){
+	pthread_mutex_lock(&q->lock);
+	int slot = (q->head + q->count) % FRAME_QUEUE;
+	snprintf(q->names[slot], FRAME_NAME, "%s", filename);
+	q->count++;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Wait until every frame is written and stop the writer. Returns 0 if
+ * all of them were, otherwise reports the first that failed.
+ */
+static int frameQueueFinish(frameQueue *q){
+	int i;
+
+	pthread_mutex_lock(&q->lock);
+	q->closing = true;
+	pthread_cond_broadcast(&q->changed);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->writer, NULL);
+
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->changed);
+	for(i = 0; i < FRAME_QUEUE; i++)
+		free(q->buffers[i]);
+	if(q->error != 0){
+		errno = q->error;
+		perror(q->failed);
+		return -1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,326 @@
+/* Geometry instancing.
+ *
+ * A prototype is a group of spheres and boxes with a BVH of its own. An
+ * instance places a copy of a prototype in the scene by a rotation, a
+ * uniform scale and a translation, and can give the whole copy one
+ * material. The scene BVH holds one primitive per instance, the box
+ * around its transformed prototype; a ray that reaches it is moved into
+ * the space of the prototype and traced through the prototype's BVH. So
+ * memory and build time grow with the prototypes, and with 60 bytes of
+ * scene file and 28 bytes of bounds per copy.
+ *
+ * A uniform scale keeps directions of unit length, so the intersection
+ * kernels work unchanged, and a distance t in the prototype is
+ * scale * t in the scene. A ray is first moved along itself to one
+ * diagonal of the copy's bounds before it enters them, so in the
+ * prototype it starts at most a few of its own sizes away wherever it
+ * came from. That keeps the rounding of the kernels, and the padding of
+ * the prototype's BVH against it, to the size of the prototype instead
+ * of the scene.
+ *
+ * Instances number the primitives of their copies one after the other,
+ * spheres before boxes like the slots of bvhSlotRef(): the first
+ * primitive of instance i is number base[i]. A hit inside an instance is
+ * PRIM_REF(PRIM_INSTANCE, that number), which tells the instance and the
+ * primitive apart without a wider reference and keeps ties in scan
+ * order. Only the references in the prims of the scene BVH, and those
+ * of bvhSlotRef(), hold the index of the instance instead.
+ */
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+/* bvh.h includes this header at its end */
+#include <stdio.h>
+#include <math.h>
+
+#include "geometry.h"
+#include "bvh.h"
+#include "arena.h"
+#include "scenefile.h"
+
+struct instanceSet{
+	prototype *protos;
+	int nprotos;
+	sphere *spheres;	/* of all prototypes */
+	box *boxes;
+	instance *inst;
+	int ninst;
+	bvh *accel;		/* one per prototype */
+	int *base;		/* first primitive of every instance, base[ninst] is all of them */
+	vector *lo, *hi;	/* bounds of every instance in the scene */
+};
+
+/* v turned by the rotation of in, and back */
+static inline vector instanceTurn(instance *in, vector *v){
+	vector r = {in->rot[0][0] * v->x + in->rot[0][1] * v->y + in->rot[0][2] * v->z,
+		in->rot[1][0] * v->x + in->rot[1][1] * v->y + in->rot[1][2] * v->z,
+		in->rot[2][0] * v->x + in->rot[2][1] * v->y + in->rot[2][2] * v->z};
+	return r;
+}
+
+static inline vector instanceTurnBack(instance *in, vector *v){
+	vector r = {in->rot[0][0] * v->x + in->rot[1][0] * v->y + in->rot[2][0] * v->z,
+		in->rot[0][1] * v->x + in->rot[1][1] * v->y + in->rot[2][1] * v->z,
+		in->rot[0][2] * v->x + in->rot[1][2] * v->y + in->rot[2][2] * v->z};
+	return r;
+}
+
+static inline int instanceCount(instanceSet *set){
+	return set->ninst;
+}
+
+/* Bounds of instance i in the scene */
+static inline void instanceGetBounds(instanceSet *set, int i, vector *lo, vector *hi){
+	*lo = set->lo[i];
+	*hi = set->hi[i];
+}
+
+/* Ray r of the scene in the space of the prototype of instance i, inv
+ * rayInverse() of its direction. It starts *t0 along r.
+ */
+static inline ray instanceRay(instanceSet *set, int i, ray *r, vector *inv, float *t0){
+	instance *in = &set->inst[i];
+	vector *lo = &set->lo[i], *hi = &set->hi[i];
+	float tx1 = (lo->x - r->start.x) * inv->x, tx2 = (hi->x - r->start.x) * inv->x;
+	float ty1 = (lo->y - r->start.y) * inv->y, ty2 = (hi->y - r->start.y) * inv->y;
+	float tz1 = (lo->z - r->start.z) * inv->z, tz2 = (hi->z - r->start.z) * inv->z;
+	float tnear = fmaxf(fmaxf(fminf(tx1, tx2), fminf(ty1, ty2)), fminf(tz1, tz2));
+	float tfar = fminf(fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2)), fmaxf(tz1, tz2));
+	vector diag = vectorSub(hi, lo);
+	float back = sqrtf(vectorDot(&diag, &diag));
+
+	/* A ray that seems to miss the bounds is left where it is */
+	*t0 = tfar >= tnear && tnear - back > 0 ? tnear - back : 0;
+	vector step = vectorScale(*t0, &r->dir);
+	vector o = vectorAdd(&r->start, &step);
+	o = vectorSub(&o, &in->pos);
+	ray l;
+	l.start = instanceTurnBack(in, &o);
+	l.start = vectorScale(1 / in->scale, &l.start);
+	l.dir = instanceTurnBack(in, &r->dir);
+	return l;
+}
+
+/* A distance t of the scene in the prototype of in for a ray moved to
+ * t0, rounded up so no hit before it is lost
+ */
+static inline float instanceReach(instance *in, float t, float t0){
+	if(!(t < INFINITY)) return t;
+	return bvhNextUp(bvhNextUp((t - t0) / in->scale));
+}
+
+/* The instance a hit reference falls in, by the number of its primitive */
+static inline int instanceOf(instanceSet *set, int ref){
+	int n = PRIM_INDEX(ref), lo = 0, hi = set->ninst - 1;
+	while(lo < hi){
+		int mid = (lo + hi + 1) / 2;
+		if(set->base[mid] <= n) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+/* The reference in its prototype of the primitive hit ref names */
+static inline int instanceLocalRef(instanceSet *set, int i, int ref){
+	prototype *p = &set->protos[set->inst[i].proto];
+	return bvhSlotRef(PRIM_INDEX(ref) - set->base[i], p->nspheres, p->nboxes, 0);
+}
+
+/* The closest hit of r in instance i, taken as bvhTakeHit() does. inv
+ * is rayInverse() of the direction. The primitives tested are added to
+ * *tests.
+ */
+static inline void instanceClosestHit(instanceSet *set, int i, ray *r, vector *inv, float *t,
+		int *best, long *tests){
+	instance *in = &set->inst[i];
+	prototype *p = &set->protos[in->proto];
+	float t0;
+	ray l = instanceRay(set, i, r, inv, &t0);
+	float tl = instanceReach(in, *t, t0);
+
+	if(!(tl > 0)) return;
+	int hit = bvhClosestHit(&set->accel[in->proto], set->spheres + p->firstSphere,
+		set->boxes + p->firstBox, NULL, NULL, &l, &tl, tests);
+	if(hit >= 0)
+		bvhTakeHit(t0 + tl * in->scale, PRIM_REF(PRIM_INSTANCE,
+			set->base[i] + bvhRefSlot(hit, p->nspheres, p->nboxes, 0)), t, best);
+}
+
+/* Any primitive of instance i that r hits before tmax, as a hit
+ * reference, or -1
+ */
+static inline int instanceAnyHit(instanceSet *set, int i, ray *r, vector *inv, float tmax,
+		long *tests){
+	instance *in = &set->inst[i];
+	prototype *p = &set->protos[in->proto];
+	float t0;
+	ray l = instanceRay(set, i, r, inv, &t0);
+	vector linv = rayInverse(&l.dir);
+
+	if(t0 >= tmax) return -1;
+	int hit = bvhAnyHit(&set->accel[in->proto], set->spheres + p->firstSphere,
+		set->boxes + p->firstBox, NULL, NULL, &l, &linv, (tmax - t0) / in->scale, tests);
+	if(hit < 0) return -1;
+	return PRIM_REF(PRIM_INSTANCE, set->base[i] + bvhRefSlot(hit, p->nspheres, p->nboxes, 0));
+}
+
+/* Does the primitive of hit reference ref block r before tmax? */
+static inline bool instanceBlocks(instanceSet *set, int ref, ray *r, vector *inv, float tmax){
+	int i = instanceOf(set, ref);
+	instance *in = &set->inst[i];
+	prototype *p = &set->protos[in->proto];
+	float t0;
+	ray l = instanceRay(set, i, r, inv, &t0);
+	vector linv = rayInverse(&l.dir);
+
+	if(t0 >= tmax) return false;
+	return bvhBlocks(set->spheres + p->firstSphere, set->boxes + p->firstBox, NULL, NULL,
+		instanceLocalRef(set, i, ref), &l, &linv, NULL, (tmax - t0) / in->scale);
+}
+
+/* Material of the primitive of hit reference ref */
+static inline int instanceMaterial(instanceSet *set, int ref){
+	int i = instanceOf(set, ref);
+	instance *in = &set->inst[i];
+	prototype *p = &set->protos[in->proto];
+	int local = instanceLocalRef(set, i, ref);
+
+	if(in->material >= 0) return in->material;
+	if(PRIM_KIND(local) == PRIM_SPHERE)
+		return set->spheres[p->firstSphere + PRIM_INDEX(local)].material;
+	return set->boxes[p->firstBox + PRIM_INDEX(local)].material;
+}
+
+/* Unit normal in the scene where r hits the primitive of hit reference
+ * ref at t. Returns false if there is none.
+ */
+static inline bool instanceNormal(instanceSet *set, int ref, ray *r, float t, vector *n){
+	int i = instanceOf(set, ref);
+	instance *in = &set->inst[i];
+	prototype *p = &set->protos[in->proto];
+	int local = instanceLocalRef(set, i, ref);
+	vector inv = rayInverse(&r->dir);
+	float t0;
+	ray l = instanceRay(set, i, r, &inv, &t0);
+	vector ln;
+
+	if(PRIM_KIND(local) == PRIM_SPHERE){
+		sphere *sp = &set->spheres[p->firstSphere + PRIM_INDEX(local)];
+		vector scaled = vectorScale((t - t0) / in->scale, &l.dir);
+		vector at = vectorAdd(&l.start, &scaled);
+		ln = vectorSub(&at, &sp->pos);
+		float len = vectorDot(&ln, &ln);
+		if(len == 0) return false;
+		ln = vectorScale(1.0f / sqrtf(len), &ln);
+	}else{
+		vector linv = rayInverse(&l.dir);
+		ln = boxNormal(&l, &linv, &set->boxes[p->firstBox + PRIM_INDEX(local)]);
+	}
+	*n = instanceTurn(in, &ln);
+	return true;
+}
+
+/* Bounds of instance i in the scene, around the corners of the bounds
+ * lo..hi of its prototype
+ */
+static void instanceBounds(instance *in, vector *plo, vector *phi, vector *lo, vector *hi){
+	int c;
+
+	boundsEmpty(lo, hi);
+	for(c = 0; c < 8; c++){
+		vector corner = {c & 1 ? phi->x : plo->x, c & 2 ? phi->y : plo->y, c & 4 ? phi->z : plo->z};
+		vector w = instanceTurn(in, &corner);
+		w = vectorScale(in->scale, &w);
+		w = vectorAdd(&w, &in->pos);
+		boundsGrow(lo, hi, &w, &w);
+	}
+}
+
+/* Set up the instances of a scene, with the arrays of a scene file, and
+ * build the BVH of every prototype. What lasts as long as the scene is
+ * taken from mem. Returns -1 after printing why if the instances cannot
+ * be used.
+ */
+static inline int instanceSetup(instanceSet *set, arena *mem, prototype *protos, int nprotos,
+		sphere *spheres, box *boxes, instance *inst, int ninst){
+	vector *plo, *phi;
+	long n = 0;
+	int i;
+
+	set->protos = protos;
+	set->nprotos = nprotos;
+	set->spheres = spheres;
+	set->boxes = boxes;
+	set->inst = inst;
+	set->ninst = ninst;
+	set->accel = arenaCalloc(mem, nprotos * sizeof(bvh));
+	set->base = arenaAlloc(mem, (ninst + 1) * sizeof(int));
+	set->lo = arenaAlloc(mem, ninst * sizeof(vector));
+	set->hi = arenaAlloc(mem, ninst * sizeof(vector));
+	plo = arenaAlloc(mem, nprotos * sizeof(vector));
+	phi = arenaAlloc(mem, nprotos * sizeof(vector));
+	if(set->accel == NULL || set->base == NULL || set->lo == NULL || set->hi == NULL ||
+			plo == NULL || phi == NULL){
+		fprintf(stderr, "instanceSetup: out of memory\n");
+		return -1;
+	}
+
+	/* The bounds of the prototypes, and of their copies */
+	for(i = 0; i < nprotos; i++){
+		prototype *p = &protos[i];
+		int k;
+		boundsEmpty(&plo[i], &phi[i]);
+		for(k = 0; k < p->nspheres + p->nboxes; k++){
+			vector lo, hi;
+			bvhPrimBounds(spheres + p->firstSphere, p->nspheres, boxes + p->firstBox, p->nboxes,
+				NULL, NULL, k, &lo, &hi);
+			boundsGrow(&plo[i], &phi[i], &lo, &hi);
+		}
+	}
+	for(i = 0; i < ninst; i++){
+		prototype *p = &protos[inst[i].proto];
+		set->base[i] = n;
+		n += p->nspheres + p->nboxes;
+		if(n >= 1 << PRIM_INDEX_BITS){
+			fprintf(stderr, "instanceSetup: more primitives in the copies than a reference can name\n");
+			return -1;
+		}
+		instanceBounds(&inst[i], &plo[inst[i].proto], &phi[inst[i].proto], &set->lo[i], &set->hi[i]);
+	}
+	set->base[ninst] = n;
+
+	/* The bounds of a copy are at most sqrt(3) diagonals of its prototype
+	 * across, and instanceRay() starts a ray no more than one of their
+	 * diagonals before them, so in the prototype rays start within four
+	 * of its diagonals
+	 */
+	for(i = 0; i < nprotos; i++){
+		prototype *p = &protos[i];
+		vector diag = vectorSub(&phi[i], &plo[i]);
+		float r = 4 * sqrtf(vectorDot(&diag, &diag));
+		vector lo = {plo[i].x - r, plo[i].y - r, plo[i].z - r};
+		vector hi = {phi[i].x + r, phi[i].y + r, phi[i].z + r};
+		bvhBuild(&set->accel[i], spheres + p->firstSphere, p->nspheres, boxes + p->firstBox,
+			p->nboxes, NULL, NULL, &lo, &hi);
+	}
+	return 0;
+}
+
+static inline void instanceFree(instanceSet *set){
+	int i;
+	for(i = 0; i < set->nprotos; i++)
+		bvhFree(&set->accel[i]);
+}
+
+/* Bytes the instances take beyond the scene file: the bounds and
+ * numbers of the copies and the BVHs of the prototypes
+ */
+static inline size_t instanceBytes(instanceSet *set){
+	size_t n = (size_t)set->ninst * (2 * sizeof(vector) + sizeof(int));
+	int i;
+	for(i = 0; i < set->nprotos; i++)
+		n += bvhBytes(&set->accel[i]);
+	return n;
+}
+
+#endif
@@ -0,0 +1,321 @@
+/* Light culling: which lights can reach a point.
+ *
+ * A light with a radius only lights the points inside it, so shading a
+ * hit only has to visit the lights whose sphere holds it. A uniform grid
+ * over those spheres lists for every cell the lights that reach into it.
+ * A hit looks up its cell and visits those lights and the ones without a
+ * radius, which reach everywhere. With the lights spread over the scene
+ * the cost of a hit follows the number of lights around it, not the
+ * number in the scene. Lights are always visited in the order of the
+ * scene, so the colours come out the same as visiting every light.
+ *
+ * Where even the lights around a hit are too many, lightShade() can pick
+ * a few of them at random, each with a probability following how much it
+ * can add, and scale up what they add so the expected colour stays the
+ * same.
+ */
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "geometry.h"
+#include "arena.h"
+
+/* Most cells along an axis of the grid, and the most cells per light
+ * with a radius. Cells are half the average radius unless that makes
+ * more cells than that, which happens when the lights are sparse.
+ */
+#define LIGHT_GRID_MAX 256
+#define LIGHT_GRID_CELLS 16.0f
+
+/* Most lights lightShade() can be asked to pick at a point */
+#define LIGHT_SAMPLES_MAX 16
+
+typedef struct{
+	vector lo;		/* corner of the grid */
+	vector inv;		/* cells per scene unit along each axis */
+	int nx, ny, nz;
+	int *start;		/* cell i lists index[start[i]] to index[start[i + 1] - 1] */
+	int *index;		/* lights with a radius, in scene order in every cell */
+	int *global;		/* lights without a radius */
+	int nglobal;
+	arena mem;		/* start, index and global */
+}lightGrid;
+
+/* Does the sphere of light l reach into the box lo..hi? */
+static inline bool lightReachesBox(light *l, vector *lo, vector *hi){
+	float dx = fmaxf(fmaxf(lo->x - l->pos.x, l->pos.x - hi->x), 0);
+	float dy = fmaxf(fmaxf(lo->y - l->pos.y, l->pos.y - hi->y), 0);
+	float dz = fmaxf(fmaxf(lo->z - l->pos.z, l->pos.z - hi->z), 0);
+	return dx * dx + dy * dy + dz * dz < l->radius * l->radius;
+}
+
+/* The cell along one axis that coordinate v falls in, clamped to the grid */
+static inline int lightGridAxis(float v, float lo, float inv, int n){
+	int i = (int)((v - lo) * inv);
+	return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+/* Add light l to the cells it reaches: only counted in start when index
+ * is NULL, otherwise stored at the positions start gives and advances
+ */
+static void lightGridAdd(lightGrid *g, light *lights, int l, int *start, int *index){
+	light *lt = &lights[l];
+	float cx = 1 / g->inv.x, cy = 1 / g->inv.y, cz = 1 / g->inv.z;
+	int x0 = lightGridAxis(lt->pos.x - lt->radius, g->lo.x, g->inv.x, g->nx);
+	int x1 = lightGridAxis(lt->pos.x + lt->radius, g->lo.x, g->inv.x, g->nx);
+	int y0 = lightGridAxis(lt->pos.y - lt->radius, g->lo.y, g->inv.y, g->ny);
+	int y1 = lightGridAxis(lt->pos.y + lt->radius, g->lo.y, g->inv.y, g->ny);
+	int z0 = lightGridAxis(lt->pos.z - lt->radius, g->lo.z, g->inv.z, g->nz);
+	int z1 = lightGridAxis(lt->pos.z + lt->radius, g->lo.z, g->inv.z, g->nz);
+	int x, y, z;
+
+	for(z = z0; z <= z1; z++)
+		for(y = y0; y <= y1; y++)
+			for(x = x0; x <= x1; x++){
+				/* Cells are a little larger than they are, for rounding */
+				vector lo = {g->lo.x + (x - 0.01f) * cx, g->lo.y + (y - 0.01f) * cy,
+					g->lo.z + (z - 0.01f) * cz};
+				vector hi = {g->lo.x + (x + 1.01f) * cx, g->lo.y + (y + 1.01f) * cy,
+					g->lo.z + (z + 1.01f) * cz};
+				int cell = (z * g->ny + y) * g->nx + x;
+				if(!lightReachesBox(lt, &lo, &hi)) continue;
+				if(index == NULL) start[cell + 1]++;
+				else index[start[cell]++] = l;
+			}
+}
+
+/* Build the grid again over lights that moved, in the memory of the
+ * last build. See lightGridBuild().
+ */
+static int lightGridRebuild(lightGrid *g, light *lights, int nlights){
+	vector lo = {INFINITY, INFINITY, INFINITY}, hi = {-INFINITY, -INFINITY, -INFINITY};
+	double sum = 0;
+	int nbounded = 0, ncells, i;
+
+	arenaReset(&g->mem);
+	g->start = g->index = NULL;
+	g->global = arenaAlloc(&g->mem, (nlights > 0 ? nlights : 1) * sizeof(int));
+	g->nglobal = 0;
+	if(g->global == NULL) return -1;
+	for(i = 0; i < nlights; i++){
+		light *l = &lights[i];
+		if(l->radius <= 0){
+			g->global[g->nglobal++] = i;
+			continue;
+		}
+		lo.x = fminf(lo.x, l->pos.x - l->radius); hi.x = fmaxf(hi.x, l->pos.x + l->radius);
+		lo.y = fminf(lo.y, l->pos.y - l->radius); hi.y = fmaxf(hi.y, l->pos.y + l->radius);
+		lo.z = fminf(lo.z, l->pos.z - l->radius); hi.z = fmaxf(hi.z, l->pos.z + l->radius);
+		sum += l->radius;
+		nbounded++;
+	}
+
+	g->nx = g->ny = g->nz = 1;
+	g->lo = lo;
+	g->inv.x = g->inv.y = g->inv.z = 1;
+	if(nbounded > 0){
+		vector size = vectorSub(&hi, &lo);
+		float cell = 0.5f * sum / nbounded;
+		float volume = (double)size.x * size.y * size.z;
+		/* At most about LIGHT_GRID_CELLS cells per light */
+		if(volume / (cell * cell * cell) > LIGHT_GRID_CELLS * nbounded)
+			cell = cbrtf(volume / (LIGHT_GRID_CELLS * nbounded));
+		g->nx = (int)fminf(ceilf(size.x / cell), LIGHT_GRID_MAX);
+		g->ny = (int)fminf(ceilf(size.y / cell), LIGHT_GRID_MAX);
+		g->nz = (int)fminf(ceilf(size.z / cell), LIGHT_GRID_MAX);
+		if(g->nx < 1) g->nx = 1;
+		if(g->ny < 1) g->ny = 1;
+		if(g->nz < 1) g->nz = 1;
+		g->inv.x = size.x > 0 ? g->nx / size.x : 1;
+		g->inv.y = size.y > 0 ? g->ny / size.y : 1;
+		g->inv.z = size.z > 0 ? g->nz / size.z : 1;
+	}
+	ncells = g->nx * g->ny * g->nz;
+
+	/* Count the lights of every cell, then store them where the counts
+	 * put them, in scene order
+	 */
+	g->start = arenaCalloc(&g->mem, (ncells + 1) * sizeof(int));
+	if(g->start == NULL) return -1;
+	for(i = 0; i < nlights; i++)
+		if(lights[i].radius > 0)
+			lightGridAdd(g, lights, i, g->start, NULL);
+	for(i = 0; i < ncells; i++)
+		g->start[i + 1] += g->start[i];
+	g->index = arenaAlloc(&g->mem, (g->start[ncells] > 0 ? g->start[ncells] : 1) * sizeof(int));
+	if(g->index == NULL) return -1;
+	for(i = 0; i < nlights; i++)
+		if(lights[i].radius > 0)
+			lightGridAdd(g, lights, i, g->start, g->index);
+	/* Storing moved every start up to where the next cell starts */
+	for(i = ncells; i > 0; i--)
+		g->start[i] = g->start[i - 1];
+	g->start[0] = 0;
+	return 0;
+}
+
+/* Build the grid over the lights, see LIGHT_GRID_CELLS, in an arena of
+ * its own. Returns 0, or -1 if there is not enough memory.
+ */
+static int lightGridBuild(lightGrid *g, light *lights, int nlights){
+	arenaInit(&g->mem, "lights", 0);
+	return lightGridRebuild(g, lights, nlights);
+}
+
+static void lightGridFree(lightGrid *g){
+	arenaFree(&g->mem);
+}
+
+/* Bytes the grid takes */
+static size_t lightGridBytes(lightGrid *g){
+	int ncells = g->nx * g->ny * g->nz;
+	return (ncells + 1 + g->start[ncells]) * sizeof(int) + g->nglobal * sizeof(int);
+}
+
+/* Visits the lights that can reach a point in scene order, see
+ * lightIterStart()
+ */
+typedef struct{
+	int *a, *b;	/* the lights of the cell and the global ones */
+	int na, nb;
+	int all;	/* without a grid: visit lights 0 to all - 1 */
+	int count;	/* lights it will visit */
+}lightIter;
+
+/* Start visiting the lights that can reach p. Without a grid, g is NULL,
+ * every one of the nlights lights is visited.
+ */
+static inline void lightIterStart(lightIter *it, lightGrid *g, int nlights, vector *p){
+	it->na = it->nb = it->all = 0;
+	if(g == NULL){
+		it->all = nlights;
+		it->count = nlights;
+		return;
+	}
+	it->b = g->global;
+	it->nb = g->nglobal;
+	float fx = (p->x - g->lo.x) * g->inv.x;
+	float fy = (p->y - g->lo.y) * g->inv.y;
+	float fz = (p->z - g->lo.z) * g->inv.z;
+	if(fx >= 0 && fy >= 0 && fz >= 0 && fx <= g->nx && fy <= g->ny && fz <= g->nz){
+		/* Points on the far faces belong to the last cell */
+		int x = fx < g->nx ? (int)fx : g->nx - 1;
+		int y = fy < g->ny ? (int)fy : g->ny - 1;
+		int z = fz < g->nz ? (int)fz : g->nz - 1;
+		int cell = (z * g->ny + y) * g->nx + x;
+		it->a = g->index + g->start[cell];
+		it->na = g->start[cell + 1] - g->start[cell];
+	}
+	it->count = it->na + it->nb;
+}
+
+/* The next light, -1 when there are no more */
+static inline int lightIterNext(lightIter *it){
+	if(it->all > 0){
+		it->count--;
+		return it->count >= 0 ? it->all - 1 - it->count : -1;
+	}
+	if(it->na > 0 && (it->nb == 0 || *it->a < *it->b)){
+		it->na--;
+		return *it->a++;
+	}
+	if(it->nb > 0){
+		it->nb--;
+		return *it->b++;
+	}
+	return -1;
+}
+
+/* How much light l can add at point p with normal n before shadows, as
+ * a single number to choose lights by
+ */
+static inline float lightImportance(light *l, vector *p, vector *n){
+	vector d = vectorSub(&l->pos, p);
+	float facing = vectorDot(n, &d);
+	if(facing <= 0) return 0;
+	float d2 = vectorDot(&d, &d);
+	float falloff = lightFalloff(l, d2);
+	if(falloff <= 0) return 0;
+	return falloff * facing / sqrtf(d2) *
+		(l->intensity.red + l->intensity.green + l->intensity.blue);
+}
+
+/* A number in [0, 1) for choice k among the lights at a point with seed */
+static inline float lightRandom(uint32_t seed, uint32_t k){
+	uint32_t h = seed ^ (k * 0x9e3779b1u);
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return (h >> 8) * (1.0f / 16777216);
+}
+
+/* Seed for the choice of lights at point p, the same every time p is
+ * shaded
+ */
+static inline uint32_t lightSeed(vector *p){
+	union{ float f; uint32_t u; } x, y, z;
+	x.f = p->x;
+	y.f = p->y;
+	z.f = p->z;
+	return x.u * 0x85ebca77u ^ y.u * 0xc2b2ae3du ^ z.u * 0x27d4eb2fu;
+}
+
+/* Shade point p with normal n by the lights that can reach it, as
+ * shadeLambert() does. With 0 < samples <= LIGHT_SAMPLES_MAX and more
+ * lights than that around, only samples lights are shaded (with shadow
+ * rays), each chosen with a probability following lightImportance()
+ * and weighted by the inverse of it, so the expected colour is the
+ * same. The lights visited are added to *visited.
+ */
+static inline void lightShade(lightGrid *g, light *lights, int nlights, int samples,
+		vector *p, vector *n, material *m, float coef, colour *c,
+		shadowFunc *shadow, void *ctx, long *visited){
+	lightIter it;
+	int j, k;
+
+	lightIterStart(&it, g, nlights, p);
+	*visited += it.count;
+	if(samples <= 0 || it.count <= samples){
+		while((j = lightIterNext(&it)) >= 0)
+			shadeLight(lights, j, p, n, m, coef, c, shadow, ctx);
+		return;
+	}
+
+	/* One weighted reservoir per sample, all over the same weights: each
+	 * keeps light j with probability w(j) / sum(w) in the end
+	 */
+	int chosen[LIGHT_SAMPLES_MAX];
+	float weight[LIGHT_SAMPLES_MAX];
+	float sum = 0;
+	uint32_t seed = lightSeed(p);
+	int i = 0;
+
+	for(k = 0; k < samples; k++){
+		chosen[k] = -1;
+		weight[k] = 0;
+	}
+	while((j = lightIterNext(&it)) >= 0){
+		float w = lightImportance(&lights[j], p, n);
+		i++;
+		if(w <= 0) continue;
+		sum += w;
+		for(k = 0; k < samples; k++)
+			if(lightRandom(seed, (uint32_t)i * samples + k) * sum < w){
+				chosen[k] = j;
+				weight[k] = w;
+			}
+	}
+	for(k = 0; k < samples; k++)
+		if(chosen[k] >= 0)
+			shadeLight(lights, chosen[k], p, n, m, coef * sum / (weight[k] * samples), c,
+				shadow, ctx);
+}
+
+#endif
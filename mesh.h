@@ -0,0 +1,404 @@
+/* Triangle meshes.
+ *
+ * A mesh is kept as two compact buffers: every vertex once, three floats,
+ * and three vertex indices per triangle. A closed surface has about half
+ * as many vertices as triangles, so ten million triangles take about
+ * 180 MB. Every triangle is a primitive of its own in the BVH, like a
+ * sphere or a box, and they all have the material of the mesh.
+ *
+ * Rays are tested with the watertight algorithm of Woop, Benthin and
+ * Wald: the vertices are moved into a space where the ray runs from the
+ * origin along +z, and the signs of the three edge functions there say
+ * whether it hits. Triangles that share an edge compute the same edge
+ * function for it, so no ray slips through between them; where one
+ * comes out exactly 0 it is computed again in double. Triangles have two
+ * sides. meshTest4() tests four triangles, the triangles of a BVH leaf,
+ * against a ray at once with SSE; meshTest() does the same operations
+ * on one, so both give the same distances.
+ *
+ * meshLoadObj() reads an OBJ file in chunks, keeping only the vertices
+ * and the faces, which are cut into fans of triangles. Everything else
+ * (normals, texture coordinates, groups, materials) is skipped.
+ */
+#ifndef MESH_H
+#define MESH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+
+#include "geometry.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* Triangles meshTest4() tests at once */
+#define MESH_LANES 4
+
+/* Bytes of an OBJ file read at a time, also the longest line */
+#define MESH_CHUNK (1 << 20)
+
+typedef struct{
+	vector *verts;	/* one float more than the vertices, see meshTest4() */
+	int nverts;
+	int *tris;	/* vertex indices, three per triangle */
+	int ntris;
+	int material;
+}mesh;
+
+/* A ray set up for the watertight test: kz is the axis it runs along
+ * most, and the shear sx, sy, sz takes it to +z
+ */
+typedef struct{
+	vector org;
+	int kx, ky, kz;
+	float sx, sy, sz;
+}meshRay;
+
+static inline float meshAxis(vector *v, int k){
+	return k == 0 ? v->x : (k == 1 ? v->y : v->z);
+}
+
+static inline void meshRaySetup(ray *r, meshRay *m){
+	float ax = fabsf(r->dir.x), ay = fabsf(r->dir.y), az = fabsf(r->dir.z);
+
+	m->kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	m->kx = m->kz == 2 ? 0 : m->kz + 1;
+	m->ky = m->kx == 2 ? 0 : m->kx + 1;
+	float dz = meshAxis(&r->dir, m->kz);
+	if(dz < 0){
+		/* Keep the winding of the triangles */
+		int k = m->kx;
+		m->kx = m->ky;
+		m->ky = k;
+	}
+	m->sx = meshAxis(&r->dir, m->kx) / dz;
+	m->sy = meshAxis(&r->dir, m->ky) / dz;
+	m->sz = 1.0f / dz;
+	m->org = r->start;
+}
+
+/* The edge functions of a triangle whose sheared vertices are (ax, ay),
+ * (bx, by) and (cx, cy), in double where the float ones are exactly 0
+ */
+static void meshEdgesDouble(float ax, float ay, float bx, float by, float cx, float cy,
+		float *u, float *v, float *w){
+	*u = (float)((double)cx * by - (double)cy * bx);
+	*v = (float)((double)ax * cy - (double)ay * cx);
+	*w = (float)((double)bx * ay - (double)by * ax);
+}
+
+/* Distance to the hit of a triangle from its edge functions and the z of
+ * its vertices relative to the ray origin, INFINITY for a miss or a hit
+ * not between 0.001 and tmax
+ */
+static inline float meshDistance(meshRay *m, float u, float v, float w, float az, float bz,
+		float cz, float tmax){
+	if((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0)) return INFINITY;
+	float det = u + v + w;
+	if(det == 0) return INFINITY;
+	float t = (u * (m->sz * az) + v * (m->sz * bz) + w * (m->sz * cz)) / det;
+	return t > 0.001f && t < tmax ? t : INFINITY;
+}
+
+/* Distance along the ray to triangle tri of the mesh, INFINITY if it
+ * misses it or the hit is not between 0.001 and tmax
+ */
+static inline float meshTest(mesh *msh, int tri, meshRay *m, float tmax){
+	int *idx = &msh->tris[3 * tri];
+	vector a = vectorSub(&msh->verts[idx[0]], &m->org);
+	vector b = vectorSub(&msh->verts[idx[1]], &m->org);
+	vector c = vectorSub(&msh->verts[idx[2]], &m->org);
+	float az = meshAxis(&a, m->kz), bz = meshAxis(&b, m->kz), cz = meshAxis(&c, m->kz);
+	float ax = meshAxis(&a, m->kx) - m->sx * az, ay = meshAxis(&a, m->ky) - m->sy * az;
+	float bx = meshAxis(&b, m->kx) - m->sx * bz, by = meshAxis(&b, m->ky) - m->sy * bz;
+	float cx = meshAxis(&c, m->kx) - m->sx * cz, cy = meshAxis(&c, m->ky) - m->sy * cz;
+	float u = cx * by - cy * bx;
+	float v = ax * cy - ay * cx;
+	float w = bx * ay - by * ax;
+
+	if(u == 0 || v == 0 || w == 0)
+		meshEdgesDouble(ax, ay, bx, by, cx, cy, &u, &v, &w);
+	return meshDistance(m, u, v, w, az, bz, cz, tmax);
+}
+
+#ifdef __SSE2__
+
+/* Vertex k of the n triangles in tris, less the ray origin, as x, y and
+ * z rows of four lanes. A vertex is loaded as four floats, which is why
+ * the vertex buffer has one float more.
+ */
+static inline void meshGather(mesh *msh, const int *tris, int n, int k, meshRay *m, __m128 *rows){
+	__m128 v0 = _mm_loadu_ps(&msh->verts[msh->tris[3 * tris[0] + k]].x);
+	__m128 v1 = n > 1 ? _mm_loadu_ps(&msh->verts[msh->tris[3 * tris[1] + k]].x) : v0;
+	__m128 v2 = n > 2 ? _mm_loadu_ps(&msh->verts[msh->tris[3 * tris[2] + k]].x) : v0;
+	__m128 v3 = n > 3 ? _mm_loadu_ps(&msh->verts[msh->tris[3 * tris[3] + k]].x) : v0;
+	_MM_TRANSPOSE4_PS(v0, v1, v2, v3);
+	rows[0] = _mm_sub_ps(v0, _mm_set1_ps(m->org.x));
+	rows[1] = _mm_sub_ps(v1, _mm_set1_ps(m->org.y));
+	rows[2] = _mm_sub_ps(v2, _mm_set1_ps(m->org.z));
+}
+
+#endif
+
+/* Distances along the ray to the n <= MESH_LANES triangles in tris into
+ * t, as meshTest() gives them
+ */
+static inline void meshTest4(mesh *msh, const int *tris, int n, meshRay *m, float tmax, float *t){
+#ifdef __SSE2__
+	__m128 a[3], b[3], c[3];
+	float lt[4];
+	int j;
+
+	meshGather(msh, tris, n, 0, m, a);
+	meshGather(msh, tris, n, 1, m, b);
+	meshGather(msh, tris, n, 2, m, c);
+	__m128 sx = _mm_set1_ps(m->sx), sy = _mm_set1_ps(m->sy), sz = _mm_set1_ps(m->sz);
+	__m128 az = a[m->kz], bz = b[m->kz], cz = c[m->kz];
+	__m128 ax = _mm_sub_ps(a[m->kx], _mm_mul_ps(sx, az));
+	__m128 ay = _mm_sub_ps(a[m->ky], _mm_mul_ps(sy, az));
+	__m128 bx = _mm_sub_ps(b[m->kx], _mm_mul_ps(sx, bz));
+	__m128 by = _mm_sub_ps(b[m->ky], _mm_mul_ps(sy, bz));
+	__m128 cx = _mm_sub_ps(c[m->kx], _mm_mul_ps(sx, cz));
+	__m128 cy = _mm_sub_ps(c[m->ky], _mm_mul_ps(sy, cz));
+	__m128 u = _mm_sub_ps(_mm_mul_ps(cx, by), _mm_mul_ps(cy, bx));
+	__m128 v = _mm_sub_ps(_mm_mul_ps(ax, cy), _mm_mul_ps(ay, cx));
+	__m128 w = _mm_sub_ps(_mm_mul_ps(bx, ay), _mm_mul_ps(by, ax));
+
+	/* Hit where the edge functions all have the same sign */
+	__m128 zero = _mm_setzero_ps();
+	__m128 neg = _mm_or_ps(_mm_or_ps(_mm_cmplt_ps(u, zero), _mm_cmplt_ps(v, zero)),
+		_mm_cmplt_ps(w, zero));
+	__m128 pos = _mm_or_ps(_mm_or_ps(_mm_cmpgt_ps(u, zero), _mm_cmpgt_ps(v, zero)),
+		_mm_cmpgt_ps(w, zero));
+	__m128 det = _mm_add_ps(_mm_add_ps(u, v), w);
+	__m128 tt = _mm_div_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(u, _mm_mul_ps(sz, az)),
+		_mm_mul_ps(v, _mm_mul_ps(sz, bz))), _mm_mul_ps(w, _mm_mul_ps(sz, cz))), det);
+	__m128 hit = _mm_andnot_ps(_mm_and_ps(neg, pos), _mm_cmpneq_ps(det, zero));
+	hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmpgt_ps(tt, _mm_set1_ps(0.001f)),
+		_mm_cmplt_ps(tt, _mm_set1_ps(tmax))));
+	_mm_storeu_ps(lt, _mm_or_ps(_mm_and_ps(hit, tt), _mm_andnot_ps(hit, _mm_set1_ps(INFINITY))));
+
+	/* A lane with an edge function of exactly 0 is done again in double */
+	__m128 flat = _mm_or_ps(_mm_or_ps(_mm_cmpeq_ps(u, zero), _mm_cmpeq_ps(v, zero)),
+		_mm_cmpeq_ps(w, zero));
+	int redo = _mm_movemask_ps(flat);
+	for(j = 0; j < n; j++)
+		t[j] = (redo >> j) & 1 ? meshTest(msh, tris[j], m, tmax) : lt[j];
+#else
+	int j;
+	for(j = 0; j < n; j++)
+		t[j] = meshTest(msh, tris[j], m, tmax);
+#endif
+}
+
+/* Bounds of triangle tri */
+static inline void meshBounds(mesh *msh, int tri, vector *lo, vector *hi){
+	int *idx = &msh->tris[3 * tri];
+	vector *a = &msh->verts[idx[0]], *b = &msh->verts[idx[1]], *c = &msh->verts[idx[2]];
+
+	lo->x = fminf(a->x, fminf(b->x, c->x)); hi->x = fmaxf(a->x, fmaxf(b->x, c->x));
+	lo->y = fminf(a->y, fminf(b->y, c->y)); hi->y = fmaxf(a->y, fmaxf(b->y, c->y));
+	lo->z = fminf(a->z, fminf(b->z, c->z)); hi->z = fmaxf(a->z, fmaxf(b->z, c->z));
+}
+
+/* Unit normal of triangle tri on the side a ray along dir comes from,
+ * or 0 if the triangle has no area
+ */
+static inline vector meshNormal(mesh *msh, int tri, vector *dir){
+	int *idx = &msh->tris[3 * tri];
+	vector e1 = vectorSub(&msh->verts[idx[1]], &msh->verts[idx[0]]);
+	vector e2 = vectorSub(&msh->verts[idx[2]], &msh->verts[idx[0]]);
+	vector n = vectorCross(&e1, &e2);
+	float len = vectorDot(&n, &n);
+
+	if(len == 0) return n;
+	len = 1.0f / sqrtf(len);
+	if(vectorDot(&n, dir) > 0) len = -len;
+	return vectorScale(len, &n);
+}
+
+/* Make room for n more elements of size in *p, which holds *cap.
+ * Returns -1 if there is no memory.
+ */
+static int meshGrow(void **p, size_t *cap, size_t used, size_t n, size_t size){
+	if(used + n <= *cap) return 0;
+	size_t want = *cap > 0 ? 2 * *cap : 1 << 16;
+	while(want < used + n) want *= 2;
+	void *q = realloc(*p, want * size);
+	if(q == NULL) return -1;
+	*p = q;
+	*cap = want;
+	return 0;
+}
+
+/* The vertex a face refers to by the OBJ index i, counting from 1, or
+ * from the end if negative. Returns -1 for 0, which is no vertex.
+ */
+static inline long meshIndex(long i, int nverts){
+	return i > 0 ? i - 1 : (i < 0 ? nverts + i : -1);
+}
+
+/* Read one line of an OBJ file, nul terminated, into m. Returns -1 on a
+ * malformed line or when out of memory, with errno set.
+ */
+static int meshObjLine(mesh *m, char *line, size_t *vcap, size_t *tcap){
+	char *p = line, *end;
+
+	while(*p == ' ' || *p == '\t') p++;
+	if(p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')){
+		vector v;
+		v.x = strtof(p + 2, &end);
+		if(end == p + 2) goto bad;
+		v.y = strtof(p = end, &end);
+		if(end == p) goto bad;
+		v.z = strtof(p = end, &end);
+		if(end == p) goto bad;
+		if(meshGrow((void **)&m->verts, vcap, m->nverts, 2, sizeof(vector)) != 0) return -1;
+		m->verts[m->nverts++] = v;
+		return 0;
+	}
+	if(p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')){
+		long first = -1, prev = -1;
+		int n = 0;
+
+		p += 2;
+		for(;;){
+			while(*p == ' ' || *p == '\t' || *p == '\r') p++;
+			if(*p == '\0' || *p == '#') break;
+			long i = meshIndex(strtol(p, &end, 10), m->nverts);
+			if(end == p || i < 0 || i > INT_MAX) goto bad;
+			/* Skip the texture coordinate and normal of the corner */
+			for(p = end; *p != '\0' && *p != ' ' && *p != '\t' && *p != '\r'; p++);
+			if(n == 0)
+				first = i;
+			else if(n >= 2){
+				if(meshGrow((void **)&m->tris, tcap, 3 * (size_t)m->ntris, 3, sizeof(int)) != 0)
+					return -1;
+				m->tris[3 * m->ntris] = first;
+				m->tris[3 * m->ntris + 1] = prev;
+				m->tris[3 * m->ntris + 2] = i;
+				m->ntris++;
+			}
+			prev = i;
+			n++;
+		}
+		if(n < 3) goto bad;
+		return 0;
+	}
+	return 0;
+bad:
+	errno = EINVAL;
+	return -1;
+}
+
+static void meshFree(mesh *m){
+	free(m->verts);
+	free(m->tris);
+	m->verts = NULL;
+	m->tris = NULL;
+}
+
+/* Read the OBJ file at path into m, all of it of the given material.
+ * Returns 0, or -1 after printing what went wrong.
+ */
+static inline int meshLoadObj(mesh *m, const char *path, int material){
+	FILE *f = fopen(path, "r");
+	char *buf = malloc(MESH_CHUNK + 1);
+	size_t vcap = 0, tcap = 0, have = 0;
+	long lineNo = 0;
+	int i;
+
+	memset(m, 0, sizeof(*m));
+	m->material = material;
+	if(f == NULL || buf == NULL){
+		perror(path);
+		goto fail;
+	}
+	for(;;){
+		size_t got = fread(buf + have, 1, MESH_CHUNK - have, f);
+		bool last = got == 0;
+		have += got;
+		if(have == 0) break;
+
+		/* Every whole line of the chunk, and what is left at the end
+		 * of the file
+		 */
+		char *line = buf, *nl;
+		buf[have] = '\0';
+		while((nl = memchr(line, '\n', buf + have - line)) != NULL || (last && line < buf + have)){
+			if(nl != NULL) *nl = '\0';
+			lineNo++;
+			if(meshObjLine(m, line, &vcap, &tcap) != 0){
+				if(errno == EINVAL)
+					fprintf(stderr, "%s:%ld: not a vertex or face I can read\n", path, lineNo);
+				else
+					perror(path);
+				goto fail;
+			}
+			line = nl != NULL ? nl + 1 : buf + have;
+		}
+		have = buf + have - line;
+		if(have == MESH_CHUNK){
+			fprintf(stderr, "%s:%ld: line longer than %d bytes\n", path, lineNo + 1, MESH_CHUNK);
+			goto fail;
+		}
+		memmove(buf, line, have);
+		if(last) break;
+	}
+	if(ferror(f)){
+		perror(path);
+		goto fail;
+	}
+	/* Faces can refer to vertices that come after them */
+	for(i = 0; i < 3 * m->ntris; i++)
+		if(m->tris[i] < 0 || m->tris[i] >= m->nverts){
+			fprintf(stderr, "%s: a face refers to vertex %d of %d\n", path, m->tris[i] + 1, m->nverts);
+			goto fail;
+		}
+	if(m->verts == NULL && meshGrow((void **)&m->verts, &vcap, 0, 2, sizeof(vector)) != 0){
+		perror(path);
+		goto fail;
+	}
+	free(buf);
+	fclose(f);
+	return 0;
+fail:
+	free(buf);
+	if(f != NULL) fclose(f);
+	meshFree(m);
+	return -1;
+}
+
+/* Scale the mesh to size along its longest side and move the centre of
+ * its bounds to centre. OBJ files look down -z with y up, the default
+ * view looks down +z with y down, so the mesh is also turned half way
+ * round x to face the camera the right way up.
+ */
+static inline void meshPlace(mesh *m, vector *centre, float size){
+	vector lo = {INFINITY, INFINITY, INFINITY}, hi = {-INFINITY, -INFINITY, -INFINITY};
+	int i;
+
+	if(m->nverts == 0) return;
+	for(i = 0; i < m->nverts; i++){
+		vector *v = &m->verts[i];
+		lo.x = fminf(lo.x, v->x); hi.x = fmaxf(hi.x, v->x);
+		lo.y = fminf(lo.y, v->y); hi.y = fmaxf(hi.y, v->y);
+		lo.z = fminf(lo.z, v->z); hi.z = fmaxf(hi.z, v->z);
+	}
+	float extent = fmaxf(hi.x - lo.x, fmaxf(hi.y - lo.y, hi.z - lo.z));
+	float scale = extent > 0 ? size / extent : 1;
+	for(i = 0; i < m->nverts; i++){
+		vector *v = &m->verts[i];
+		v->x = centre->x + scale * (v->x - 0.5f * (lo.x + hi.x));
+		v->y = centre->y - scale * (v->y - 0.5f * (lo.y + hi.y));
+		v->z = centre->z - scale * (v->z - 0.5f * (lo.z + hi.z));
+	}
+}
+
+#endif
@@ -0,0 +1,437 @@
+/* Ray packet intersection kernels.
+ *
+ * A packet holds PACKET_SIZE rays that are traced together against spheres
+ * kept in structure-of-arrays form (separate x, y, z and radius arrays).
+ * With that layout one sphere is tested against all rays of the packet
+ * with a handful of SIMD instructions. The kernel used is picked once at
+ * runtime from the features of the CPU: AVX2 traces all 8 rays at once,
+ * SSE does two halves of 4 rays, and the scalar loop runs everywhere else.
+ *
+ * The kernels do the same arithmetic in the same order as
+ * intersectRaySphere(), so they find exactly the same hits. When spheres
+ * are stored in BVH leaf order each sphere keeps its primitive reference
+ * in id, and hits at equal distance go to the lower id like in the scan.
+ * Boxes have no packet kernel, they are tested one ray at a time.
+ */
+#ifndef PACKET_H
+#define PACKET_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "bvh.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PACKET_X86 1
+#include <immintrin.h>
+#endif
+
+/* Number of rays in a packet */
+#define PACKET_SIZE 8
+
+/* Spheres in structure-of-arrays form. The arrays are 32 byte aligned and
+ * padded to a multiple of PACKET_SIZE so kernels may load whole packets.
+ * In BVH leaf order the slots of boxes hold NaN, which no kernel ever hits.
+ */
+typedef struct{
+	float *x;
+	float *y;
+	float *z;
+	float *radius;
+	int *id;	/* primitive reference, PRIM_REF() */
+	int count;
+}sphereSoA;
+
+/* A packet of rays, also in structure-of-arrays form. Rays past count are
+ * traced like the others but their results are ignored.
+ */
+typedef struct{
+	float ox[PACKET_SIZE] __attribute__((aligned(32)));
+	float oy[PACKET_SIZE] __attribute__((aligned(32)));
+	float oz[PACKET_SIZE] __attribute__((aligned(32)));
+	float dx[PACKET_SIZE] __attribute__((aligned(32)));
+	float dy[PACKET_SIZE] __attribute__((aligned(32)));
+	float dz[PACKET_SIZE] __attribute__((aligned(32)));
+	int count;
+}rayPacket;
+
+/* Closest hit for every ray of a packet, hit is the primitive reference or
+ * -1 where nothing was hit.
+ * The kernels only replace hits that are further away, so t and hit must
+ * be set up with packetHitInit() before the first call.
+ */
+typedef struct{
+	float t[PACKET_SIZE] __attribute__((aligned(32)));
+	int hit[PACKET_SIZE] __attribute__((aligned(32)));
+}packetHit;
+
+/* Intersect the packet with spheres [first, last) of s */
+typedef void packetKernel(sphereSoA *s, int first, int last, rayPacket *p, packetHit *h);
+
+static void packetHitInit(packetHit *h){
+	int k;
+	for(k = 0; k < PACKET_SIZE; k++){
+		h->t[k] = 20000.0f;
+		h->hit[k] = -1;
+	}
+}
+
+/* n floats cleared to zero, from mem */
+static float *soaAlloc(int n, arena *mem){
+	float *p = arenaAlloc(mem, n * sizeof(float));
+	if(p == NULL){
+		fprintf(stderr, "soaAlloc: out of memory\n");
+		exit(1);
+	}
+	memset(p, 0, n * sizeof(float));
+	return p;
+}
+
+/* Allocate room for n spheres, rounded up to whole packets, from mem.
+ * They are freed with the arena.
+ */
+static void soaInit(sphereSoA *s, int n, arena *mem){
+	int padded = (n + PACKET_SIZE - 1) / PACKET_SIZE * PACKET_SIZE;
+	if(padded == 0) padded = PACKET_SIZE;
+	s->x = soaAlloc(padded, mem);
+	s->y = soaAlloc(padded, mem);
+	s->z = soaAlloc(padded, mem);
+	s->radius = soaAlloc(padded, mem);
+	s->id = (int *)soaAlloc(padded, mem);
+	s->count = n;
+}
+
+/* Reference kernel, one ray at a time */
+static void intersectPacketScalar(sphereSoA *s, int first, int last, rayPacket *p, packetHit *h){
+	int k, i;
+	for(k = 0; k < PACKET_SIZE; k++){
+		float dx = p->dx[k], dy = p->dy[k], dz = p->dz[k];
+		float A = dx * dx + dy * dy + dz * dz;
+		float t = h->t[k];
+		int hit = h->hit[k];
+
+		for(i = first; i < last; i++){
+			float distx = p->ox[k] - s->x[i];
+			float disty = p->oy[k] - s->y[i];
+			float distz = p->oz[k] - s->z[i];
+			float B = 2 * (dx * distx + dy * disty + dz * distz);
+			float C = (distx * distx + disty * disty + distz * distz)
+				- (s->radius[i] * s->radius[i]);
+			float discr = B * B - 4 * A * C;
+			if(discr < 0) continue;
+
+			float sqrtdiscr = sqrtf(discr);
+			float t0 = (-B + sqrtdiscr)/(2);
+			float t1 = (-B - sqrtdiscr)/(2);
+			if(t0 > t1) t0 = t1;
+			if((t0 > 0.001f) && (t0 < t || (t0 == t && s->id[i] < hit))){
+				t = t0;
+				hit = s->id[i];
+			}
+		}
+		h->t[k] = t;
+		h->hit[k] = hit;
+	}
+}
+
+#ifdef PACKET_X86
+
+/* Four rays at a time, the packet is done in two halves */
+__attribute__((target("sse2")))
+static void intersectPacketSSE(sphereSoA *s, int first, int last, rayPacket *p, packetHit *h){
+	int half, i;
+	for(half = 0; half < PACKET_SIZE; half += 4){
+		__m128 ox = _mm_load_ps(p->ox + half);
+		__m128 oy = _mm_load_ps(p->oy + half);
+		__m128 oz = _mm_load_ps(p->oz + half);
+		__m128 dx = _mm_load_ps(p->dx + half);
+		__m128 dy = _mm_load_ps(p->dy + half);
+		__m128 dz = _mm_load_ps(p->dz + half);
+
+		__m128 A = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)),
+			_mm_mul_ps(dz, dz));
+		__m128 fourA = _mm_mul_ps(_mm_set1_ps(4.0f), A);
+		__m128 t = _mm_load_ps(h->t + half);
+		__m128i hit = _mm_load_si128((__m128i *)(h->hit + half));
+
+		for(i = first; i < last; i++){
+			__m128 distx = _mm_sub_ps(ox, _mm_set1_ps(s->x[i]));
+			__m128 disty = _mm_sub_ps(oy, _mm_set1_ps(s->y[i]));
+			__m128 distz = _mm_sub_ps(oz, _mm_set1_ps(s->z[i]));
+			__m128 r = _mm_set1_ps(s->radius[i]);
+
+			__m128 B = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, distx), _mm_mul_ps(dy, disty)),
+				_mm_mul_ps(dz, distz));
+			B = _mm_mul_ps(_mm_set1_ps(2.0f), B);
+			__m128 C = _mm_add_ps(_mm_add_ps(_mm_mul_ps(distx, distx), _mm_mul_ps(disty, disty)),
+				_mm_mul_ps(distz, distz));
+			C = _mm_sub_ps(C, _mm_mul_ps(r, r));
+			__m128 discr = _mm_sub_ps(_mm_mul_ps(B, B), _mm_mul_ps(fourA, C));
+
+			__m128 sqrtdiscr = _mm_sqrt_ps(discr);
+			__m128 negB = _mm_sub_ps(_mm_setzero_ps(), B);
+			__m128 t0 = _mm_mul_ps(_mm_add_ps(negB, sqrtdiscr), _mm_set1_ps(0.5f));
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(negB, sqrtdiscr), _mm_set1_ps(0.5f));
+			t0 = _mm_min_ps(t0, t1);
+
+			/* NaN from a negative discriminant fails every compare */
+			__m128i id = _mm_set1_epi32(s->id[i]);
+			__m128 closer = _mm_or_ps(_mm_cmplt_ps(t0, t),
+				_mm_and_ps(_mm_cmpeq_ps(t0, t), _mm_castsi128_ps(_mm_cmpgt_epi32(hit, id))));
+			__m128 mask = _mm_and_ps(_mm_cmpge_ps(discr, _mm_setzero_ps()),
+				_mm_and_ps(_mm_cmpgt_ps(t0, _mm_set1_ps(0.001f)), closer));
+			if(_mm_movemask_ps(mask) == 0) continue;
+
+			t = _mm_or_ps(_mm_and_ps(mask, t0), _mm_andnot_ps(mask, t));
+			__m128i m = _mm_castps_si128(mask);
+			hit = _mm_or_si128(_mm_and_si128(m, id), _mm_andnot_si128(m, hit));
+		}
+		_mm_store_ps(h->t + half, t);
+		_mm_store_si128((__m128i *)(h->hit + half), hit);
+	}
+}
+
+/* All eight rays at once */
+__attribute__((target("avx2")))
+static void intersectPacketAVX2(sphereSoA *s, int first, int last, rayPacket *p, packetHit *h){
+	int i;
+	__m256 ox = _mm256_load_ps(p->ox);
+	__m256 oy = _mm256_load_ps(p->oy);
+	__m256 oz = _mm256_load_ps(p->oz);
+	__m256 dx = _mm256_load_ps(p->dx);
+	__m256 dy = _mm256_load_ps(p->dy);
+	__m256 dz = _mm256_load_ps(p->dz);
+
+	__m256 A = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)),
+		_mm256_mul_ps(dz, dz));
+	__m256 fourA = _mm256_mul_ps(_mm256_set1_ps(4.0f), A);
+	__m256 t = _mm256_load_ps(h->t);
+	__m256i hit = _mm256_load_si256((__m256i *)h->hit);
+
+	for(i = first; i < last; i++){
+		__m256 distx = _mm256_sub_ps(ox, _mm256_broadcast_ss(s->x + i));
+		__m256 disty = _mm256_sub_ps(oy, _mm256_broadcast_ss(s->y + i));
+		__m256 distz = _mm256_sub_ps(oz, _mm256_broadcast_ss(s->z + i));
+		__m256 r = _mm256_broadcast_ss(s->radius + i);
+
+		__m256 B = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, distx), _mm256_mul_ps(dy, disty)),
+			_mm256_mul_ps(dz, distz));
+		B = _mm256_mul_ps(_mm256_set1_ps(2.0f), B);
+		__m256 C = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(distx, distx), _mm256_mul_ps(disty, disty)),
+			_mm256_mul_ps(distz, distz));
+		C = _mm256_sub_ps(C, _mm256_mul_ps(r, r));
+		__m256 discr = _mm256_sub_ps(_mm256_mul_ps(B, B), _mm256_mul_ps(fourA, C));
+
+		__m256 sqrtdiscr = _mm256_sqrt_ps(discr);
+		__m256 negB = _mm256_sub_ps(_mm256_setzero_ps(), B);
+		__m256 t0 = _mm256_mul_ps(_mm256_add_ps(negB, sqrtdiscr), _mm256_set1_ps(0.5f));
+		__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(negB, sqrtdiscr), _mm256_set1_ps(0.5f));
+		t0 = _mm256_min_ps(t0, t1);
+
+		__m256i id = _mm256_set1_epi32(s->id[i]);
+		__m256 closer = _mm256_or_ps(_mm256_cmp_ps(t0, t, _CMP_LT_OQ),
+			_mm256_and_ps(_mm256_cmp_ps(t0, t, _CMP_EQ_OQ),
+				_mm256_castsi256_ps(_mm256_cmpgt_epi32(hit, id))));
+		__m256 mask = _mm256_and_ps(_mm256_cmp_ps(discr, _mm256_setzero_ps(), _CMP_GE_OQ),
+			_mm256_and_ps(_mm256_cmp_ps(t0, _mm256_set1_ps(0.001f), _CMP_GT_OQ), closer));
+		if(_mm256_movemask_ps(mask) == 0) continue;
+
+		t = _mm256_blendv_ps(t, t0, mask);
+		hit = _mm256_blendv_epi8(hit, id, _mm256_castps_si256(mask));
+	}
+	_mm256_store_ps(h->t, t);
+	_mm256_store_si256((__m256i *)h->hit, hit);
+}
+
+#endif
+
+/* Pick the kernel for this CPU. name can force "avx2", "sse" or "scalar",
+ * NULL or "auto" selects the widest one the CPU supports. Returns NULL if
+ * the requested kernel is not available.
+ */
+static packetKernel *packetSelect(const char *name, const char **chosen){
+	packetKernel *k = intersectPacketScalar;
+	const char *kname = "scalar";
+	int automatic = (name == NULL || strcmp(name, "auto") == 0);
+
+#ifdef PACKET_X86
+	__builtin_cpu_init();
+	if((automatic || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")){
+		k = intersectPacketAVX2;
+		kname = "avx2";
+	}else if((automatic || strcmp(name, "sse") == 0) && __builtin_cpu_supports("sse2")){
+		k = intersectPacketSSE;
+		kname = "sse";
+	}
+#endif
+	if(!automatic && strcmp(name, kname) != 0)
+		return NULL;
+	if(chosen != NULL) *chosen = kname;
+	return k;
+}
+
+/* Inverse directions of the rays of a packet, see rayInverse() */
+static void packetInverse(rayPacket *p, vector *inv){
+	int k;
+	for(k = 0; k < PACKET_SIZE; k++){
+		vector d = {p->dx[k], p->dy[k], p->dz[k]};
+		inv[k] = rayInverse(&d);
+	}
+}
+
+/* The rays of a packet set up for the triangle test, see meshRaySetup() */
+static void packetMeshRays(rayPacket *p, meshRay *m){
+	int k;
+	for(k = 0; k < p->count; k++){
+		ray r = {{p->ox[k], p->oy[k], p->oz[k]}, {p->dx[k], p->dy[k], p->dz[k]}};
+		meshRaySetup(&r, &m[k]);
+	}
+}
+
+/* Test box ref against every ray of the packet, one ray at a time */
+static inline void packetTestBox(box *boxes, int ref, rayPacket *p, vector *inv, packetHit *h){
+	int k;
+	for(k = 0; k < p->count; k++){
+		ray r = {{p->ox[k], p->oy[k], p->oz[k]}, {p->dx[k], p->dy[k], p->dz[k]}};
+		bvhTestPrim(NULL, boxes, ref, &r, &inv[k], &h->t[k], &h->hit[k]);
+	}
+}
+
+/* Test the boxes, triangles and instances among the count primitives at
+ * refs against every ray of the packet, one ray at a time, leaving the
+ * spheres to the kernel. m is packetMeshRays() of the packet. The tests
+ * done inside instances are added to *tests.
+ */
+static void packetTestLeaf(box *boxes, mesh *msh, instanceSet *inst, int *refs, int count,
+		rayPacket *p, vector *inv, meshRay *m, packetHit *h, long *tests){
+	int k;
+	for(k = 0; k < p->count; k++){
+		ray r = {{p->ox[k], p->oy[k], p->oz[k]}, {p->dx[k], p->dy[k], p->dz[k]}};
+		bvhTestLeaf(NULL, boxes, msh, inst, refs, count, &r, &inv[k], &m[k], &h->t[k], &h->hit[k],
+			tests);
+	}
+}
+
+/* Does any ray of the packet that is still active reach the node? */
+static inline bool packetHitNode(bvhNode *n, rayPacket *p, vector *inv, packetHit *h){
+	int k;
+	for(k = 0; k < p->count; k++){
+		vector o = {p->ox[k], p->oy[k], p->oz[k]};
+		float tnear;
+		if(bvhHitNode(n, &o, &inv[k], h->t[k], &tnear))
+			return true;
+	}
+	return false;
+}
+
+/* Test leaf n of b against the packet: its spheres with the kernel, the
+ * rest ray by ray. A leaf without spheres has nothing for the kernel to
+ * look at.
+ */
+static inline void packetTestNode(bvh *b, sphereSoA *s, box *boxes, mesh *msh, instanceSet *inst,
+		packetKernel *kernel, bvhNode *n, rayPacket *p, vector *inv, meshRay *m, packetHit *h,
+		long *tests){
+	int *refs = &b->prims[n->first];
+	bool spheres = boxes == NULL && msh == NULL && inst == NULL, others = false;
+	int i;
+
+	for(i = 0; i < n->count && !spheres; i++){
+		if(PRIM_KIND(refs[i]) == PRIM_SPHERE) spheres = true;
+		else others = true;
+	}
+	for(; i < n->count && !others; i++)
+		others = PRIM_KIND(refs[i]) != PRIM_SPHERE;
+	if(spheres)
+		kernel(s, n->first, n->first + n->count, p, h);
+	if(others)
+		packetTestLeaf(boxes, msh, inst, refs, n->count, p, inv, m, h, tests);
+}
+
+/* Closest sphere hits of a packet through the BVH. s must hold the
+ * spheres in the leaf order of b, so every leaf is a range of s that the
+ * kernel tests against all rays at once. A node is entered when any ray
+ * of the packet reaches it, which for coherent rays is nearly always all
+ * of them or none. Boxes and triangles in the leaves are tested ray by
+ * ray; boxes may be NULL if the scene has none, msh is NULL without
+ * triangles and inst NULL without instances. The tests done are added to *tests.
+ */
+static inline void intersectPacketBVH(bvh *b, sphereSoA *s, box *boxes, mesh *msh, instanceSet *inst,
+		packetKernel *kernel, rayPacket *p, packetHit *h, long *tests){
+	vector inv[PACKET_SIZE];
+	meshRay m[PACKET_SIZE];
+	int stack[BVH_STACK];
+	int sp = 0;
+
+	packetInverse(p, inv);
+	if(msh != NULL) packetMeshRays(p, m);
+	if(b->nprims == 0) return;
+
+	stack[sp++] = 0;
+	while(sp > 0){
+		bvhNode *n = &b->nodes[stack[--sp]];
+		if(!packetHitNode(n, p, inv, h)) continue;
+		if(n->count > 0){
+			packetTestNode(b, s, boxes, msh, inst, kernel, n, p, inv, m, h, tests);
+			*tests += (long)n->count * p->count;
+		}else{
+			/* Order the children front to back along the first ray */
+			vector o = {p->ox[0], p->oy[0], p->oz[0]};
+			float tl, tr;
+			bvhHitNode(&b->nodes[n->first], &o, &inv[0], INFINITY, &tl);
+			bvhHitNode(&b->nodes[n->first + 1], &o, &inv[0], INFINITY, &tr);
+			if(tr < tl){
+				stack[sp++] = n->first;
+				stack[sp++] = n->first + 1;
+			}else{
+				stack[sp++] = n->first + 1;
+				stack[sp++] = n->first;
+			}
+		}
+	}
+}
+
+
+/* Closest hits of a packet among the leaves of b listed in leaves, such
+ * as bvhFrustumLeaves() found for the tile the packet is in. The leaves
+ * can be in any order, ties still go to the first primitive in scan
+ * order.
+ */
+static inline void intersectPacketLeaves(bvh *b, sphereSoA *s, box *boxes, mesh *msh, instanceSet *inst,
+		packetKernel *kernel, int *leaves, int nleaves, rayPacket *p, packetHit *h, long *tests){
+	vector inv[PACKET_SIZE];
+	meshRay m[PACKET_SIZE];
+	int j;
+
+	packetInverse(p, inv);
+	if(msh != NULL) packetMeshRays(p, m);
+	for(j = 0; j < nleaves; j++){
+		bvhNode *n = &b->nodes[leaves[j]];
+		if(!packetHitNode(n, p, inv, h)) continue;
+		packetTestNode(b, s, boxes, msh, inst, kernel, n, p, inv, m, h, tests);
+		*tests += (long)n->count * p->count;
+	}
+}
+
+/* Closest hits of a packet among the primitives listed in refs, with s
+ * holding the spheres in scan order
+ */
+static inline void intersectPacketPrims(sphereSoA *s, box *boxes, mesh *msh, instanceSet *inst,
+		packetKernel *kernel, int *refs, int nrefs, rayPacket *p, packetHit *h, long *tests){
+	vector inv[PACKET_SIZE];
+	meshRay m[PACKET_SIZE];
+	int j;
+
+	packetInverse(p, inv);
+	if(msh != NULL) packetMeshRays(p, m);
+	for(j = 0; j < nrefs; j++){
+		if(PRIM_KIND(refs[j]) == PRIM_SPHERE)
+			kernel(s, PRIM_INDEX(refs[j]), PRIM_INDEX(refs[j]) + 1, p, h);
+		else
+			packetTestLeaf(boxes, msh, inst, &refs[j], 1, p, inv, m, h, tests);
+	}
+	*tests += (long)nrefs * p->count;
+}
+
+#endif
@@ -0,0 +1,2582 @@
+/* A simple ray tracer for scenes of spheres, boxes and triangles */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h> /* Needed for boolean datatype */
+#include <math.h>
+#include <time.h>
+#include <getopt.h>
+#include <limits.h>
+
+#include "geometry.h"
+#include "bvh.h"
+#include "tiles.h"
+#include "image.h"
+#include "tonemap.h"
+#include "stats.h"
+#include "packet.h"
+#include "scenefile.h"
+#include "dirty.h"
+#include "animation.h"
+#include "camera.h"
+#include "lights.h"
+#include "wavefront.h"
+#include "remote.h"
+#include "terminate.h"
+#include "serve.h"
+
+/* Width and height of the view in scene units, and the default size of
+ * the image. Larger or smaller images sample the same view more or less
+ * finely.
+ */
+#define WIDTH  1000
+#define HEIGHT 1000
+
+/* Adaptive anti-aliasing samples a pixel again on a grid of up to
+ * AA_MAX by AA_MAX rays when its corners differ by more than the
+ * threshold in any channel
+ */
+#define AA_MAX 8
+#define AA_THRESHOLD 0.1f
+
+/* Progressive rendering starts with one ray per PROGRESSIVE_STRIDE by
+ * PROGRESSIVE_STRIDE block of pixels and halves the spacing every pass
+ */
+#define PROGRESSIVE_STRIDE 16
+
+/* An animation builds its BVH again once refitting has made it this many
+ * times as costly to trace as when it was built
+ */
+#define REFIT_LIMIT 1.5f
+
+/* Longest side of a mesh from an OBJ file in scene units, unless
+ * --obj-at gives one
+ */
+#define OBJ_SIZE 800
+
+/* Primitives or BVH leaves a tile keeps from culling against its
+ * frustum. A tile that sees more traces its packets through the whole
+ * scene.
+ */
+#define TILE_CULL 128
+
+/* Memory a band of the image may take when no band height is given,
+ * its colours and its bytes
+ */
+#define BAND_BYTES (4 << 20)
+
+/* The objects of the scene, shared read-only by all render threads */
+typedef struct{
+	sphere *spheres;
+	int nspheres;
+	box *boxes;
+	int nboxes;
+	mesh *mesh;		/* triangles, NULL for none */
+	instanceSet *inst;	/* copies of prototypes, NULL for none */
+	sphereSoA soa;		/* the spheres again, laid out for the packet kernels */
+	material *materials;
+	light *lights;
+	int nlights;
+	lightGrid *lightGrid;	/* finds the lights that reach a point, NULL to try them all */
+	int lightSamples;	/* lights shaded per hit when more are around, 0 for all */
+	bvh accel;
+	bool useBvh;		/* false scans every object for every ray */
+	bool shadows;		/* test whether lights are blocked */
+	vector viewLo, viewHi;	/* the box every primary ray starts in */
+	vector *cullLo, *cullHi;	/* padded bounds of every object for culling a scan, or NULL */
+	arena *mem;		/* arrays that last as long as the scene */
+}scene;
+
+/* Lights whose last shadow blocker a worker remembers */
+#define SHADOW_CACHE 16
+
+/* The object that last blocked each light, per worker */
+typedef struct{
+	int blocker[SHADOW_CACHE];
+}__attribute__((aligned(64))) shadowCache;
+
+/* What the primary rays of the tile a worker is on can hit: BVH leaves,
+ * or objects when there is no BVH. count is -1 when the tile was not
+ * culled and every object has to be considered.
+ */
+typedef struct{
+	int count;
+	int entries[TILE_CULL];
+}__attribute__((aligned(64))) tileCull;
+
+/* What a render thread needs to fill in its tiles */
+typedef struct{
+	scene *s;
+	colour *frame;		/* linear colours of the rows of the current band */
+	unsigned char *img;	/* and their bytes, once tone mapped */
+	int width;
+	int height;
+	int y0;			/* first image row held in frame and img */
+	tonemap *tm;
+	tonemapKernel *toneKernel;
+	double toneSeconds;	/* spent in tonemapRows() */
+	float sampleMax;	/* samples are clamped to this before they are averaged:
+				 * what the clamp curve shows as white, or no limit */
+	camera *cam;
+	terminatePolicy *term;	/* when paths stop bouncing */
+	packetKernel *kernel;	/* NULL traces primary rays one at a time */
+	renderStats *stats;	/* one per worker */
+	shadowCache *shadows;	/* one per worker */
+	tileCull *culls;	/* one per worker */
+	arena *scratch;		/* one per worker */
+	wavefront *waves;	/* one per worker for a wavefront render, or NULL */
+	bool sortRays;		/* sort the reflected rays of a wavefront render */
+	int aa;			/* edge of the grid a pixel is sampled on again, 1 for none */
+	float aaThreshold;	/* contrast between corners that makes it */
+	int stride;		/* pixels between the rays of a progressive pass */
+	double deadline;	/* monotonicSeconds() after which no tile is started, 0 for none */
+	pixelRecord *records;	/* what every pixel of the image depended on, or NULL */
+	sceneEdit *edit;	/* the edit whose pixels renderTileEdit() traces again */
+}renderJob;
+
+/* A --move: sphere goes to pos */
+typedef struct{
+	int sphere;
+	vector pos;
+}sphereMove;
+
+/* Seconds on the monotonic clock */
+double monotonicSeconds(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Find the closest object hit by r nearer than *t. Returns its primitive
+ * reference, PRIM_REF(), or -1 if there is none.
+ */
+int closestHit(scene *s, ray *r, float *t, renderStats *st){
+	if(s->useBvh)
+		return bvhClosestHit(&s->accel, s->spheres, s->boxes, s->mesh, s->inst, r, t, &st->tests);
+
+	st->tests += s->nspheres + s->nboxes + MESH_TRIS(s->mesh) + INSTANCES(s->inst);
+	int i, current = -1;
+	for(i = 0; i < s->nspheres; i++){
+		if(intersectRaySphere(r, &s->spheres[i], t)){
+			current = PRIM_REF(PRIM_SPHERE, i);
+
+		}
+	}
+	if(s->nboxes > 0){
+		vector inv = rayInverse(&r->dir);
+		for(i = 0; i < s->nboxes; i++)
+			if(intersectRayBox(r, &inv, &s->boxes[i], t))
+				current = PRIM_REF(PRIM_BOX, i);
+	}
+	if(s->mesh != NULL){
+		int tris[MESH_LANES];
+		float tt[MESH_LANES];
+		meshRay m;
+		meshRaySetup(r, &m);
+		for(i = 0; i < s->mesh->ntris; i += MESH_LANES){
+			int j, n = s->mesh->ntris - i < MESH_LANES ? s->mesh->ntris - i : MESH_LANES;
+			for(j = 0; j < n; j++)
+				tris[j] = i + j;
+			meshTest4(s->mesh, tris, n, &m, *t, tt);
+			for(j = 0; j < n; j++)
+				if(tt[j] < *t){
+					*t = tt[j];
+					current = PRIM_REF(PRIM_TRIANGLE, i + j);
+				}
+		}
+	}
+	if(s->inst != NULL){
+		vector inv = rayInverse(&r->dir);
+		for(i = 0; i < s->inst->ninst; i++)
+			instanceClosestHit(s->inst, i, r, &inv, t, &current, &st->tests);
+	}
+	return current;
+}
+
+/* Find any object hit by r before it has gone dist, -1 if there is none.
+ * Stops at the first one found, which is all a shadow ray needs to know.
+ * inv is rayInverse() of the direction.
+ */
+int anyHit(scene *s, ray *r, vector *inv, float dist, renderStats *st){
+	if(s->useBvh)
+		return bvhAnyHit(&s->accel, s->spheres, s->boxes, s->mesh, s->inst, r, inv, dist,
+			&st->tests);
+
+	int i, n = s->nspheres + s->nboxes + MESH_TRIS(s->mesh);
+	meshRay m;
+	if(s->mesh != NULL) meshRaySetup(r, &m);
+	for(i = 0; i < n; i++){
+		int ref = bvhSlotRef(i, s->nspheres, s->nboxes, MESH_TRIS(s->mesh));
+		st->tests++;
+		if(bvhBlocks(s->spheres, s->boxes, s->mesh, s->inst, ref, r, inv, &m, dist))
+			return ref;
+	}
+	for(i = 0; i < INSTANCES(s->inst); i++){
+		int ref = instanceAnyHit(s->inst, i, r, inv, dist, &st->tests);
+		if(ref >= 0) return ref;
+	}
+	return -1;
+}
+
+/* What the shadow test of shadeLambert() gets to work with */
+typedef struct{
+	scene *s;
+	renderStats *st;
+	shadowCache *cache;
+	pixelRecord *rec;	/* NULL if the path is not recorded */
+}shadowQuery;
+
+/* shadowFunc for shadeLambert(): is the light at dist along r blocked?
+ * Neighbouring points are mostly shadowed by the same object, so the
+ * last blocker of the light is tried before searching the scene.
+ */
+bool lightBlocked(void *ctx, int light, ray *r, float dist){
+	shadowQuery *q = ctx;
+	int *last = &q->cache->blocker[light % SHADOW_CACHE];
+
+	vector inv = rayInverse(&r->dir);
+	meshRay m;
+
+	q->st->shadowRays++;
+	if(*last >= 0){
+		q->st->tests++;
+		if(PRIM_KIND(*last) == PRIM_TRIANGLE) meshRaySetup(r, &m);
+		if(bvhBlocks(q->s->spheres, q->s->boxes, q->s->mesh, q->s->inst, *last, r, &inv, &m, dist)){
+			if(q->rec != NULL) q->rec->sig |= recordBit(*last);
+			q->st->shadowed++;
+			return true;
+		}
+	}
+
+	int ref = anyHit(q->s, r, &inv, dist, q->st);
+	if(ref < 0) return false;
+	*last = ref;
+	if(q->rec != NULL) q->rec->sig |= recordBit(ref);
+	q->st->shadowed++;
+	return true;
+}
+
+/* Material of primitive hit */
+static inline int hitMaterial(scene *s, int hit){
+	if(PRIM_KIND(hit) == PRIM_SPHERE)
+		return s->spheres[PRIM_INDEX(hit)].material;
+	if(PRIM_KIND(hit) == PRIM_BOX)
+		return s->boxes[PRIM_INDEX(hit)].material;
+	if(PRIM_KIND(hit) == PRIM_INSTANCE)
+		return instanceMaterial(s->inst, hit);
+	return s->mesh->material;
+}
+
+/* Shade the hit of ray r on primitive hit at t: add the light reaching
+ * it, weighted by *coef, to c. Then r becomes the reflected ray, *coef
+ * its weight and *normal the normal at the hit. Returns false if there
+ * is no normal to reflect about and the path ends.
+ */
+bool shadeHit(scene *s, renderStats *st, shadowQuery *shadow, ray *r, int hit, float t,
+		float *coef, colour *c, vector *normal){
+	vector scaled = vectorScale(t, &r->dir);
+	vector newStart = vectorAdd(&r->start, &scaled);
+
+	/* Find the normal for this new vector at the point of intersection */
+	vector n;
+	if(PRIM_KIND(hit) == PRIM_SPHERE){
+		sphere *sp = &s->spheres[PRIM_INDEX(hit)];
+		n = vectorSub(&newStart, &sp->pos);
+		float temp = vectorDot(&n, &n);
+
+		if(temp == 0) return false;
+
+		temp = 1.0f / sqrtf(temp);
+		n = vectorScale(temp, &n);
+	}else if(PRIM_KIND(hit) == PRIM_BOX){
+		/* A box face is known from the slab the ray entered last */
+		vector inv = rayInverse(&r->dir);
+		n = boxNormal(r, &inv, &s->boxes[PRIM_INDEX(hit)]);
+	}else if(PRIM_KIND(hit) == PRIM_INSTANCE){
+		/* Found in the prototype, then turned into the scene */
+		if(!instanceNormal(s->inst, hit, r, t, &n)) return false;
+	}else{
+		/* Triangles have two sides, the one facing the ray is lit */
+		n = meshNormal(s->mesh, PRIM_INDEX(hit), &r->dir);
+		if(vectorDot(&n, &n) == 0) return false;
+	}
+	*normal = n;
+
+	/* Find the material to determine the colour */
+	material currentMat = s->materials[hitMaterial(s, hit)];
+
+	/* Find the value of the light at this point */
+	lightShade(s->lightGrid, s->lights, s->nlights, s->lightSamples, &newStart, &n,
+		&currentMat, *coef, c, s->shadows ? lightBlocked : NULL, shadow, &st->lights);
+
+	/* Iterate over the reflection */
+	*coef *= currentMat.reflection;
+
+	/* The reflected ray start and direction */
+	r->start = newStart;
+	float reflect = 2.0f * vectorDot(&r->dir, &n);
+	vector tmp = vectorScale(reflect, &n);
+	r->dir = vectorSub(&r->dir, &tmp);
+	return true;
+}
+
+/* Trace the primary ray through point (x, y) of the image, in pixels,
+ * and return its colour. If primary is not NULL the closest hit of the
+ * first ray was already found by a packet kernel and is taken from lane
+ * of primary. Records are only kept when every pixel is a single ray
+ * through (x, y), and then the path is recorded for the pixel.
+ */
+colour traceSample(renderJob *job, int worker, float x, float y, packetHit *primary, int lane){
+
+	scene *s = job->s;
+	renderStats *st = &job->stats[worker];
+	ray r;
+	pixelRecord *rec = NULL;
+
+	if(job->records != NULL){
+		rec = &job->records[(size_t)y * job->width + (size_t)x];
+		recordClear(rec);
+	}
+	shadowQuery shadow = {s, st, &job->shadows[worker], rec};
+
+	colour c = {0, 0, 0};
+
+	st->samples++;
+
+	int level = 0;
+	float coef = 1.0;
+
+	cameraRay(job->cam, x, y, &r);
+
+	do{
+		/* Find closest intersection */
+		float t = 20000.0f;
+		int hit = -1;
+
+		if(level == 0 && primary != NULL){
+			t = primary->t[lane];
+			hit = primary->hit[lane];
+		}else
+			hit = closestHit(s, &r, &t, st);
+		st->rays++;
+		if(rec != NULL){
+			if(level > 0)
+				recordRay(rec, &r, hit, t);
+			else if(hit >= 0){
+				rec->hit = hit;
+				rec->t = t;
+			}
+		}
+		if(hit == -1) break;
+		st->hits++;
+
+		vector n;
+		if(!shadeHit(s, st, &shadow, &r, hit, t, &coef, &c, &n)) break;
+		TRACE("%g %g %d: %f ,%f %f\n", x, y, level, n.x, n.y, n.z);
+
+		level++;
+
+	}while(!terminatePath(job->term, &coef, level, &c, (int)x, (int)y, &r.start, st));
+	st->depth[level]++;
+	return c;
+}
+
+/* Store the colour of pixel (x, y) in the band */
+void storePixel(renderJob *job, int x, int y, colour *c){
+	job->frame[x + (size_t)(y - job->y0)*job->width] = *c;
+}
+
+/* Tile callback that tone maps the colours of a tile into its bytes */
+void tonemapTile(void *ctx, tile *t, int worker){
+	renderJob *job = ctx;
+	int y;
+
+	(void)worker;
+	for(y = t->y0; y < t->y1; y++){
+		size_t i = t->x0 + (size_t)(y - job->y0) * job->width;
+		job->toneKernel(job->tm, (float *)(job->frame + i), job->img + 3 * i, t->x1 - t->x0, t->x0, y);
+	}
+}
+
+/* Tone map rows y0 to y1 of the band, on nthreads threads */
+void tonemapRows(renderJob *job, int y0, int y1, int nthreads){
+	double t0 = monotonicSeconds();
+
+	renderTiles(0, y0, job->width, y1, TONEMAP_TILE, nthreads, tonemapTile, job);
+	job->toneSeconds += monotonicSeconds() - t0;
+}
+
+/* Write the band, rows job->y0 to y1, to out: its colours to a PFM file,
+ * otherwise its bytes. Returns 0 on success.
+ */
+int writeBand(renderJob *job, imageStream *out, int y1, int nthreads){
+	if(out->format == IMAGE_PFM)
+		return imageWriteFloats(out, (float *)job->frame, y1 - job->y0);
+	tonemapRows(job, job->y0, y1, nthreads);
+	return imageWriteRows(out, job->img, y1 - job->y0);
+}
+
+/* Closest hits of the primary rays of packet p, into h. Only what the
+ * frustum of the worker's tile let through is tested if it was culled.
+ */
+void intersectPacket(renderJob *job, int worker, rayPacket *p, packetHit *h){
+	scene *s = job->s;
+	tileCull *cull = &job->culls[worker];
+	long *tests = &job->stats[worker].tests;
+	int k;
+
+	packetHitInit(h);
+	if(cull->count >= 0 && s->useBvh)
+		intersectPacketLeaves(&s->accel, &s->soa, s->nboxes > 0 ? s->boxes : NULL, s->mesh, s->inst,
+			job->kernel, cull->entries, cull->count, p, h, tests);
+	else if(cull->count >= 0)
+		intersectPacketPrims(&s->soa, s->boxes, s->mesh, s->inst, job->kernel, cull->entries,
+			cull->count, p, h, tests);
+	else if(s->useBvh)
+		intersectPacketBVH(&s->accel, &s->soa, s->nboxes > 0 ? s->boxes : NULL, s->mesh, s->inst,
+			job->kernel, p, h, tests);
+	else{
+		job->kernel(&s->soa, 0, s->soa.count, p, h);
+		if(s->nboxes > 0 || s->mesh != NULL || s->inst != NULL){
+			vector inv[PACKET_SIZE];
+			meshRay m[PACKET_SIZE];
+			int refs[MESH_LANES];
+			packetInverse(p, inv);
+			for(k = 0; k < s->nboxes; k++)
+				packetTestBox(s->boxes, PRIM_REF(PRIM_BOX, k), p, inv, h);
+			if(s->mesh != NULL) packetMeshRays(p, m);
+			for(k = 0; k < MESH_TRIS(s->mesh); k += MESH_LANES){
+				int j, n = s->mesh->ntris - k < MESH_LANES ? s->mesh->ntris - k : MESH_LANES;
+				for(j = 0; j < n; j++)
+					refs[j] = PRIM_REF(PRIM_TRIANGLE, k + j);
+				packetTestLeaf(NULL, s->mesh, NULL, refs, n, p, inv, m, h, tests);
+			}
+			for(k = 0; k < INSTANCES(s->inst); k++){
+				refs[0] = PRIM_REF(PRIM_INSTANCE, k);
+				packetTestLeaf(NULL, NULL, s->inst, refs, 1, p, inv, m, h, tests);
+			}
+		}
+		*tests += (long)(s->nspheres + s->nboxes + MESH_TRIS(s->mesh) + INSTANCES(s->inst)) * p->count;
+	}
+}
+
+/* Trace n <= PACKET_SIZE primary rays through the points (xs[k], ys[k])
+ * and store their colours in out. With a packet kernel the rays are
+ * intersected all at once before shading them one by one, against only
+ * what the frustum of the tile let through if it was culled.
+ */
+void traceSamples(renderJob *job, int worker, float *xs, float *ys, int n, colour *out){
+	int k;
+
+	if(n == 0) return;
+	if(job->kernel == NULL){
+		for(k = 0; k < n; k++)
+			out[k] = traceSample(job, worker, xs[k], ys[k], NULL, 0);
+		return;
+	}
+
+	rayPacket p;
+	packetHit h;
+	p.count = n;
+	for(k = 0; k < PACKET_SIZE; k++){
+		int j = k < n ? k : n - 1;
+		ray r;
+		cameraRay(job->cam, xs[j], ys[j], &r);
+		p.ox[k] = r.start.x;
+		p.oy[k] = r.start.y;
+		p.oz[k] = r.start.z;
+		p.dx[k] = r.dir.x;
+		p.dy[k] = r.dir.y;
+		p.dz[k] = r.dir.z;
+	}
+	intersectPacket(job, worker, &p, &h);
+	for(k = 0; k < n; k++)
+		out[k] = traceSample(job, worker, xs[k], ys[k], &h, k);
+}
+
+/* Trace the n points (x0 + i, y) of a row into out */
+void traceRow(renderJob *job, int worker, int x0, int n, float y, colour *out){
+	float xs[PACKET_SIZE], ys[PACKET_SIZE];
+	int i, k;
+
+	for(i = 0; i < n; i += PACKET_SIZE){
+		int count = n - i < PACKET_SIZE ? n - i : PACKET_SIZE;
+		for(k = 0; k < count; k++){
+			xs[k] = x0 + i + k;
+			ys[k] = y;
+		}
+		traceSamples(job, worker, xs, ys, count, out + i);
+	}
+}
+
+/* Largest difference of any channel between the four corners of a
+ * pixel, as it will be displayed
+ */
+float pixelContrast(colour *c){
+	float lo[3] = {1, 1, 1}, hi[3] = {0, 0, 0};
+	int i;
+
+	for(i = 0; i < 4; i++){
+		float v[3] = {min(c[i].red, 1.0f), min(c[i].green, 1.0f), min(c[i].blue, 1.0f)};
+		int k;
+		for(k = 0; k < 3; k++){
+			lo[k] = min(lo[k], v[k]);
+			hi[k] = max(hi[k], v[k]);
+		}
+	}
+	return max(hi[0] - lo[0], max(hi[1] - lo[1], hi[2] - lo[2]));
+}
+
+/* Colour of pixel (x, y) from an n by n grid of samples spread evenly
+ * over it
+ */
+colour refinePixel(renderJob *job, int worker, int x, int y, int n){
+	float xs[PACKET_SIZE], ys[PACKET_SIZE];
+	colour c[PACKET_SIZE], sum = {0, 0, 0};
+	int i, k;
+
+	for(i = 0; i < n * n; i += PACKET_SIZE){
+		int count = n * n - i < PACKET_SIZE ? n * n - i : PACKET_SIZE;
+		for(k = 0; k < count; k++){
+			xs[k] = x + ((i + k) % n + 0.5f) / n;
+			ys[k] = y + ((i + k) / n + 0.5f) / n;
+		}
+		traceSamples(job, worker, xs, ys, count, c);
+		for(k = 0; k < count; k++){
+			sum.red += min(c[k].red, job->sampleMax);
+			sum.green += min(c[k].green, job->sampleMax);
+			sum.blue += min(c[k].blue, job->sampleMax);
+		}
+	}
+	sum.red /= n * n;
+	sum.green /= n * n;
+	sum.blue /= n * n;
+	return sum;
+}
+
+/* Find what the primary rays of tile t can hit, for traceSamples(). The
+ * frustum is made half a pixel wider all round, which covers every point
+ * a tile callback traces and keeps rounding from culling what a ray on
+ * its edge would hit. Only packets are traced against the result.
+ */
+void cullTile(renderJob *job, tile *t, int worker){
+	scene *s = job->s;
+	tileCull *cull = &job->culls[worker];
+	renderStats *st = &job->stats[worker];
+	frustum f;
+	int i;
+
+	cull->count = -1;
+	if(job->kernel == NULL ||
+			!cameraFrustum(job->cam, t->x0 - 0.5f, t->y0 - 0.5f, t->x1 + 0.5f, t->y1 + 0.5f, &f))
+		return;
+	if(s->useBvh)
+		cull->count = bvhFrustumLeaves(&s->accel, &f, cull->entries, TILE_CULL);
+	else{
+		int n = 0;
+		int nprims = s->nspheres + s->nboxes + MESH_TRIS(s->mesh) + INSTANCES(s->inst);
+		for(i = 0; i < nprims && n >= 0; i++){
+			if(frustumMissesBox(&f, &s->cullLo[i], &s->cullHi[i])) continue;
+			if(n == TILE_CULL) n = -1;
+			else cull->entries[n++] = bvhSlotRef(i, s->nspheres, s->nboxes, MESH_TRIS(s->mesh));
+		}
+		cull->count = n;
+	}
+	st->culled += cull->count == 0;
+}
+
+/* Render a tile with adaptive anti-aliasing. Pixel (x, y) covers the
+ * square from (x, y) to (x + 1, y + 1) and every corner of it is traced
+ * once, two rows of corners at a time. Where the corners of a pixel
+ * agree it gets their average, otherwise it is sampled again on an aa
+ * by aa grid. The corners on the far edges of the tile are traced again
+ * by the tiles next to it.
+ */
+void renderTileAdaptive(renderJob *job, tile *t, int worker){
+	renderStats *st = &job->stats[worker];
+	int w = t->x1 - t->x0;
+	int x, y;
+	arenaMark mark = arenaGetMark(&job->scratch[worker]);
+	colour *rows = arenaAlloc(&job->scratch[worker], 2 * (w + 1) * sizeof(colour));
+	colour *above = rows, *below = rows + w + 1;
+
+	if(rows == NULL){
+		fprintf(stderr, "renderTileAdaptive: out of memory\n");
+		exit(1);
+	}
+
+	traceRow(job, worker, t->x0, w + 1, t->y0, above);
+	for(y = t->y0; y < t->y1; y++){
+		traceRow(job, worker, t->x0, w + 1, y + 1, below);
+		for(x = 0; x < w; x++){
+			colour corner[4] = {above[x], above[x + 1], below[x], below[x + 1]};
+			colour c = {0, 0, 0};
+			int i;
+
+			if(pixelContrast(corner) > job->aaThreshold){
+				c = refinePixel(job, worker, t->x0 + x, y, job->aa);
+				st->refined++;
+			}else{
+				for(i = 0; i < 4; i++){
+					c.red += 0.25f * min(corner[i].red, job->sampleMax);
+					c.green += 0.25f * min(corner[i].green, job->sampleMax);
+					c.blue += 0.25f * min(corner[i].blue, job->sampleMax);
+				}
+			}
+			storePixel(job, t->x0 + x, y, &c);
+		}
+		colour *tmp = above;
+		above = below;
+		below = tmp;
+	}
+	arenaRelease(&job->scratch[worker], mark);
+}
+
+/* Tile callback for the scheduler, renders every pixel of the tile.
+ * Without anti-aliasing each pixel is one ray through its corner and the
+ * rays of a row are traced PACKET_SIZE pixels at a time. A tile started
+ * after the deadline is left as it is.
+ */
+void renderTile(void *ctx, tile *t, int worker){
+	renderJob *job = ctx;
+	colour c[PACKET_SIZE];
+	int x, y, k;
+
+	if(job->deadline > 0 && monotonicSeconds() > job->deadline){
+		job->stats[worker].skipped++;
+		return;
+	}
+	cullTile(job, t, worker);
+	if(job->aa > 1){
+		renderTileAdaptive(job, t, worker);
+		return;
+	}
+
+	for(y = t->y0; y < t->y1; y++){
+		for(x = t->x0; x < t->x1; x += PACKET_SIZE){
+			int count = t->x1 - x < PACKET_SIZE ? t->x1 - x : PACKET_SIZE;
+			traceRow(job, worker, x, count, y, c);
+			for(k = 0; k < count; k++)
+				storePixel(job, x + k, y, &c[k]);
+		}
+	}
+}
+
+/* Paint the stride by stride block of pixels starting at (x, y) */
+void storeBlock(renderJob *job, int x, int y, int stride, colour *c){
+	int x1 = x + stride < job->width ? x + stride : job->width;
+	int y1 = y + stride < job->height ? y + stride : job->height;
+	int i, j;
+
+	for(j = y; j < y1; j++)
+		for(i = x; i < x1; i++)
+			storePixel(job, i, j, c);
+}
+
+/* Tile callback for one pass of progressive rendering. Traces the pixels
+ * on a grid job->stride apart that the pass before, twice as coarse, did
+ * not, and paints each one's block with its colour. Tiles are a multiple
+ * of PROGRESSIVE_STRIDE so blocks never cross into another tile. Except
+ * in the first pass, a tile started after the deadline keeps the blocks
+ * of the previous pass.
+ */
+void renderTileCoarse(void *ctx, tile *t, int worker){
+	renderJob *job = ctx;
+	int stride = job->stride;
+	bool first = stride == PROGRESSIVE_STRIDE;
+	float xs[PACKET_SIZE], ys[PACKET_SIZE];
+	colour c[PACKET_SIZE];
+	int x, y, k, n = 0;
+
+	if(!first && monotonicSeconds() > job->deadline){
+		job->stats[worker].skipped++;
+		return;
+	}
+	cullTile(job, t, worker);
+	for(y = t->y0; y < t->y1; y += stride){
+		/* Rows the previous pass traced already have every other pixel */
+		bool traced = !first && y % (2 * stride) == 0;
+		int step = traced ? 2 * stride : stride;
+
+		for(x = t->x0 + (traced ? stride : 0); x < t->x1; x += step){
+			xs[n] = x;
+			ys[n] = y;
+			if(++n < PACKET_SIZE) continue;
+			traceSamples(job, worker, xs, ys, n, c);
+			for(k = 0; k < n; k++)
+				storeBlock(job, xs[k], ys[k], stride, &c[k]);
+			n = 0;
+		}
+	}
+	traceSamples(job, worker, xs, ys, n, c);
+	for(k = 0; k < n; k++)
+		storeBlock(job, xs[k], ys[k], stride, &c[k]);
+}
+
+/* Render the whole image, held in job->frame, in passes of finer and finer
+ * grids until job->deadline: one ray per PROGRESSIVE_STRIDE square block,
+ * then every pixel, then anti-aliasing if job->aa asks for it. The first
+ * pass always runs to the end so there is a complete image however
+ * little time there is. Returns the number of passes that were finished.
+ */
+int renderProgressive(renderJob *job, int tileSize, int nthreads){
+	int passes = 0;
+	renderStats total;
+
+	/* Tiles must hold whole blocks of the coarsest pass */
+	tileSize = (tileSize + PROGRESSIVE_STRIDE - 1) / PROGRESSIVE_STRIDE * PROGRESSIVE_STRIDE;
+	job->y0 = 0;
+	for(job->stride = PROGRESSIVE_STRIDE; job->stride >= 1; job->stride /= 2){
+		renderTiles(0, 0, job->width, job->height, tileSize, nthreads, renderTileCoarse, job);
+		statsMerge(&total, job->stats, nthreads);
+		if(total.skipped > 0) return passes;
+		passes++;
+	}
+	if(job->aa > 1){
+		renderTiles(0, 0, job->width, job->height, tileSize, nthreads, renderTile, job);
+		statsMerge(&total, job->stats, nthreads);
+		if(total.skipped == 0) passes++;
+	}
+	return passes;
+}
+
+/* Closest hits of every ray of w->cur. If primary is not NULL the rays
+ * are the primary rays of that tile, made by waveGenerate(). They are
+ * coherent and go through the packet kernel PACKET_SIZE at a time if
+ * there is one, each block culled against its frustum first. Other rays
+ * are traced one at a time, except that with job->sortRays they are put
+ * in order by wavefrontSort() and every PACKET_SIZE of them close enough
+ * together go through the whole BVH as a packet.
+ */
+void waveIntersect(renderJob *job, int worker, wavefront *w, tile *primary){
+	renderStats *st = &job->stats[worker];
+	rayQueue *q = &w->cur;
+	int i, j, k;
+
+	st->rays += q->count;
+	if(primary != NULL && job->kernel != NULL){
+		tile b;
+		i = 0;
+		for(b.y0 = primary->y0; b.y0 < primary->y1; b.y0 += TILE_SIZE)
+			for(b.x0 = primary->x0; b.x0 < primary->x1; b.x0 += TILE_SIZE){
+				b.x1 = b.x0 + TILE_SIZE < primary->x1 ? b.x0 + TILE_SIZE : primary->x1;
+				b.y1 = b.y0 + TILE_SIZE < primary->y1 ? b.y0 + TILE_SIZE : primary->y1;
+				int end = i + (b.x1 - b.x0) * (b.y1 - b.y0);
+				cullTile(job, &b, worker);
+				for(; i < end; i += PACKET_SIZE){
+					rayPacket p;
+					packetHit h;
+					rayQueuePacket(q, i, end, &p);
+					intersectPacket(job, worker, &p, &h);
+					for(k = 0; k < p.count; k++){
+						q->t[i + k] = h.t[k];
+						q->hit[i + k] = h.hit[k];
+					}
+				}
+			}
+		return;
+	}
+	if(job->sortRays && primary == NULL){
+		wavefrontSort(w);
+		job->culls[worker].count = -1;
+		for(j = 0; j < q->count; j += PACKET_SIZE){
+			int end = j + PACKET_SIZE < q->count ? j + PACKET_SIZE : q->count;
+			if(job->kernel != NULL && wavefrontCoherent(w, j, end - 1)){
+				rayPacket p;
+				packetHit h;
+				rayQueueGather(q, w->order, j, end, &p);
+				intersectPacket(job, worker, &p, &h);
+				for(k = 0; k < p.count; k++){
+					q->t[w->order[j + k]] = h.t[k];
+					q->hit[w->order[j + k]] = h.hit[k];
+				}
+				continue;
+			}
+			for(k = j; k < end; k++){
+				ray r;
+				i = w->order[k];
+				rayQueueGet(q, i, &r);
+				q->t[i] = 20000.0f;
+				q->hit[i] = closestHit(job->s, &r, &q->t[i], st);
+			}
+		}
+		return;
+	}
+	for(i = 0; i < q->count; i++){
+		ray r;
+		rayQueueGet(q, i, &r);
+		q->t[i] = 20000.0f;
+		q->hit[i] = closestHit(job->s, &r, &q->t[i], st);
+	}
+}
+
+/* Tile callback of the wavefront renderer: one ray per pixel like
+ * renderTile(), but the rays of the whole tile go through each stage
+ * together, bounce after bounce, see wavefront.h. The time each stage
+ * takes is added to the worker's stats. Gives the same image as
+ * renderTile().
+ */
+void renderTileWavefront(void *ctx, tile *t, int worker){
+	renderJob *job = ctx;
+	scene *s = job->s;
+	renderStats *st = &job->stats[worker];
+	wavefront *w = &job->waves[worker];
+	shadowQuery shadow = {s, st, &job->shadows[worker], NULL};
+	int tw = t->x1 - t->x0, n = tw * (t->y1 - t->y0);
+	int i, j, level;
+	double t0 = monotonicSeconds(), t1;
+
+	/* Generate the primary rays, block by block of TILE_SIZE pixels so
+	 * each block can be culled on its own
+	 */
+	tile b;
+	w->cur.count = 0;
+	for(b.y0 = t->y0; b.y0 < t->y1; b.y0 += TILE_SIZE)
+		for(b.x0 = t->x0; b.x0 < t->x1; b.x0 += TILE_SIZE){
+			b.x1 = b.x0 + TILE_SIZE < t->x1 ? b.x0 + TILE_SIZE : t->x1;
+			b.y1 = b.y0 + TILE_SIZE < t->y1 ? b.y0 + TILE_SIZE : t->y1;
+			int x, y;
+			for(y = b.y0; y < b.y1; y++)
+				for(x = b.x0; x < b.x1; x++){
+					ray r;
+					cameraRay(job->cam, x, y, &r);
+					rayQueuePush(&w->cur, &r, 1.0f, (y - t->y0) * tw + x - t->x0);
+				}
+		}
+	memset(w->pixels, 0, n * sizeof(colour));
+	st->samples += n;
+	t1 = monotonicSeconds();
+	st->stage[STAGE_GENERATE] += t1 - t0;
+
+	for(level = 0; w->cur.count > 0; level++){
+		rayQueue *q = &w->cur;
+		int nkeys = 1;
+
+		t0 = t1;
+		waveIntersect(job, worker, w, level == 0 ? t : NULL);
+		t1 = monotonicSeconds();
+		st->stage[STAGE_INTERSECT] += t1 - t0;
+
+		/* Group the hits by kind of primitive and material, misses first */
+		t0 = t1;
+		for(i = 0; i < q->count; i++){
+			int hit = q->hit[i];
+			w->key[i] = hit < 0 ? 0 : 1 + PRIM_KINDS * hitMaterial(s, hit) + PRIM_KIND(hit);
+			if(w->key[i] >= nkeys) nkeys = w->key[i] + 1;
+		}
+		wavefrontGroup(w, nkeys);
+		t1 = monotonicSeconds();
+		st->stage[STAGE_GROUP] += t1 - t0;
+
+		/* Shade the hits group by group. The reflected ray of ray i goes
+		 * to slot i of the next queue, and key[i] says if there is one.
+		 */
+		t0 = t1;
+		for(j = 0; j < q->count; j++){
+			ray r;
+			vector normal;
+			i = w->order[j];
+			float coef = q->coef[i];
+			w->key[i] = 0;
+			if(q->hit[i] < 0){
+				st->depth[level]++;
+				continue;
+			}
+			st->hits++;
+			rayQueueGet(q, i, &r);
+			if(!shadeHit(s, st, &shadow, &r, q->hit[i], q->t[i], &coef, &w->pixels[q->pixel[i]],
+					&normal)){
+				st->depth[level]++;
+				continue;
+			}
+			int pixel = q->pixel[i];
+			if(!terminatePath(job->term, &coef, level + 1, &w->pixels[pixel],
+					t->x0 + pixel % tw, t->y0 + pixel / tw, &r.start, st)){
+				w->next.count = i;
+				rayQueuePush(&w->next, &r, coef, pixel);
+				w->key[i] = 1;
+			}else
+				st->depth[level + 1]++;
+		}
+		/* Close the gaps, so the next bounce keeps the order of the pixels */
+		w->next.count = wavefrontCompact(&w->next, w->key, q->count);
+		wavefrontSwap(w);
+		t1 = monotonicSeconds();
+		st->stage[STAGE_SHADE] += t1 - t0;
+	}
+
+	for(i = 0; i < n; i++)
+		storePixel(job, t->x0 + i % tw, t->y0 + i / tw, &w->pixels[i]);
+}
+
+/* Tile callback that traces again the pixels job->edit can have
+ * changed, from the records of the frame before it. The records of
+ * those pixels are made again on the way.
+ */
+void renderTileEdit(void *ctx, tile *t, int worker){
+	renderJob *job = ctx;
+	float xs[PACKET_SIZE], ys[PACKET_SIZE];
+	colour c[PACKET_SIZE];
+	int x, y, k, n = 0;
+
+	cullTile(job, t, worker);
+	for(y = t->y0; y < t->y1; y++){
+		for(x = t->x0; x < t->x1; x++){
+			pixelRecord *rec = &job->records[(size_t)y * job->width + x];
+			ray r;
+			cameraRay(job->cam, x, y, &r);
+			if(!recordDirty(rec, &r, job->edit))
+				continue;
+			xs[n] = x;
+			ys[n] = y;
+			if(++n < PACKET_SIZE) continue;
+			traceSamples(job, worker, xs, ys, n, c);
+			for(k = 0; k < n; k++)
+				storePixel(job, xs[k], ys[k], &c[k]);
+			n = 0;
+		}
+	}
+	traceSamples(job, worker, xs, ys, n, c);
+	for(k = 0; k < n; k++)
+		storePixel(job, xs[k], ys[k], &c[k]);
+}
+
+/* Copy the spheres into the packet kernels' arrays, which are in the
+ * order sceneSoA() set up. Enough after spheres have moved if the order
+ * did not change.
+ */
+void sceneSoAFill(scene *s){
+	int i;
+
+	for(i = 0; i < s->soa.count; i++){
+		int ref = s->useBvh ? s->accel.prims[i] : PRIM_REF(PRIM_SPHERE, i);
+		s->soa.id[i] = ref;
+		if(PRIM_KIND(ref) != PRIM_SPHERE){
+			s->soa.x[i] = s->soa.y[i] = s->soa.z[i] = s->soa.radius[i] = NAN;
+			continue;
+		}
+		sphere *sp = &s->spheres[PRIM_INDEX(ref)];
+		s->soa.x[i] = sp->pos.x;
+		s->soa.y[i] = sp->pos.y;
+		s->soa.z[i] = sp->pos.z;
+		s->soa.radius[i] = sp->radius;
+	}
+}
+
+/* Lay the spheres out for the packet kernels. They are walked in BVH
+ * leaf order, where boxes and triangles take up slots that can never be
+ * hit, and are kept with the BVH, which frees them when it is built
+ * again. Without a BVH only the spheres are stored.
+ */
+void sceneSoA(scene *s){
+	soaInit(&s->soa, s->useBvh ? s->accel.nprims : s->nspheres, s->useBvh ? &s->accel.mem : s->mem);
+	sceneSoAFill(s);
+}
+
+/* Padded bounds of every object, which cullTile() tests against the
+ * frustum of a tile when there is no BVH. They have to be made again
+ * whenever objects move.
+ */
+void sceneCullBounds(scene *s){
+	int n = s->nspheres + s->nboxes + MESH_TRIS(s->mesh) + INSTANCES(s->inst);
+
+	if(s->useBvh) return;
+	if(s->cullLo == NULL){
+		s->cullLo = arenaAlloc(s->mem, n * sizeof(vector));
+		s->cullHi = arenaAlloc(s->mem, n * sizeof(vector));
+		if(s->cullLo == NULL || s->cullHi == NULL){
+			fprintf(stderr, "sceneCullBounds: out of memory\n");
+			exit(1);
+		}
+	}
+	bvhPaddedBounds(s->spheres, s->nspheres, s->boxes, s->nboxes, s->mesh, s->inst, &s->viewLo,
+		&s->viewHi, s->cullLo, s->cullHi);
+}
+
+/* Build what scene s needs to be traced from its view box: the light
+ * grid into grid, unless that is NULL, the copies of the prototypes of
+ * file into inst, the BVH or the bounds for culling a scan, and the
+ * arrays of the packet kernels. file is the scene file s was loaded
+ * from, NULL for none, and mapped says s still uses its arrays as they
+ * are in it. Returns 0 on success.
+ */
+int scenePrepare(scene *s, sceneFile *file, bool mapped, lightGrid *grid, instanceSet *inst){
+	s->lightGrid = NULL;
+	if(grid != NULL){
+		double t0 = monotonicSeconds();
+		if(lightGridBuild(grid, s->lights, s->nlights) != 0){
+			fprintf(stderr, "scenePrepare: out of memory\n");
+			return -1;
+		}
+		s->lightGrid = grid;
+		fprintf(stderr, "lights: %d, %d everywhere, grid of %dx%dx%d cells, %zu bytes, built in %.2f ms\n",
+			s->nlights, grid->nglobal, grid->nx, grid->ny, grid->nz, lightGridBytes(grid),
+			(monotonicSeconds() - t0) * 1e3);
+	}
+	/* Every prototype gets a BVH of its own, and every copy of one is a
+	 * single primitive of the scene
+	 */
+	if(file != NULL && file->h->ninstances > 0){
+		double t0 = monotonicSeconds();
+		if(instanceSetup(inst, s->mem, file->prototypes, file->h->nprototypes,
+				file->protoSpheres, file->protoBoxes, file->instances, file->h->ninstances) != 0)
+			return -1;
+		s->inst = inst;
+		fprintf(stderr, "instances: %d copies of %d prototypes, %d primitives in the copies, "
+			"%zu bytes, set up in %.2f ms\n", inst->ninst, inst->nprotos,
+			inst->base[inst->ninst], instanceBytes(inst), (monotonicSeconds() - t0) * 1e3);
+	}
+	s->cullLo = s->cullHi = NULL;
+	if(s->useBvh){
+		bvhBuild(&s->accel, s->spheres, s->nspheres, s->boxes, s->nboxes, s->mesh, s->inst,
+			&s->viewLo, &s->viewHi);
+		fprintf(stderr, "bvh: %d primitives, %d nodes, %zu bytes, built in %.2f ms\n",
+			s->accel.nprims, s->accel.nnodes, bvhBytes(&s->accel), s->accel.buildMs);
+	}else
+		sceneCullBounds(s);
+
+	/* The arrays of a scene file are already in order for a scan */
+	if(file != NULL && mapped && !s->useBvh){
+		s->soa.x = file->sphereX;
+		s->soa.y = file->sphereY;
+		s->soa.z = file->sphereZ;
+		s->soa.radius = file->sphereRadius;
+		s->soa.id = file->sphereId;
+		s->soa.count = s->nspheres;
+	}else
+		sceneSoA(s);
+	return 0;
+}
+
+/* Grow the view box of s to take in lo..hi, padding the BVH or the
+ * bounds for culling a scan for it. The BVH is refitted, or built again
+ * if refitting made it REFIT_LIMIT times as costly.
+ */
+void sceneWiden(scene *s, vector *lo, vector *hi){
+	s->viewLo.x = fminf(s->viewLo.x, lo->x);
+	s->viewLo.y = fminf(s->viewLo.y, lo->y);
+	s->viewLo.z = fminf(s->viewLo.z, lo->z);
+	s->viewHi.x = fmaxf(s->viewHi.x, hi->x);
+	s->viewHi.y = fmaxf(s->viewHi.y, hi->y);
+	s->viewHi.z = fmaxf(s->viewHi.z, hi->z);
+	if(s->useBvh && bvhRefit(&s->accel, s->spheres, s->nspheres, s->boxes, s->nboxes, s->mesh,
+			s->inst, &s->viewLo, &s->viewHi) > REFIT_LIMIT * s->accel.cost){
+		bvhRebuild(&s->accel, s->spheres, s->nspheres, s->boxes, s->nboxes, s->mesh, s->inst,
+			&s->viewLo, &s->viewHi);
+		sceneSoA(s);
+	}
+	sceneCullBounds(s);
+}
+
+/* A private copy of n bytes at p in mem, for scene arrays that are
+ * changed
+ */
+void *copyOf(arena *mem, void *p, size_t n){
+	void *q = arenaAlloc(mem, n);
+	if(q == NULL){
+		fprintf(stderr, "copyOf: out of memory\n");
+		exit(1);
+	}
+	memcpy(q, p, n);
+	return q;
+}
+
+/* Scatter n spheres over the view, used to time big scenes. The
+ * generator is seeded so every run gets the same scene.
+ */
+sphere *randomSpheres(arena *mem, int n){
+	sphere *spheres = arenaAlloc(mem, n * sizeof(sphere));
+	unsigned int seed = 12345;
+	float radius = 500.0f / sqrtf(n) + 1.0f;
+	int i;
+
+	if(spheres == NULL){
+		fprintf(stderr, "randomSpheres: out of memory\n");
+		exit(1);
+	}
+	for(i = 0; i < n; i++){
+		spheres[i].pos.x = 1000.0f * rand_r(&seed) / RAND_MAX;
+		spheres[i].pos.y = 1000.0f * rand_r(&seed) / RAND_MAX;
+		spheres[i].pos.z = 1000.0f * rand_r(&seed) / RAND_MAX;
+		spheres[i].radius = radius * (0.5f + (float)rand_r(&seed) / RAND_MAX);
+		spheres[i].material = rand_r(&seed) % 3;
+	}
+	return spheres;
+}
+
+/* Name of frame k of a render with moves: output with -k put in front
+ * of its extension
+ */
+void frameName(char *name, size_t size, char *output, int k){
+	char *dot = strrchr(output, '.');
+	char *slash = strrchr(output, '/');
+
+	if(dot == NULL || (slash != NULL && dot < slash)) dot = output + strlen(output);
+	snprintf(name, size, "%.*s-%04d%s", (int)(dot - output), output, k, dot);
+}
+
+/* Render every frame of an animation into its own file, named by
+ * frameName(). cams holds the camera of every frame, or is NULL if it
+ * does not move. Between frames the BVH is refitted, or built again once
+ * refitting has made it REFIT_LIMIT times as costly as it was. Finished
+ * frames go to a writer thread, so the next frame is traced while the
+ * last one is written. Returns 0 if every frame was written.
+ */
+int renderAnimation(renderJob *job, animation *a, camera *cams, int tileSize, int nthreads,
+		char *output){
+	scene *s = job->s;
+	frameQueue q;
+	char name[FRAME_NAME];
+	int f, refits = 0, rebuilds = 0;
+	double updateMs = 0;
+
+	if(frameQueueStart(&q, job->width, job->height, nthreads) != 0){
+		fprintf(stderr, "renderAnimation: cannot start the frame writer\n");
+		return -1;
+	}
+	for(f = 0; f < a->frames; f++){
+		if(f > 0){
+			double t0 = monotonicSeconds();
+			animStep(a, f, s->spheres, s->boxes, s->lights);
+			if(s->useBvh && bvhRefit(&s->accel, s->spheres, s->nspheres, s->boxes, s->nboxes,
+					s->mesh, s->inst, &s->viewLo, &s->viewHi) > REFIT_LIMIT * s->accel.cost){
+				bvhRebuild(&s->accel, s->spheres, s->nspheres, s->boxes, s->nboxes, s->mesh, s->inst,
+					&s->viewLo, &s->viewHi);
+				sceneSoA(s);
+				rebuilds++;
+			}else{
+				sceneSoAFill(s);
+				refits += s->useBvh;
+			}
+			sceneCullBounds(s);
+			if(s->lightGrid != NULL && animMovesLights(a)){
+				if(lightGridRebuild(s->lightGrid, s->lights, s->nlights) != 0){
+					/* The frames already queued are still written */
+					fprintf(stderr, "renderAnimation: out of memory\n");
+					frameQueueFinish(&q);
+					return -1;
+				}
+			}
+			updateMs += (monotonicSeconds() - t0) * 1e3;
+		}
+		if(cams != NULL) job->cam = &cams[f];
+		job->y0 = 0;
+		renderTiles(0, 0, job->width, job->height, tileSize, nthreads,
+			job->waves != NULL ? renderTileWavefront : renderTile, job);
+		job->img = frameQueueNext(&q);
+		tonemapRows(job, 0, job->height, nthreads);
+		frameName(name, sizeof(name), output, f);
+		frameQueuePush(&q, name);
+	}
+
+	double waited = q.waited;
+	int status = frameQueueFinish(&q);
+	fprintf(stderr, "animation: %d frames, %d refits and %d rebuilds in %.2f ms, %.3f s waiting for the writer\n",
+		a->frames, refits, rebuilds, updateMs, waited);
+	return status;
+}
+
+/* Render the frame on the workers that connect to listenAddr and write
+ * it to output, encoded on nthreads threads, see remote.h. file is the
+ * scene file s was loaded from, or NULL to pack s into a scene image to
+ * send.
+ */
+int renderCoordinator(scene *s, sceneFile *file, int nmaterials, remoteSetup *setup,
+		char *listenAddr, int tileSize, int nthreads, char *output){
+	sceneFile packed;
+	unsigned char *img = malloc((size_t)3 * setup->width * setup->height);
+	int status = 1;
+
+	if(img == NULL){
+		fprintf(stderr, "remote: out of memory\n");
+		return 1;
+	}
+	if(file == NULL){
+		if(scenePack(&packed, s->spheres, s->nspheres, s->boxes, s->nboxes, s->materials,
+				nmaterials, s->lights, s->nlights) != 0){
+			fprintf(stderr, "remote: out of memory\n");
+			goto done;
+		}
+		file = &packed;
+	}
+	setup->sceneSize = file->h->size;
+	if(sizeof(remoteSetup) + setup->sceneSize > UINT32_MAX){
+		fprintf(stderr, "remote: scene of %llu bytes is too large to send\n",
+			(unsigned long long)setup->sceneSize);
+		goto done;
+	}
+
+	int fd = remoteListen(listenAddr);
+	fprintf(stderr, "remote: listening on %s, %llu bytes of scene\n", listenAddr,
+		(unsigned long long)setup->sceneSize);
+	remoteCoordinate(fd, setup, file, img, tileSize);
+	close(fd);
+	if(imageSave(output, img, setup->width, setup->height, nthreads) != 0){
+		perror(output);
+		goto done;
+	}
+	status = 0;
+
+done:
+	if(file == &packed) sceneUnmap(&packed);
+	free(img);
+	return status;
+}
+
+/* Render the tiles the coordinator on fd hands out until it says the
+ * frame is done, see remote.h. Each one is cut again into tiles of
+ * tileSize for the threads.
+ */
+void renderWorker(renderJob *job, int fd, int tileSize, int nthreads){
+	unsigned char *band = NULL, *reply = NULL;
+	colour *frame = NULL;
+	size_t head = sizeof(remoteHeader) + sizeof(remoteTileMsg);
+	remoteTileMsg m;
+	int ntiles = 0, y;
+
+	/* The coordinator hangs up on a worker that is still busy once the
+	 * frame is done, that ends the frame here as well
+	 */
+	Signal(SIGPIPE, SIG_IGN);
+	while(remoteNextTile(fd, &m)){
+		tile *t = &m.t;
+		if(t->x0 < 0 || t->y0 < 0 || t->x1 > job->width || t->y1 > job->height ||
+				t->x0 >= t->x1 || t->y0 >= t->y1)
+			err_quit("coordinator sent a tile outside the image");
+		int tw = t->x1 - t->x0, th = t->y1 - t->y0;
+
+		band = realloc(band, (size_t)3 * job->width * th);
+		frame = realloc(frame, (size_t)job->width * th * sizeof(colour));
+		reply = realloc(reply, head + (size_t)3 * tw * th);
+		if(band == NULL || frame == NULL || reply == NULL)
+			err_sys("worker: out of memory");
+		job->img = band;
+		job->frame = frame;
+		job->y0 = t->y0;
+		renderTiles(t->x0, t->y0, t->x1, t->y1, tileSize, nthreads,
+			job->waves != NULL ? renderTileWavefront : renderTile, job);
+		renderTiles(t->x0, t->y0, t->x1, t->y1, TONEMAP_TILE, nthreads, tonemapTile, job);
+		for(y = 0; y < th; y++)
+			memcpy(reply + head + (size_t)3 * tw * y, band + ((size_t)job->width * y + t->x0) * 3,
+				3 * tw);
+		if(remoteSendPixels(fd, &m, reply) != 0) break;
+		ntiles++;
+	}
+	fprintf(stderr, "worker: %d tiles rendered\n", ntiles);
+	close(fd);
+	free(band);
+	free(frame);
+	free(reply);
+}
+
+/* A scene a daemon keeps loaded, with everything built for it */
+typedef struct residentScene{
+	char name[SERVE_NAME];	/* file it was loaded from, empty for a scene not from a file */
+	scene *s;		/* own, or the one the daemon was started with */
+	scene own;
+	terminatePolicy term;
+	sceneFile file;
+	lightGrid grid;
+	instanceSet inst;
+	arena mem;		/* own.mem */
+	pthread_rwlock_t lock;	/* read to render it, write to widen its view */
+	bool ready;		/* loaded, false while it is still being loaded */
+	bool failed;		/* could not be loaded */
+	int users;		/* jobs holding it */
+	double used;		/* monotonicSeconds() when it was last let go */
+	struct residentScene *next;
+}residentScene;
+
+/* A render daemon, see serve.h. Jobs are traced the way its command
+ * line says, only what they see and how finely is their own.
+ */
+typedef struct{
+	serveQueue queue;
+	pthread_mutex_t lock;	/* of the list of scenes */
+	pthread_cond_t loaded;	/* a scene was loaded, or failed to be */
+	residentScene *scenes;
+	residentScene *home;	/* the scene it was started with, never let go */
+	long served;		/* connections taken, to tell jobs apart in the log */
+	int threads;		/* per job */
+	int tileSize;
+	int bandRows;		/* 0 to go by BAND_BYTES */
+	int aa;			/* for jobs that do not say, 0 to go by their budget */
+	float aaThreshold;
+	bool wave, sortRays;
+	bool useBvh, shadows, grid;
+	int lightSamples;
+	tonemap *tm;
+	char *termMode;
+	float roulette;
+	packetKernel *kernel;
+	tonemapKernel *toneKernel;
+}renderServer;
+
+/* A connection to a daemon, with the job on it */
+typedef struct{
+	renderServer *sv;
+	int fd;
+	long id;
+	int ahead;		/* jobs let in before it */
+	double arrived;
+}serveConn;
+
+void residentUnload(residentScene *r){
+	if(r->own.useBvh) bvhFree(&r->own.accel);
+	if(r->own.inst != NULL) instanceFree(&r->inst);
+	if(r->own.lightGrid != NULL) lightGridFree(&r->grid);
+	sceneUnmap(&r->file);
+	arenaFree(&r->mem);
+	pthread_rwlock_destroy(&r->lock);
+	free(r);
+}
+
+/* Map the scene file r is named for and build what it needs to be
+ * traced the way the daemon traces, for a view of lo..hi. Returns 0 on
+ * success.
+ */
+int residentLoad(renderServer *sv, residentScene *r, vector *lo, vector *hi){
+	scene *s = &r->own;
+
+	if(sceneMap(&r->file, r->name) != 0) return -1;
+	arenaInit(&r->mem, "scene", 0);
+	memset(s, 0, sizeof(*s));
+	s->mem = &r->mem;
+	s->spheres = r->file.spheres;
+	s->nspheres = r->file.h->nspheres;
+	s->boxes = r->file.boxes;
+	s->nboxes = r->file.h->nboxes;
+	s->materials = r->file.materials;
+	s->lights = r->file.lights;
+	s->nlights = r->file.h->nlights;
+	s->useBvh = sv->useBvh;
+	s->shadows = sv->shadows;
+	s->lightSamples = sv->lightSamples;
+	s->viewLo = *lo;
+	s->viewHi = *hi;
+	fprintf(stderr, "scene: %d spheres, %d boxes, %d lights from %s\n", s->nspheres, s->nboxes,
+		s->nlights, r->name);
+	if(scenePrepare(s, &r->file, true, sv->grid ? &r->grid : NULL, &r->inst) != 0){
+		if(s->inst != NULL) instanceFree(&r->inst);
+		if(s->lightGrid != NULL) lightGridFree(&r->grid);
+		sceneUnmap(&r->file);
+		arenaFree(&r->mem);
+		return -1;
+	}
+	terminateInit(&r->term, sv->termMode, sv->roulette, s->materials, r->file.h->nmaterials,
+		s->lights, s->nlights, sv->tm);
+	pthread_rwlock_init(&r->lock, NULL);
+	r->s = s;
+	return 0;
+}
+
+/* Take the read lock of r for a job that sees lo..hi, first widening
+ * the view of its scene if it does not take that in. Views only grow,
+ * so one that was widened still takes it in once the lock is back.
+ */
+void residentView(residentScene *r, vector *lo, vector *hi){
+	scene *s = r->s;
+
+	pthread_rwlock_rdlock(&r->lock);
+	if(lo->x >= s->viewLo.x && lo->y >= s->viewLo.y && lo->z >= s->viewLo.z &&
+			hi->x <= s->viewHi.x && hi->y <= s->viewHi.y && hi->z <= s->viewHi.z)
+		return;
+	pthread_rwlock_unlock(&r->lock);
+
+	pthread_rwlock_wrlock(&r->lock);
+	double t0 = monotonicSeconds();
+	sceneWiden(s, lo, hi);
+	fprintf(stderr, "serve: view of %s widened in %.2f ms\n", r->name[0] != '\0' ? r->name : "the scene",
+		(monotonicSeconds() - t0) * 1e3);
+	pthread_rwlock_unlock(&r->lock);
+	pthread_rwlock_rdlock(&r->lock);
+}
+
+/* The scene named name for a job that sees lo..hi, read locked, see
+ * residentView(). A scene file nobody has asked for yet is loaded, and
+ * jobs asking for it meanwhile wait for it. Returns NULL if it cannot be
+ * loaded.
+ */
+residentScene *residentAcquire(renderServer *sv, char *name, vector *lo, vector *hi){
+	residentScene *r, **p;
+
+	pthread_mutex_lock(&sv->lock);
+	for(r = sv->scenes; r != NULL && strcmp(r->name, name) != 0; r = r->next)
+		;
+	if(r != NULL){
+		r->users++;
+		while(!r->ready && !r->failed)
+			pthread_cond_wait(&sv->loaded, &sv->lock);
+	}else{
+		r = calloc(1, sizeof(residentScene));
+		if(r == NULL){
+			pthread_mutex_unlock(&sv->lock);
+			return NULL;
+		}
+		snprintf(r->name, sizeof(r->name), "%s", name);
+		r->users = 1;
+		r->next = sv->scenes;
+		sv->scenes = r;
+		pthread_mutex_unlock(&sv->lock);
+
+		double t0 = monotonicSeconds();
+		bool loaded = residentLoad(sv, r, lo, hi) == 0;
+
+		pthread_mutex_lock(&sv->lock);
+		if(loaded){
+			r->ready = true;
+			fprintf(stderr, "serve: %s loaded in %.2f ms\n", name, (monotonicSeconds() - t0) * 1e3);
+		}else{
+			r->failed = true;
+			for(p = &sv->scenes; *p != r; p = &(*p)->next)
+				;
+			*p = r->next;
+		}
+		pthread_cond_broadcast(&sv->loaded);
+	}
+	if(r->failed){
+		bool last = --r->users == 0;
+		pthread_mutex_unlock(&sv->lock);
+		if(last) free(r);
+		return NULL;
+	}
+	pthread_mutex_unlock(&sv->lock);
+	residentView(r, lo, hi);
+	return r;
+}
+
+/* A job is done with r. Scene files beyond SERVE_SCENES that no job
+ * holds are let go, the least recently used first.
+ */
+void residentRelease(renderServer *sv, residentScene *r){
+	residentScene **p, **oldest;
+	int n;
+
+	pthread_rwlock_unlock(&r->lock);
+	pthread_mutex_lock(&sv->lock);
+	r->users--;
+	r->used = monotonicSeconds();
+	for(;;){
+		oldest = NULL;
+		n = 0;
+		for(p = &sv->scenes; *p != NULL; p = &(*p)->next){
+			if(*p == sv->home) continue;
+			n++;
+			if((*p)->users == 0 && (*p)->ready && (oldest == NULL || (*p)->used < (*oldest)->used))
+				oldest = p;
+		}
+		if(n <= SERVE_SCENES || oldest == NULL) break;
+		r = *oldest;
+		*oldest = r->next;
+		fprintf(stderr, "serve: %s let go\n", r->name);
+		residentUnload(r);
+	}
+	pthread_mutex_unlock(&sv->lock);
+}
+
+/* Render the frame of job q on r, which is read locked, and send it to
+ * fd band by band as each is finished. ahead is what the job waited
+ * for. Returns 0 once every row went out, otherwise -1 with why in why.
+ */
+int serveRender(renderServer *sv, residentScene *r, serveRequest *q, int ahead, int fd,
+		serveDone *done, char **why){
+	int nthreads = sv->threads, width = q->cam.width, height = q->cam.height;
+	int aa = q->aa > 0 ? q->aa : sv->aa > 0 ? sv->aa : q->budget > 0 ? 4 : 1;
+	int bandRows = sv->bandRows, y0, i, status;
+	renderStats total;
+	renderJob job;
+	arena mem;
+
+	if(aa > AA_MAX){
+		*why = "anti-aliasing grid too fine";
+		return -1;
+	}
+	if(sv->wave && (aa > 1 || q->budget > 0)){
+		*why = "the wavefront renderer cannot anti-alias or render to a budget";
+		return -1;
+	}
+	/* Progressive passes go over the whole image */
+	if(q->budget > 0)
+		bandRows = height;
+	else if(bandRows == 0){
+		bandRows = BAND_BYTES / ((3 + sizeof(colour)) * width);
+		if(bandRows < 1) bandRows = 1;
+	}
+	if(bandRows > height) bandRows = height;
+
+	memset(&job, 0, sizeof(job));
+	arenaInit(&mem, "job", 0);
+	job.frame = arenaAlloc(&mem, (size_t)width * bandRows * sizeof(colour));
+	job.img = arenaAlloc(&mem, (size_t)3 * width * bandRows);
+	job.stats = arenaCalloc(&mem, nthreads * sizeof(renderStats));
+	job.shadows = arenaAlloc(&mem, nthreads * sizeof(shadowCache));
+	job.culls = arenaAlloc(&mem, nthreads * sizeof(tileCull));
+	job.scratch = arenaAlloc(&mem, nthreads * sizeof(arena));
+	if(sv->wave) job.waves = arenaAlloc(&mem, nthreads * sizeof(wavefront));
+	if(job.frame == NULL || job.img == NULL || job.stats == NULL || job.shadows == NULL ||
+			job.culls == NULL || job.scratch == NULL || (sv->wave && job.waves == NULL)){
+		arenaFree(&mem);
+		*why = "out of memory";
+		return -1;
+	}
+	memset(job.shadows, 0xff, nthreads * sizeof(shadowCache));	/* no blockers yet, -1 */
+	for(i = 0; i < nthreads; i++){
+		arenaInit(&job.scratch[i], "scratch", 0);
+		if(sv->wave) wavefrontInit(&job.waves[i], sv->tileSize * sv->tileSize, &job.scratch[i]);
+	}
+	job.s = r->s;
+	job.width = width;
+	job.height = height;
+	job.tm = sv->tm;
+	job.toneKernel = sv->toneKernel;
+	job.sampleMax = sv->tm->curve == TONEMAP_CLAMP ? 1.0f / sv->tm->scale : INFINITY;
+	job.cam = &q->cam;
+	job.term = &r->term;
+	job.kernel = sv->kernel;
+	job.sortRays = sv->sortRays;
+	job.aa = aa;
+	job.aaThreshold = sv->aaThreshold;
+
+	serveFrame frame = {width, height, ahead};
+	status = serveSend(fd, SERVE_MSG_FRAME, &frame, sizeof(frame));
+	if(status == 0 && q->budget > 0){
+		/* The budget runs from the start of the job, not of the daemon */
+		job.deadline = monotonicSeconds() + q->budget * 1e-3;
+		done->passes = renderProgressive(&job, sv->tileSize, nthreads);
+		tonemapRows(&job, 0, height, nthreads);
+		status = serveSendRows(fd, job.img, width, 0, height);
+	}else for(y0 = 0; status == 0 && y0 < height; y0 += bandRows){
+		int y1 = y0 + bandRows < height ? y0 + bandRows : height;
+		job.y0 = y0;
+		renderTiles(0, y0, width, y1, sv->tileSize, nthreads,
+			sv->wave ? renderTileWavefront : renderTile, &job);
+		tonemapRows(&job, y0, y1, nthreads);
+		status = serveSendRows(fd, job.img, width, y0, y1);
+	}
+	if(status != 0) *why = "client went away";
+	statsMerge(&total, job.stats, nthreads);
+	done->rays = total.rays;
+
+	for(i = 0; i < nthreads; i++)
+		arenaFree(&job.scratch[i]);
+	arenaFree(&mem);
+	return status;
+}
+
+/* Take the job of one connection through the queue of the daemon: wait
+ * for its turn, render it on the scene it names and send it back
+ */
+void *serveClient(void *arg){
+	serveConn *c = arg;
+	renderServer *sv = c->sv;
+	serveRequest q;
+	serveDone done = {0};
+	residentScene *r;
+	char *why;
+	bool running = false;
+	int status = -1;
+
+	if(serveReceiveJob(c->fd, &q, &why) == 0){
+		vector lo, hi;
+		serveQueueEnter(&sv->queue);
+		running = true;
+		double started = monotonicSeconds();
+		done.waited = started - c->arrived;
+		cameraBounds(&q.cam, &lo, &hi);
+		r = residentAcquire(sv, q.scene[0] != '\0' ? q.scene : sv->home->name, &lo, &hi);
+		if(r == NULL)
+			why = "cannot load the scene";
+		else{
+			status = serveRender(sv, r, &q, c->ahead, c->fd, &done, &why);
+			residentRelease(sv, r);
+		}
+		done.seconds = monotonicSeconds() - started;
+	}
+	serveQueueLeave(&sv->queue, running);
+
+	if(status == 0 && serveSend(c->fd, SERVE_MSG_DONE, &done, sizeof(done)) == 0)
+		fprintf(stderr, "serve: job %ld, %dx%d of %s, waited %.3f s, rendered in %.3f s, %.2f Mrays/s\n",
+			c->id, q.cam.width, q.cam.height, q.scene[0] != '\0' ? q.scene : "the scene", done.waited,
+			done.seconds, done.rays / done.seconds * 1e-6);
+	else{
+		if(status == 0) why = "client went away";
+		serveFail(c->fd, why);
+		fprintf(stderr, "serve: job %ld failed, %s\n", c->id, why);
+	}
+	close(c->fd);
+	free(c);
+	return NULL;
+}
+
+/* Run a daemon on the Unix domain socket at path, see serve.h. s is the
+ * scene of jobs that name none and term its termination policy; it
+ * came from sceneName, or NULL if not from a file. Up to jobs jobs are
+ * rendered at once and queue more wait. Returns only if it cannot go on.
+ */
+int renderServe(renderServer *sv, scene *s, terminatePolicy *term, char *sceneName, char *path,
+		int jobs, int queue){
+	char full[PATH_MAX];
+	residentScene *home = calloc(1, sizeof(residentScene));
+
+	if(home == NULL){
+		fprintf(stderr, "serve: out of memory\n");
+		return 1;
+	}
+	/* Jobs name scene files by their full path */
+	if(sceneName != NULL && realpath(sceneName, full) != NULL && strlen(full) < sizeof(home->name))
+		strcpy(home->name, full);
+	home->s = s;
+	home->term = *term;
+	home->ready = true;
+	pthread_rwlock_init(&home->lock, NULL);
+	sv->home = sv->scenes = home;
+	pthread_mutex_init(&sv->lock, NULL);
+	pthread_cond_init(&sv->loaded, NULL);
+	serveQueueInit(&sv->queue, jobs, queue);
+
+	Signal(SIGPIPE, SIG_IGN);
+	int fd = serveListen(path);
+	fprintf(stderr, "serve: listening on %s, %d jobs at once on %d threads each, %d more queued\n",
+		path, jobs, sv->threads, queue);
+	for(;;){
+		struct timeval timeout = {SERVE_TIMEOUT, 0};
+		pthread_t t;
+		int cfd = accept(fd, NULL, NULL);
+		if(cfd < 0){
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			err_sys("accept on %s", path);
+		}
+		sv->served++;
+		serveConn *c = malloc(sizeof(serveConn));
+		int ahead = c != NULL ? serveQueueAdmit(&sv->queue) : -1;
+		if(ahead < 0){
+			serveFail(cfd, "the queue is full");
+			fprintf(stderr, "serve: job %ld turned away, the queue is full\n", sv->served);
+			close(cfd);
+			free(c);
+			continue;
+		}
+		c->sv = sv;
+		c->fd = cfd;
+		c->id = sv->served;
+		c->ahead = ahead;
+		c->arrived = monotonicSeconds();
+		/* A client that stops reading loses its job and frees its slot */
+		Setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+		Setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		if(pthread_create(&t, NULL, serveClient, c) != 0){
+			serveQueueLeave(&sv->queue, false);
+			serveFail(cfd, "out of threads");
+			close(cfd);
+			free(c);
+			continue;
+		}
+		pthread_detach(t);
+	}
+}
+
+/* How the image of a termination policy compares to that of the fixed
+ * depth, for --compare
+ */
+typedef struct{
+	terminatePolicy fixed;
+	renderStats *stats;	/* one per worker, of the fixed depth */
+	unsigned char *img;	/* its bytes of the band */
+	long differ;		/* bytes of the image that are not the same */
+	int most;		/* and the most one is off by */
+	double seconds;		/* spent on the fixed depth */
+}fixedCompare;
+
+/* Render the band, rows job->y0 to y1, again with the fixed depth and
+ * compare its bytes with those of job->img, tone mapping them first if
+ * the band was written as floats
+ */
+void compareBand(renderJob *job, fixedCompare *cmp, int y1, int tileSize, int nthreads,
+		bool wave, bool floats){
+	double t0 = monotonicSeconds(), toneSeconds = job->toneSeconds;
+	terminatePolicy *term = job->term;
+	renderStats *stats = job->stats;
+	unsigned char *img = job->img;
+	size_t i, n = (size_t)3 * job->width * (y1 - job->y0);
+
+	if(floats) tonemapRows(job, job->y0, y1, nthreads);
+	job->term = &cmp->fixed;
+	job->stats = cmp->stats;
+	job->img = cmp->img;
+	renderTiles(0, job->y0, job->width, y1, tileSize, nthreads,
+		wave ? renderTileWavefront : renderTile, job);
+	tonemapRows(job, job->y0, y1, nthreads);
+	job->term = term;
+	job->stats = stats;
+	job->img = img;
+	job->toneSeconds = toneSeconds;
+
+	for(i = 0; i < n; i++){
+		int d = abs(img[i] - cmp->img[i]);
+		if(d == 0) continue;
+		cmp->differ++;
+		if(d > cmp->most) cmp->most = d;
+	}
+	cmp->seconds += monotonicSeconds() - t0;
+}
+
+/* Bounces made by all paths */
+long bounces(renderStats *st){
+	long n = 0;
+	int d;
+
+	for(d = 1; d < STATS_DEPTHS; d++)
+		n += d * st->depth[d];
+	return n;
+}
+
+/* The most every arena held. The scratch arenas of the workers are
+ * alike, the largest stands for them.
+ */
+void printArenas(scene *s, renderJob *job, int nthreads){
+	arena *largest = &job->scratch[0];
+	int i;
+
+	arenaPrint(stderr, s->mem);
+	if(s->useBvh) arenaPrint(stderr, &s->accel.mem);
+	if(s->lightGrid != NULL) arenaPrint(stderr, &s->lightGrid->mem);
+	for(i = 1; i < nthreads; i++)
+		if(job->scratch[i].peak > largest->peak) largest = &job->scratch[i];
+	if(largest->nblocks > 0) arenaPrint(stderr, largest);
+}
+
+void usage(char *prog){
+	fprintf(stderr, "usage: %s [--threads N] [--tile N] [--simd auto|avx2|sse|scalar|off]\n"
+		"\t[--accel bvh|scan] [--random N] [--scene FILE] [--shadows]\n"
+		"\t[--aa N] [--aa-threshold T] [--budget MS] [--move I,X,Y,Z]...\n"
+		"\t[--animate FILE] [--camera X,Y,Z [--look-at X,Y,Z] [--up X,Y,Z] [--fov DEG]\n"
+		"\t[--aperture R] [--focus D]] [--lights grid|all] [--light-samples N]\n"
+		"\t[--wavefront] [--sort-rays] [--listen [HOST:]PORT | --worker HOST:PORT]\n"
+		"\t[--exposure STOPS] [--tonemap clamp|reinhard|aces] [--srgb] [--dither]\n"
+		"\t[--terminate fixed|cut|roulette] [--roulette STEPS] [--compare]\n"
+		"\t[--obj FILE [--obj-at X,Y,Z,SIZE] [--obj-material N]]\n"
+		"\t[--serve SOCKET [--jobs N] [--queue N] | --submit SOCKET]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[]){
+
+	double launched = monotonicSeconds();
+	int nthreads = tileDefaultThreads();
+	int tileSize = 0;
+	int width = WIDTH;
+	int height = HEIGHT;
+	int bandRows = 0;
+	char *output = "image.ppm";
+	char *simd = "auto";
+	char *accel = "bvh";
+	int nrandom = 0;
+	char *sceneName = NULL;
+	bool shadows = false;
+	int aa = 0;
+	float aaThreshold = AA_THRESHOLD;
+	double budget = 0;
+	sphereMove *moves = NULL;
+	int nmoves = 0;
+	char *animName = NULL;
+	bool perspective = false;
+	vector eye, lookAt = {WIDTH / 2, HEIGHT / 2, 0}, up = {0, -1, 0};
+	float fov = 60, aperture = 0, focus = 0;
+	char *lightMode = "grid";
+	int lightSamples = 0;
+	bool wave = false, sortRays = false;
+	char *listenAddr = NULL, *workerAddr = NULL;
+	char *curve = "clamp";
+	float stops = 0;
+	bool srgb = false, dither = false;
+	char *termMode = "cut";
+	float roulette = TERMINATE_ROULETTE_STEPS;
+	bool compare = false;
+	char *objName = NULL;
+	vector objAt = {WIDTH / 2, HEIGHT / 2, 0};
+	float objSize = OBJ_SIZE;
+	int objMaterial = 1;
+	char *serveAddr = NULL, *submitAddr = NULL;
+	int jobs = 1, queue = SERVE_QUEUE;
+
+	static struct option options[] = {
+		{"threads", required_argument, NULL, 't'},
+		{"tile", required_argument, NULL, 's'},
+		{"width", required_argument, NULL, 'W'},
+		{"height", required_argument, NULL, 'H'},
+		{"band", required_argument, NULL, 'b'},
+		{"output", required_argument, NULL, 'o'},
+		{"simd", required_argument, NULL, 'v'},
+		{"accel", required_argument, NULL, 'a'},
+		{"random", required_argument, NULL, 'r'},
+		{"scene", required_argument, NULL, 'f'},
+		{"shadows", no_argument, NULL, 'S'},
+		{"aa", required_argument, NULL, 'A'},
+		{"aa-threshold", required_argument, NULL, 'T'},
+		{"budget", required_argument, NULL, 'B'},
+		{"move", required_argument, NULL, 'm'},
+		{"animate", required_argument, NULL, 'n'},
+		{"camera", required_argument, NULL, 'c'},
+		{"look-at", required_argument, NULL, 'l'},
+		{"up", required_argument, NULL, 'u'},
+		{"fov", required_argument, NULL, 'F'},
+		{"aperture", required_argument, NULL, 'R'},
+		{"focus", required_argument, NULL, 'D'},
+		{"lights", required_argument, NULL, 'L'},
+		{"light-samples", required_argument, NULL, 'N'},
+		{"wavefront", no_argument, NULL, 'w'},
+		{"sort-rays", no_argument, NULL, 'k'},
+		{"listen", required_argument, NULL, 'P'},
+		{"worker", required_argument, NULL, 'J'},
+		{"exposure", required_argument, NULL, 'E'},
+		{"tonemap", required_argument, NULL, 'M'},
+		{"srgb", no_argument, NULL, 'G'},
+		{"dither", no_argument, NULL, 'd'},
+		{"terminate", required_argument, NULL, 'x'},
+		{"roulette", required_argument, NULL, 'q'},
+		{"compare", no_argument, NULL, 'C'},
+		{"obj", required_argument, NULL, 'j'},
+		{"obj-at", required_argument, NULL, 'g'},
+		{"obj-material", required_argument, NULL, 'i'},
+		{"serve", required_argument, NULL, 'Y'},
+		{"submit", required_argument, NULL, 'Z'},
+		{"jobs", required_argument, NULL, 'Q'},
+		{"queue", required_argument, NULL, 'O'},
+		{NULL, 0, NULL, 0}
+	};
+	int opt;
+	while((opt = getopt_long(argc, argv, "t:s:W:H:b:o:v:a:r:f:SA:T:B:m:n:c:l:u:F:R:D:L:N:wkP:J:E:M:Gdx:q:Cj:g:i:Y:Z:Q:O:", options, NULL)) != -1){
+		switch(opt){
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+		case 's':
+			tileSize = atoi(optarg);
+			break;
+		case 'W':
+			width = atoi(optarg);
+			break;
+		case 'H':
+			height = atoi(optarg);
+			break;
+		case 'b':
+			bandRows = atoi(optarg);
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'v':
+			simd = optarg;
+			break;
+		case 'a':
+			accel = optarg;
+			break;
+		case 'r':
+			nrandom = atoi(optarg);
+			break;
+		case 'f':
+			sceneName = optarg;
+			break;
+		case 'S':
+			shadows = true;
+			break;
+		case 'A':
+			aa = atoi(optarg);
+			break;
+		case 'T':
+			aaThreshold = atof(optarg);
+			break;
+		case 'B':
+			budget = atof(optarg);
+			if(!(budget > 0)) usage(argv[0]);
+			break;
+		case 'm':
+			moves = realloc(moves, (nmoves + 1) * sizeof(sphereMove));
+			if(moves == NULL){
+				fprintf(stderr, "%s: out of memory\n", argv[0]);
+				return 1;
+			}
+			if(sscanf(optarg, "%d,%f,%f,%f", &moves[nmoves].sphere, &moves[nmoves].pos.x,
+					&moves[nmoves].pos.y, &moves[nmoves].pos.z) != 4)
+				usage(argv[0]);
+			nmoves++;
+			break;
+		case 'n':
+			animName = optarg;
+			break;
+		case 'c':
+			if(sscanf(optarg, "%f,%f,%f", &eye.x, &eye.y, &eye.z) != 3) usage(argv[0]);
+			perspective = true;
+			break;
+		case 'l':
+			if(sscanf(optarg, "%f,%f,%f", &lookAt.x, &lookAt.y, &lookAt.z) != 3) usage(argv[0]);
+			break;
+		case 'u':
+			if(sscanf(optarg, "%f,%f,%f", &up.x, &up.y, &up.z) != 3) usage(argv[0]);
+			break;
+		case 'F':
+			fov = atof(optarg);
+			break;
+		case 'R':
+			aperture = atof(optarg);
+			break;
+		case 'D':
+			focus = atof(optarg);
+			break;
+		case 'L':
+			lightMode = optarg;
+			break;
+		case 'N':
+			lightSamples = atoi(optarg);
+			break;
+		case 'w':
+			wave = true;
+			break;
+		case 'k':
+			wave = true;
+			sortRays = true;
+			break;
+		case 'P':
+			listenAddr = optarg;
+			break;
+		case 'J':
+			workerAddr = optarg;
+			break;
+		case 'E':
+			stops = atof(optarg);
+			break;
+		case 'M':
+			curve = optarg;
+			break;
+		case 'G':
+			srgb = true;
+			break;
+		case 'd':
+			dither = true;
+			break;
+		case 'x':
+			termMode = optarg;
+			break;
+		case 'q':
+			roulette = atof(optarg);
+			break;
+		case 'C':
+			compare = true;
+			break;
+		case 'j':
+			objName = optarg;
+			break;
+		case 'g':
+			if(sscanf(optarg, "%f,%f,%f,%f", &objAt.x, &objAt.y, &objAt.z, &objSize) != 4 ||
+					!(objSize > 0))
+				usage(argv[0]);
+			break;
+		case 'i':
+			objMaterial = atoi(optarg);
+			break;
+		case 'Y':
+			serveAddr = optarg;
+			break;
+		case 'Z':
+			submitAddr = optarg;
+			break;
+		case 'Q':
+			jobs = atoi(optarg);
+			break;
+		case 'O':
+			queue = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	/* Wavefront tiles are large so each stage has many rays to work on,
+	 * and the tiles of a coordinator are large so each is worth sending
+	 */
+	if(tileSize == 0) tileSize = listenAddr != NULL ? REMOTE_TILE : wave ? WAVEFRONT_TILE : TILE_SIZE;
+	if(nthreads < 1 || tileSize < 1 || width < 1 || height < 1 || bandRows < 0 || nrandom < 0) usage(argv[0]);
+	/* A progressive render goes on to anti-alias if there is time left */
+	int aaAsked = aa;
+	if(aa == 0) aa = budget > 0 ? 4 : 1;
+	if(aa < 1 || aa > AA_MAX || !(aaThreshold >= 0)) usage(argv[0]);
+	/* Pixel records assume one ray per pixel and a finished frame */
+	if(nmoves > 0 && (aa > 1 || budget > 0)) usage(argv[0]);
+	if(animName != NULL && (nmoves > 0 || budget > 0)) usage(argv[0]);
+	/* The wavefront renderer traces one ray per pixel all the way */
+	if(wave && (aa > 1 || budget > 0 || nmoves > 0)) usage(argv[0]);
+	/* A distributed render is one finished frame */
+	if((listenAddr != NULL || workerAddr != NULL) && (budget > 0 || nmoves > 0 || animName != NULL))
+		usage(argv[0]);
+	if(listenAddr != NULL && workerAddr != NULL) usage(argv[0]);
+	/* The fixed depth is rendered again band by band, for one frame */
+	if(compare && (budget > 0 || nmoves > 0 || animName != NULL || listenAddr != NULL ||
+			workerAddr != NULL))
+		usage(argv[0]);
+	if(!(roulette > 0)) usage(argv[0]);
+	/* Workers are sent the scene file, which has no triangles */
+	if(objName != NULL && (listenAddr != NULL || workerAddr != NULL)) usage(argv[0]);
+	/* A daemon renders the frames it is sent, each job says what it sees
+	 * and how long it may take, and the daemon has the scene
+	 */
+	if(serveAddr != NULL && (submitAddr != NULL || listenAddr != NULL || workerAddr != NULL ||
+			budget > 0 || nmoves > 0 || animName != NULL || compare))
+		usage(argv[0]);
+	if(submitAddr != NULL && (listenAddr != NULL || workerAddr != NULL || nmoves > 0 ||
+			animName != NULL || compare || objName != NULL || nrandom > 0))
+		usage(argv[0]);
+	if(jobs < 1 || queue < 0) usage(argv[0]);
+	/* Frames that are not written by an imageStream are bytes */
+	bool floats = imageFormatOf(output) == IMAGE_PFM;
+	if(floats && (animName != NULL || listenAddr != NULL || serveAddr != NULL || submitAddr != NULL)){
+		fprintf(stderr, "%s: --animate, --listen, --serve and --submit cannot write PFM\n", argv[0]);
+		return 1;
+	}
+
+	/* Only what the frame sees goes to the daemon. A scene file is named
+	 * by its full path, the daemon may be somewhere else.
+	 */
+	if(submitAddr != NULL){
+		serveRequest q;
+		char path[PATH_MAX];
+		memset(&q, 0, sizeof(q));
+		if(sceneName != NULL && snprintf(q.scene, sizeof(q.scene), "%s",
+				realpath(sceneName, path) != NULL ? path : sceneName) >= (int)sizeof(q.scene)){
+			fprintf(stderr, "%s: %s: scene name too long\n", argv[0], sceneName);
+			return 1;
+		}
+		if(!perspective)
+			cameraOrtho(&q.cam, width, height, WIDTH, HEIGHT);
+		else if(!cameraLookAt(&q.cam, &eye, &lookAt, &up, fov, aperture, focus, width, height)){
+			fprintf(stderr, "%s: the camera has no direction, or up is along it\n", argv[0]);
+			return 1;
+		}
+		q.aa = aaAsked;
+		q.budget = budget;
+		return serveSubmit(submitAddr, &q, output, nthreads) != 0;
+	}
+
+	animation anim = {0};
+	if(animName != NULL && animLoad(&anim, animName) != 0) return 1;
+	if(strcmp(accel, "bvh") != 0 && strcmp(accel, "scan") != 0) usage(argv[0]);
+	if(strcmp(lightMode, "grid") != 0 && strcmp(lightMode, "all") != 0) usage(argv[0]);
+	if(lightSamples < 0 || lightSamples > LIGHT_SAMPLES_MAX) usage(argv[0]);
+
+	/* A worker renders whatever frame its coordinator sets up */
+	int coordinator = -1;
+	remoteSetup setup;
+	if(workerAddr != NULL){
+		coordinator = remoteConnect(workerAddr);
+		remoteReceiveSetup(coordinator, &setup);
+		width = setup.width;
+		height = setup.height;
+		aa = setup.aa;
+		aaThreshold = setup.aaThreshold;
+		shadows = setup.shadows;
+		lightSamples = setup.lightSamples;
+		curve = (char *)tonemapCurveNames[setup.curve < 0 || setup.curve > TONEMAP_ACES ? 0 : setup.curve];
+		stops = setup.stops;
+		srgb = setup.srgb;
+		dither = setup.dither;
+		termMode = (char *)terminateModeNames[setup.terminate < 0 || setup.terminate > TERMINATE_ROULETTE ?
+			0 : setup.terminate];
+		roulette = setup.roulette;
+		sceneName = workerAddr;
+		if(wave && aa > 1){
+			fprintf(stderr, "%s: --wavefront cannot render a frame with --aa\n", argv[0]);
+			return 1;
+		}
+	}
+	tonemap tm;
+	if(tonemapInit(&tm, curve, stops, srgb, dither) != 0 || !isfinite(tm.scale)) usage(argv[0]);
+
+	material materials[3];
+	materials[0].diffuse.red = 1;
+	materials[0].diffuse.green = 0;
+	materials[0].diffuse.blue = 0;
+	materials[0].reflection = 0.2;
+
+	materials[1].diffuse.red = 0;
+	materials[1].diffuse.green = 1;
+	materials[1].diffuse.blue = 0;
+	materials[1].reflection = 0.5;
+
+	materials[2].diffuse.red = 0;
+	materials[2].diffuse.green = 0;
+	materials[2].diffuse.blue = 1;
+	materials[2].reflection = 0.9;
+
+	sphere spheres[5];
+	spheres[0].pos.x = 100;
+	spheres[0].pos.y = 200;
+	spheres[0].pos.z = 0;
+	spheres[0].radius = 100;
+	spheres[0].material = 0;
+
+	spheres[1].pos.x = 400;
+	spheres[1].pos.y = 400;
+	spheres[1].pos.z = 0;
+	spheres[1].radius = 100;
+	spheres[1].material = 1;
+
+	spheres[2].pos.x = 900;
+	spheres[2].pos.y = 140;
+	spheres[2].pos.z = 0;
+	spheres[2].radius = 100;
+	spheres[2].material = 2;
+
+  spheres[3].pos.x = 300;
+	spheres[3].pos.y = 840;
+	spheres[3].pos.z = 0;
+	spheres[3].radius = 100;
+	spheres[3].material = 0;
+
+  spheres[4].pos.x = 600;
+  spheres[4].pos.y = 740;
+  spheres[4].pos.z = 0;
+  spheres[4].radius = 100;
+  spheres[4].material = 2;
+
+
+	int nmaterials = 3;
+	light lights[3];
+
+	lights[0].pos.x = 0;
+	lights[0].pos.y = 240;
+	lights[0].pos.z = -100;
+	lights[0].intensity.red = 1;
+	lights[0].intensity.green = 1;
+	lights[0].intensity.blue = 1;
+	lights[0].radius = 0;
+
+	lights[1].pos.x = 3200;
+	lights[1].pos.y = 3000;
+	lights[1].pos.z = -1000;
+	lights[1].intensity.red = 0.6;
+	lights[1].intensity.green = 0.7;
+	lights[1].intensity.blue = 1;
+	lights[1].radius = 0;
+
+	lights[2].pos.x = 600;
+	lights[2].pos.y = 0;
+	lights[2].pos.z = -100;
+	lights[2].intensity.red = 0.3;
+	lights[2].intensity.green = 0.5;
+	lights[2].intensity.blue = 1;
+	lights[2].radius = 0;
+
+	/* Everything that lasts the whole run is taken from one arena, and
+	 * given back at once at the end
+	 */
+	arena sceneMem;
+	arenaInit(&sceneMem, "scene", 0);
+
+	scene s;
+	s.mem = &sceneMem;
+	s.spheres = spheres;
+	s.nspheres = 5;
+	s.boxes = NULL;
+	s.nboxes = 0;
+	s.mesh = NULL;
+	s.inst = NULL;
+	s.materials = materials;
+	s.lights = lights;
+	s.nlights = 3;
+	if(nrandom > 0){
+		s.spheres = randomSpheres(&sceneMem, nrandom);
+		s.nspheres = nrandom;
+	}
+
+	/* A scene file is used where it is mapped, nothing is copied unless
+	 * something is going to move
+	 */
+	bool copied = sceneName != NULL && (nmoves > 0 || animName != NULL);
+	sceneFile file = {0};
+	if(sceneName != NULL){
+		struct timespec t0, t1;
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if(coordinator >= 0 ? remoteReceiveScene(coordinator, &setup, &file, sceneName) != 0 :
+				sceneMap(&file, sceneName) != 0)
+			return 1;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		s.spheres = file.spheres;
+		s.nspheres = file.h->nspheres;
+		s.boxes = file.boxes;
+		s.nboxes = file.h->nboxes;
+		s.materials = file.materials;
+		nmaterials = file.h->nmaterials;
+		s.lights = file.lights;
+		s.nlights = file.h->nlights;
+		if(copied){
+			s.spheres = copyOf(&sceneMem, s.spheres, s.nspheres * sizeof(sphere));
+			s.boxes = copyOf(&sceneMem, s.boxes, s.nboxes * sizeof(box));
+			s.lights = copyOf(&sceneMem, s.lights, s.nlights * sizeof(light));
+		}
+		fprintf(stderr, "scene: %d spheres, %d boxes, %d lights from %s, %s in %.2f ms\n",
+			s.nspheres, s.nboxes, s.nlights, sceneName, coordinator >= 0 ? "received" : "mapped",
+			(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) * 1e-6);
+	}
+
+	/* The mesh is read into buffers of its own, it does not move */
+	mesh obj;
+	if(objName != NULL){
+		double t0 = monotonicSeconds();
+		if(objMaterial < 0 || objMaterial >= nmaterials){
+			fprintf(stderr, "%s: no material %d for the mesh\n", argv[0], objMaterial);
+			return 1;
+		}
+		if(meshLoadObj(&obj, objName, objMaterial) != 0) return 1;
+		if(obj.ntris >= 1 << PRIM_INDEX_BITS){
+			fprintf(stderr, "%s: %d triangles are more than a reference can name\n", argv[0], obj.ntris);
+			return 1;
+		}
+		meshPlace(&obj, &objAt, objSize);
+		if(obj.ntris > 0) s.mesh = &obj;
+		fprintf(stderr, "mesh: %d triangles, %d vertices, %zu bytes from %s, read in %.2f ms\n",
+			obj.ntris, obj.nverts, (size_t)obj.ntris * 3 * sizeof(int) + (size_t)obj.nverts * sizeof(vector),
+			objName, (monotonicSeconds() - t0) * 1e3);
+	}
+
+	int i;
+	for(i = 0; i < nmoves; i++)
+		if(moves[i].sphere < 0 || moves[i].sphere >= s.nspheres){
+			fprintf(stderr, "%s: no sphere %d to move\n", argv[0], moves[i].sphere);
+			return 1;
+		}
+	if(animName != NULL){
+		if(animCheck(&anim, animName, s.nspheres, s.nboxes, s.nlights) != 0) return 1;
+		animStep(&anim, 0, s.spheres, s.boxes, s.lights);
+	}
+
+	camera cam;
+	if(coordinator >= 0)
+		cam = setup.cam;
+	else if(perspective){
+		if(!cameraLookAt(&cam, &eye, &lookAt, &up, fov, aperture, focus, width, height)){
+			fprintf(stderr, "%s: the camera has no direction, or up is along it\n", argv[0]);
+			return 1;
+		}
+	}else
+		cameraOrtho(&cam, width, height, WIDTH, HEIGHT);
+	cameraBounds(&cam, &s.viewLo, &s.viewHi);
+
+	/* A moving camera is set up for every frame at once, and the BVH is
+	 * padded for wherever it goes
+	 */
+	camera *cams = NULL;
+	if(animName != NULL && animCamera(&anim, 0, &eye, &lookAt)){
+		cams = arenaAlloc(&sceneMem, anim.frames * sizeof(camera));
+		if(cams == NULL){
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+		for(i = 0; i < anim.frames; i++){
+			vector lo, hi;
+			animCamera(&anim, i, &eye, &lookAt);
+			if(!cameraLookAt(&cams[i], &eye, &lookAt, &up, fov, aperture, focus, width, height)){
+				fprintf(stderr, "%s: frame %d: the camera has no direction, or up is along it\n",
+					animName, i);
+				return 1;
+			}
+			cameraBounds(&cams[i], &lo, &hi);
+			s.viewLo.x = fminf(s.viewLo.x, lo.x);
+			s.viewLo.y = fminf(s.viewLo.y, lo.y);
+			s.viewLo.z = fminf(s.viewLo.z, lo.z);
+			s.viewHi.x = fmaxf(s.viewHi.x, hi.x);
+			s.viewHi.y = fmaxf(s.viewHi.y, hi.y);
+			s.viewHi.z = fmaxf(s.viewHi.z, hi.z);
+		}
+	}
+
+	/* A float image is not quantized, nothing is cut from it */
+	terminatePolicy term;
+	if(terminateInit(&term, termMode, roulette, s.materials, nmaterials, s.lights, s.nlights,
+			floats ? NULL : &tm) != 0)
+		usage(argv[0]);
+
+	/* The coordinator only hands out tiles, it needs no BVH of its own */
+	if(listenAddr != NULL){
+		memset(&setup, 0, sizeof(setup));
+		setup.byteOrder = REMOTE_BYTE_ORDER;
+		setup.size = sizeof(remoteSetup);
+		setup.width = width;
+		setup.height = height;
+		setup.cam = cam;
+		setup.aa = aa;
+		setup.aaThreshold = aaThreshold;
+		setup.shadows = shadows;
+		setup.lightSamples = lightSamples;
+		setup.curve = tm.curve;
+		setup.stops = tm.stops;
+		setup.srgb = tm.srgb;
+		setup.dither = tm.dither;
+		setup.terminate = term.mode;
+		setup.roulette = term.threshold;
+		return renderCoordinator(&s, sceneName != NULL ? &file : NULL, nmaterials, &setup,
+			listenAddr, tileSize, nthreads, output);
+	}
+	s.useBvh = strcmp(accel, "bvh") == 0;
+	s.shadows = shadows;
+	s.lightSamples = lightSamples;
+	lightGrid grid;
+	instanceSet instances;
+	if(scenePrepare(&s, sceneName != NULL ? &file : NULL, !copied,
+			strcmp(lightMode, "grid") == 0 ? &grid : NULL, &instances) != 0)
+		return 1;
+
+	const char *kernelName = "off", *toneName = "scalar";
+	packetKernel *kernel = NULL;
+	if(strcmp(simd, "off") != 0){
+		kernel = packetSelect(simd, &kernelName);
+		if(kernel == NULL){
+			fprintf(stderr, "%s: %s kernel not supported on this CPU\n", argv[0], simd);
+			return 1;
+		}
+	}
+	tonemapKernel *toneKernel = tonemapSelect(simd, &toneName);
+
+	/* A daemon keeps this scene and renders the jobs it is sent */
+	if(serveAddr != NULL){
+		renderServer sv;
+		memset(&sv, 0, sizeof(sv));
+		sv.tileSize = tileSize;
+		sv.threads = nthreads / jobs > 0 ? nthreads / jobs : 1;
+		sv.bandRows = bandRows;
+		sv.aa = aaAsked;
+		sv.aaThreshold = aaThreshold;
+		sv.wave = wave;
+		sv.sortRays = sortRays;
+		sv.useBvh = s.useBvh;
+		sv.shadows = shadows;
+		sv.lightSamples = lightSamples;
+		sv.grid = strcmp(lightMode, "grid") == 0;
+		sv.tm = &tm;
+		sv.termMode = termMode;
+		sv.roulette = roulette;
+		sv.kernel = kernel;
+		sv.toneKernel = toneKernel;
+		fprintf(stderr, "serve: %s packets, %s tone mapping\n", kernelName, toneName);
+		return renderServe(&sv, &s, &term, sceneName, serveAddr, jobs, queue);
+	}
+
+	/* The image is rendered and written out in bands of rows, only one
+	 * band is ever held in memory. Progressive passes go over the whole
+	 * image, and so do edits, so then it is one band. An animation
+	 * renders into the buffers of its frame writer instead.
+	 */
+	if(budget > 0 || nmoves > 0 || animName != NULL)
+		bandRows = height;
+	else if(bandRows == 0){
+		bandRows = BAND_BYTES / ((3 + sizeof(colour)) * width);
+		if(bandRows < 1) bandRows = 1;
+	}
+	if(bandRows > height) bandRows = height;
+	unsigned char *band = NULL;
+	colour *frame = NULL;
+	imageStream out;
+	if(coordinator < 0){
+		frame = arenaAlloc(&sceneMem, (size_t)width * bandRows * sizeof(colour));
+		if(frame == NULL){
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+	}
+	if(animName == NULL && coordinator < 0){
+		band = arenaAlloc(&sceneMem, (size_t)3 * width * bandRows);
+		if(band == NULL){
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+		if(imageBegin(&out, output, width, height, nthreads) != 0){
+			perror(output);
+			return 1;
+		}
+	}
+
+	renderJob job;
+	job.s = &s;
+	job.frame = frame;
+	job.img = band;
+	job.tm = &tm;
+	job.toneSeconds = 0;
+	/* Samples brighter than white are clamped to it when they would be
+	 * on display, but a tone curve or a float image needs them all
+	 */
+	job.sampleMax = tm.curve == TONEMAP_CLAMP && !floats ? 1.0f / tm.scale : INFINITY;
+	job.width = width;
+	job.height = height;
+	job.cam = &cam;
+	job.term = &term;
+	job.aa = aa;
+	job.aaThreshold = aaThreshold;
+	job.deadline = 0;
+	job.records = NULL;
+	job.edit = NULL;
+	if(nmoves > 0){
+		job.records = arenaAlloc(&sceneMem, (size_t)width * height * sizeof(pixelRecord));
+		if(job.records == NULL){
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+	}
+	job.stats = arenaCalloc(&sceneMem, nthreads * sizeof(renderStats));
+	job.shadows = arenaAlloc(&sceneMem, nthreads * sizeof(shadowCache));
+	job.culls = arenaAlloc(&sceneMem, nthreads * sizeof(tileCull));
+	job.scratch = arenaAlloc(&sceneMem, nthreads * sizeof(arena));
+	if(job.stats == NULL || job.shadows == NULL || job.culls == NULL || job.scratch == NULL){
+		fprintf(stderr, "%s: out of memory\n", argv[0]);
+		return 1;
+	}
+	memset(job.shadows, 0xff, nthreads * sizeof(shadowCache));	/* no blockers yet, -1 */
+	for(i = 0; i < nthreads; i++)
+		arenaInit(&job.scratch[i], "scratch", 0);
+	job.waves = NULL;
+	job.sortRays = sortRays;
+	if(wave){
+		job.waves = arenaAlloc(&sceneMem, nthreads * sizeof(wavefront));
+		if(job.waves == NULL){
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+		for(i = 0; i < nthreads; i++)
+			wavefrontInit(&job.waves[i], tileSize * tileSize, &job.scratch[i]);
+	}
+
+	fixedCompare cmp = {0};
+	if(compare){
+		terminateInit(&cmp.fixed, "fixed", roulette, NULL, 0, NULL, 0, NULL);
+		cmp.stats = arenaCalloc(&sceneMem, nthreads * sizeof(renderStats));
+		cmp.img = arenaAlloc(&sceneMem, (size_t)3 * width * bandRows);
+		if(cmp.stats == NULL || cmp.img == NULL){
+			fprintf(stderr, "%s: out of memory\n", argv[0]);
+			return 1;
+		}
+	}
+
+	job.kernel = kernel;
+	job.toneKernel = toneKernel;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	int y0, k, passes = 0;
+	if(coordinator >= 0)
+		renderWorker(&job, coordinator, tileSize, nthreads);
+	else if(animName != NULL){
+		if(renderAnimation(&job, &anim, cams, tileSize, nthreads, output) != 0)
+			return 1;
+	}else if(budget > 0){
+		/* The budget runs from the start of the program */
+		job.deadline = launched + budget * 1e-3;
+		passes = renderProgressive(&job, tileSize, nthreads);
+		if(writeBand(&job, &out, height, nthreads) != 0){
+			perror(output);
+			return 1;
+		}
+	}else for(y0 = 0; y0 < height; y0 += bandRows){
+		int y1 = y0 + bandRows < height ? y0 + bandRows : height;
+		job.y0 = y0;
+		renderTiles(0, y0, width, y1, tileSize, nthreads,
+			wave ? renderTileWavefront : renderTile, &job);
+		if(writeBand(&job, &out, y1, nthreads) != 0){
+			perror(output);
+			return 1;
+		}
+		if(compare) compareBand(&job, &cmp, y1, tileSize, nthreads, wave, floats);
+	}
+	if(animName == NULL && coordinator < 0 && imageEnd(&out) != 0){
+		perror(output);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9 - cmp.seconds;
+	renderStats total;
+	statsMerge(&total, job.stats, nthreads);
+	if(budget > 0)
+		fprintf(stderr, "progressive: %d passes finished in %.0f ms budget, %ld tiles skipped\n",
+			passes, budget, total.skipped);
+	fprintf(stderr, "rendered %dx%d with %d threads, %s packets, %s in %.3f s, %.2f Mrays/s\n",
+		width, height, nthreads, kernelName, accel, seconds, total.rays / seconds * 1e-6);
+	if(aa > 1)
+		fprintf(stderr, "anti-aliasing: %.2f samples per pixel, %.1f%% of pixels sampled %d times\n",
+			(double)total.samples / ((double)width * height),
+			100.0 * total.refined / ((double)width * height), aa * aa);
+	statsPrint(stderr, &total);
+	if(!floats && coordinator < 0)
+		fprintf(stderr, "tonemap: %s%s%s, exposure %g, %s in %.2f ms\n", tonemapCurveNames[tm.curve],
+			tm.srgb ? ", srgb" : "", tm.dither ? ", dither" : "", tm.stops, toneName,
+			job.toneSeconds * 1e3);
+	if(term.mode == TERMINATE_ROULETTE)
+		fprintf(stderr, "terminate: roulette below %g steps\n", term.threshold);
+	if(compare){
+		renderStats fixed;
+		statsMerge(&fixed, cmp.stats, nthreads);
+		fprintf(stderr, "terminate: %s saves %ld of %ld bounces (%.1f%%) and %ld rays of the fixed depth, "
+			"which took %.3f s; %ld bytes of the image differ, by at most %d\n",
+			terminateModeNames[term.mode], bounces(&fixed) - bounces(&total), bounces(&fixed),
+			bounces(&fixed) ? 100.0 * (bounces(&fixed) - bounces(&total)) / bounces(&fixed) : 0.0,
+			fixed.rays - total.rays, cmp.seconds, cmp.differ, cmp.most);
+	}
+
+	/* Make the moves one after the other, each time tracing again only
+	 * the pixels the move can change, and write every frame
+	 */
+	for(k = 0; k < nmoves; k++){
+		char name[FRAME_NAME];
+		sceneEdit edit;
+		int ref = PRIM_REF(PRIM_SPHERE, moves[k].sphere);
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		s.spheres[moves[k].sphere].pos = moves[k].pos;
+		if(s.useBvh){
+			/* Refit like an animation frame, build again only once that
+			 * has made the BVH REFIT_LIMIT times as costly
+			 */
+			if(bvhRefit(&s.accel, s.spheres, s.nspheres, s.boxes, s.nboxes, s.mesh, s.inst,
+					&s.viewLo, &s.viewHi) > REFIT_LIMIT * s.accel.cost){
+				bvhRebuild(&s.accel, s.spheres, s.nspheres, s.boxes, s.nboxes, s.mesh, s.inst,
+					&s.viewLo, &s.viewHi);
+				sceneSoA(&s);
+			}else
+				sceneSoAFill(&s);
+		}else{
+			s.soa.x[moves[k].sphere] = moves[k].pos.x;
+			s.soa.y[moves[k].sphere] = moves[k].pos.y;
+			s.soa.z[moves[k].sphere] = moves[k].pos.z;
+			sceneCullBounds(&s);
+		}
+		editMake(&edit, s.spheres, s.nspheres, s.boxes, s.nboxes, s.mesh, s.inst, ref, s.lights,
+			s.nlights, s.lightGrid, s.shadows);
+		job.edit = &edit;
+		memset(job.stats, 0, nthreads * sizeof(renderStats));
+		renderTiles(0, 0, width, height, tileSize, nthreads, renderTileEdit, &job);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		frameName(name, sizeof(name), output, k + 1);
+		if(imageBegin(&out, name, width, height, nthreads) != 0 || writeBand(&job, &out, height, nthreads) != 0 ||
+				imageEnd(&out) != 0){
+			perror(name);
+			return 1;
+		}
+		statsMerge(&total, job.stats, nthreads);
+		fprintf(stderr, "move %d: sphere %d to (%g, %g, %g), traced %ld of %d pixels (%.1f%%) again in %.3f s\n",
+			k + 1, moves[k].sphere, moves[k].pos.x, moves[k].pos.y, moves[k].pos.z,
+			total.samples, width * height, 100.0 * total.samples / ((double)width * height),
+			(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+	}
+
+	printArenas(&s, &job, nthreads);
+	if(s.useBvh) bvhFree(&s.accel);
+	if(objName != NULL) meshFree(&obj);
+	if(s.inst != NULL) instanceFree(&instances);
+	if(s.lightGrid != NULL) lightGridFree(&grid);
+	if(sceneName != NULL) sceneUnmap(&file);
+	animFree(&anim);
+	free(moves);
+	for(i = 0; i < nthreads; i++)
+		arenaFree(&job.scratch[i]);
+	arenaFree(&sceneMem);
+
+return 0;
+}
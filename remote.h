@@ -0,0 +1,572 @@
+/* Rendering one frame on several machines.
+ *
+ * A coordinator (--listen) loads the scene and cuts the image into
+ * tiles. Workers (--worker) connect to it over TCP. Each one is sent the
+ * scene and the view once, then renders the tiles it is handed on all of
+ * its threads and sends back their pixels. A worker has up to
+ * REMOTE_INFLIGHT tiles at a time and gets a new one as each comes back,
+ * so faster workers do more of the frame. The coordinator never waits on
+ * one worker: what it sends goes out as each socket takes it, the scene
+ * too, and a worker gets tiles once it has all of the scene.
+ *
+ * A tile that has been out for much longer than tiles usually take is
+ * handed to a second worker, so one slow or stuck worker cannot hold up
+ * the frame. Whichever copy comes back first is used. The tiles of a
+ * worker that disconnects are handed out again. Once the frame is done
+ * the coordinator sends DONE and hangs up, also on workers still busy
+ * with tiles it got elsewhere; they take the lost connection for the
+ * end of the frame too.
+ *
+ * Messages are a remoteHeader followed by length bytes. Records are sent
+ * as they are laid out in memory, so the coordinator and the workers
+ * must be the same build on the same kind of machine. The scene goes
+ * over as a scene image (see scenefile.h), and its header catches a
+ * mismatch.
+ */
+#ifndef REMOTE_H
+#define REMOTE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/tcp.h>
+
+#include "util.h"
+#include "tiles.h"
+#include "camera.h"
+#include "scenefile.h"
+
+/* Default edge of the tiles the coordinator hands out. Each is cut again
+ * into the tiles of the worker's threads.
+ */
+#define REMOTE_TILE 128
+
+/* Tiles a worker holds at once, so the next one is already there when
+ * it sends back the last
+ */
+#define REMOTE_INFLIGHT 2
+
+/* A tile is handed out again once it has been out this many times as
+ * long as tiles take on average
+ */
+#define REMOTE_SLOW 3.0
+
+/* How often the coordinator looks for slow tiles, in ms */
+#define REMOTE_POLL_MS 100
+
+#define REMOTE_BYTE_ORDER 0x01020304
+
+enum{
+	REMOTE_MSG_SETUP,	/* coordinator to worker: remoteSetup, then the scene image */
+	REMOTE_MSG_TILE,	/* coordinator to worker: remoteTileMsg */
+	REMOTE_MSG_PIXELS,	/* worker to coordinator: remoteTileMsg, then its pixels */
+	REMOTE_MSG_DONE	/* coordinator to worker: the frame is finished */
+};
+
+typedef struct{
+	uint32_t type;
+	uint32_t length;	/* bytes that follow */
+}remoteHeader;
+
+/* Everything about the frame that changes the pixels. How a worker
+ * traces them (threads, kernel, acceleration) is its own business, every
+ * way gives the same image.
+ */
+typedef struct{
+	uint32_t byteOrder;
+	uint32_t size;		/* sizeof(remoteSetup) */
+	int32_t width, height;
+	camera cam;
+	int32_t aa;
+	float aaThreshold;
+	int32_t shadows;
+	int32_t lightSamples;
+	int32_t curve;		/* tonemapCurve */
+	float stops;
+	int32_t srgb, dither;
+	int32_t terminate;	/* terminateMode */
+	float roulette;
+	uint64_t sceneSize;	/* bytes of scene image after this */
+}remoteSetup;
+
+typedef struct{
+	int32_t id;	/* index of the tile at the coordinator */
+	tile t;
+}remoteTileMsg;
+
+/* A tile of the frame at the coordinator */
+typedef struct{
+	tile t;
+	int holders;	/* workers rendering it now */
+	bool done;
+	double issued;	/* when it was last handed out */
+}remoteTile;
+
+/* Room for the messages to a worker that have not gone out yet: the
+ * setup, or else the tiles it holds and DONE
+ */
+#define REMOTE_OUT (sizeof(remoteHeader) + sizeof(remoteSetup) + \
+	(REMOTE_INFLIGHT + 1) * (sizeof(remoteHeader) + sizeof(remoteTileMsg)))
+
+/* A connected worker at the coordinator */
+typedef struct{
+	int fd;		/* -1 once it is gone */
+	char name[64];
+	int tiles[REMOTE_INFLIGHT];	/* ids of the tiles it holds */
+	int ntiles;
+	unsigned char out[REMOTE_OUT];	/* messages to send, from outFrom to outTo */
+	size_t outFrom, outTo;
+	unsigned char *scene;	/* rest of the scene image, sent after them; NULL once it is all sent */
+	size_t sceneLeft;
+	remoteHeader h;	/* message being received */
+	unsigned char *buf;	/* header, then body */
+	size_t got;	/* bytes of the message received so far */
+	int first;	/* tiles it was first to send back */
+	int late;	/* tiles another worker had already sent */
+}remoteWorker;
+
+static double remoteNow(void){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Split "host:port" at the last colon. host is empty if there is none. */
+static void remoteSplit(char *addr, char *host, size_t hostSize, char **port){
+	char *colon = strrchr(addr, ':');
+
+	if(colon == NULL){
+		host[0] = '\0';
+		*port = addr;
+		return;
+	}
+	snprintf(host, hostSize, "%.*s", (int)(colon - addr), addr);
+	*port = colon + 1;
+}
+
+/* Listen on [host:]port, every address of the machine without a host */
+static int remoteListen(char *addr){
+	char host[256], *port;
+	struct addrinfo *res, *ai;
+	const int on = 1;
+	int fd = -1;
+
+	remoteSplit(addr, host, sizeof(host), &port);
+	res = Host_serv(host[0] != '\0' ? host : NULL, port, AF_UNSPEC, SOCK_STREAM);
+	for(ai = res; ai != NULL; ai = ai->ai_next){
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(fd >= 0) break;
+	}
+	if(fd < 0)
+		err_sys("cannot listen on %s", addr);
+	Setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	Bind(fd, ai->ai_addr, ai->ai_addrlen);
+	if(listen(fd, 64) < 0)
+		err_sys("listen on %s", addr);
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* Connect to the coordinator at host:port */
+static int remoteConnect(char *addr){
+	char host[256], *port;
+	struct addrinfo *res, *ai;
+	const int on = 1;
+	int fd = -1;
+
+	remoteSplit(addr, host, sizeof(host), &port);
+	if(host[0] == '\0')
+		err_quit("%s: expected host:port", addr);
+	res = Host_serv(host, port, AF_UNSPEC, SOCK_STREAM);
+	for(ai = res; ai != NULL; ai = ai->ai_next){
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if(fd < 0) continue;
+		if(connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+		close(fd);
+		fd = -1;
+	}
+	if(fd < 0)
+		err_sys("cannot connect to %s", addr);
+	Setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* Read exactly n bytes, the connection ending first is fatal. For the
+ * worker, which has nothing left to do once its coordinator is gone.
+ */
+static void remoteReadAll(int fd, void *p, size_t n){
+	char *c = p;
+
+	while(n > 0){
+		ssize_t got = Read(fd, c, n);
+		if(got == 0)
+			err_quit("coordinator closed the connection");
+		c += got;
+		n -= got;
+	}
+}
+
+/* Read exactly n bytes of the tiles a worker is handed. Returns -1 if
+ * the coordinator closed or reset the connection first, which it does
+ * when the frame is done; other errors are fatal.
+ */
+static int remoteReadTile(int fd, void *p, size_t n){
+	char *c = p;
+
+	while(n > 0){
+		ssize_t got = read(fd, c, n);
+		if(got < 0 && errno == EINTR) continue;
+		if(got == 0 || (got < 0 && errno == ECONNRESET)) return -1;
+		if(got < 0)
+			err_sys("worker: read from the coordinator");
+		c += got;
+		n -= got;
+	}
+	return 0;
+}
+
+/* Write n bytes where the other end going away must not take this one
+ * with it. Returns 0 on success, or -1 with errno saying why.
+ */
+static int remoteSend(int fd, void *p, size_t n){
+	char *c = p;
+
+	while(n > 0){
+		ssize_t sent = write(fd, c, n);
+		if(sent < 0 && errno == EINTR) continue;
+		if(sent <= 0) return -1;
+		c += sent;
+		n -= sent;
+	}
+	return 0;
+}
+
+/* Add n bytes at p to the messages waiting to go to w */
+static void remoteQueue(remoteWorker *w, void *p, size_t n){
+	if(w->outTo + n > sizeof(w->out)){
+		memmove(w->out, w->out + w->outFrom, w->outTo - w->outFrom);
+		w->outTo -= w->outFrom;
+		w->outFrom = 0;
+	}
+	memcpy(w->out + w->outTo, p, n);
+	w->outTo += n;
+}
+
+/* Whether w has anything waiting to be sent */
+static bool remotePending(remoteWorker *w){
+	return w->outFrom < w->outTo || w->scene != NULL;
+}
+
+/* Send w as much of what waits for it as its socket takes without
+ * blocking. Returns 0, or -1 if the worker went away.
+ */
+static int remoteFlush(remoteWorker *w){
+	while(remotePending(w)){
+		bool queued = w->outFrom < w->outTo;
+		ssize_t sent = write(w->fd, queued ? w->out + w->outFrom : w->scene,
+			queued ? w->outTo - w->outFrom : w->sceneLeft);
+		if(sent < 0 && errno == EINTR) continue;
+		if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+		if(sent <= 0) return -1;
+		if(queued){
+			w->outFrom += sent;
+			if(w->outFrom == w->outTo) w->outFrom = w->outTo = 0;
+		}else if((w->sceneLeft -= sent) == 0)
+			w->scene = NULL;
+		else
+			w->scene += sent;
+	}
+	return 0;
+}
+
+/* Queue the setup of the frame for w, and the scene image after it */
+static void remoteQueueSetup(remoteWorker *w, remoteSetup *setup, sceneFile *scene){
+	remoteHeader h = {REMOTE_MSG_SETUP, sizeof(remoteSetup) + setup->sceneSize};
+
+	remoteQueue(w, &h, sizeof(h));
+	remoteQueue(w, setup, sizeof(*setup));
+	w->scene = scene->base;
+	w->sceneLeft = setup->sceneSize;
+}
+
+/* Receive the setup of the frame on a worker. The scene image follows
+ * and is read by remoteReceiveScene().
+ */
+static void remoteReceiveSetup(int fd, remoteSetup *setup){
+	remoteHeader h;
+
+	remoteReadAll(fd, &h, sizeof(h));
+	if(h.type != REMOTE_MSG_SETUP || h.length < sizeof(remoteSetup))
+		err_quit("coordinator sent no setup");
+	remoteReadAll(fd, setup, sizeof(*setup));
+	if(setup->byteOrder != REMOTE_BYTE_ORDER || setup->size != sizeof(remoteSetup) ||
+			h.length != sizeof(remoteSetup) + setup->sceneSize)
+		err_quit("coordinator was built differently from this worker");
+}
+
+static int remoteReceiveScene(int fd, remoteSetup *setup, sceneFile *f, char *name){
+	if(sceneAllocate(f, setup->sceneSize) != 0){
+		perror(name);
+		return -1;
+	}
+	remoteReadAll(fd, f->base, f->size);
+	if(sceneCheck(f, name) != 0){
+		sceneUnmap(f);
+		return -1;
+	}
+	return 0;
+}
+
+/* Hand tile id to w, it goes out with remoteFlush() */
+static void remoteIssue(remoteWorker *w, remoteTile *tiles, int id, double now){
+	struct{
+		remoteHeader h;
+		remoteTileMsg m;
+	}msg = {{REMOTE_MSG_TILE, sizeof(remoteTileMsg)}, {id, tiles[id].t}};
+
+	remoteQueue(w, &msg, sizeof(msg));
+	w->tiles[w->ntiles++] = id;
+	tiles[id].holders++;
+	tiles[id].issued = now;
+}
+
+/* The tile w should get next: the first nobody has, or else the one out
+ * longest if it has been out more than REMOTE_SLOW times the mean time
+ * and w does not hold it already. -1 for none.
+ */
+static int remotePick(remoteWorker *w, remoteTile *tiles, int ntiles, int *next, double now,
+		double mean){
+	int i, k, oldest = -1;
+
+	for(; *next < ntiles; (*next)++)
+		if(!tiles[*next].done && tiles[*next].holders == 0)
+			return (*next)++;
+	if(mean == 0) return -1;
+	for(i = 0; i < ntiles; i++){
+		if(tiles[i].done || now - tiles[i].issued < REMOTE_SLOW * mean) continue;
+		for(k = 0; k < w->ntiles && w->tiles[k] != i; k++)
+			;
+		if(k < w->ntiles) continue;
+		if(oldest < 0 || tiles[i].issued < tiles[oldest].issued) oldest = i;
+	}
+	return oldest;
+}
+
+/* Forget w, its tiles go back to be handed out from the start */
+static void remoteDrop(remoteWorker *w, remoteTile *tiles, int *next, char *why){
+	int k;
+
+	fprintf(stderr, "remote: worker %s %s, %d tiles back\n", w->name, why, w->ntiles);
+	for(k = 0; k < w->ntiles; k++){
+		int id = w->tiles[k];
+		tiles[id].holders--;
+		if(!tiles[id].done && tiles[id].holders == 0 && id < *next) *next = id;
+	}
+	w->ntiles = 0;
+	w->outFrom = w->outTo = 0;
+	w->scene = NULL;
+	close(w->fd);
+	w->fd = -1;
+}
+
+/* Render the frame of width by height pixels in tiles of tileSize on the
+ * workers that connect to listenFd, into img. Returns once every tile is
+ * back; there is no timeout for workers to show up.
+ */
+static void remoteCoordinate(int listenFd, remoteSetup *setup, sceneFile *scene,
+		unsigned char *img, int tileSize){
+	int width = setup->width, height = setup->height;
+	int tilesX = (width + tileSize - 1) / tileSize, tilesY = (height + tileSize - 1) / tileSize;
+	int ntiles = tilesX * tilesY, remaining = ntiles, next = 0;
+	size_t maxBody = sizeof(remoteTileMsg) + (size_t)3 * tileSize * tileSize;
+	remoteTile *tiles = Calloc(ntiles, sizeof(remoteTile));
+	remoteWorker *workers = NULL;
+	int nworkers = 0, reissued = 0, i, k;
+	double spent = 0, t0 = remoteNow();
+	long returned = 0;
+
+	Signal(SIGPIPE, SIG_IGN);
+	for(i = 0; i < ntiles; i++){
+		tile *t = &tiles[i].t;
+		t->x0 = i % tilesX * tileSize;
+		t->y0 = i / tilesX * tileSize;
+		t->x1 = t->x0 + tileSize < width ? t->x0 + tileSize : width;
+		t->y1 = t->y0 + tileSize < height ? t->y0 + tileSize : height;
+	}
+
+	while(remaining > 0){
+		struct pollfd *fds = Calloc(nworkers + 1, sizeof(struct pollfd));
+		double now = remoteNow(), mean = returned > 0 ? spent / returned : 0;
+
+		/* Top up every worker that has the scene, counting what is
+		 * handed out again
+		 */
+		for(i = 0; i < nworkers; i++){
+			remoteWorker *w = &workers[i];
+			while(w->fd >= 0 && w->scene == NULL && w->ntiles < REMOTE_INFLIGHT){
+				int id = remotePick(w, tiles, ntiles, &next, now, mean);
+				if(id < 0) break;
+				if(tiles[id].holders > 0) reissued++;
+				remoteIssue(w, tiles, id, now);
+			}
+			if(w->fd >= 0 && remoteFlush(w) != 0)
+				remoteDrop(w, tiles, &next, "went away");
+		}
+
+		fds[0].fd = listenFd;
+		fds[0].events = POLLIN;
+		for(i = 0; i < nworkers; i++){
+			fds[i + 1].fd = workers[i].fd;
+			fds[i + 1].events = POLLIN | (remotePending(&workers[i]) ? POLLOUT : 0);
+		}
+		if(poll(fds, nworkers + 1, REMOTE_POLL_MS) < 0 && errno != EINTR)
+			err_sys("poll");
+
+		int polled = nworkers;
+		if(fds[0].revents & POLLIN){
+			struct sockaddr_storage sa;
+			socklen_t len = sizeof(sa);
+			const int on = 1;
+			int fd = accept(listenFd, (struct sockaddr *)&sa, &len);
+			if(fd >= 0){
+				workers = realloc(workers, (nworkers + 1) * sizeof(remoteWorker));
+				if(workers == NULL)
+					err_sys("remote: out of memory");
+				remoteWorker *w = &workers[nworkers++];
+				memset(w, 0, sizeof(*w));
+				w->fd = fd;
+				int port = sa.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&sa)->sin6_port :
+					((struct sockaddr_in *)&sa)->sin_port;
+				snprintf(w->name, sizeof(w->name), "%s:%d", Sock_ntop_host((struct sockaddr *)&sa, len),
+					ntohs(port));
+				w->buf = malloc(sizeof(remoteHeader) + maxBody);
+				if(w->buf == NULL)
+					err_sys("remote: out of memory");
+				Setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0)
+					err_sys("remote: fcntl");
+				fprintf(stderr, "remote: worker %s connected\n", w->name);
+				remoteQueueSetup(w, setup, scene);
+				if(remoteFlush(w) != 0)
+					remoteDrop(w, tiles, &next, "went away");
+			}
+		}
+
+		for(i = 0; i < polled; i++){
+			remoteWorker *w = &workers[i];
+			if(w->fd >= 0 && (fds[i + 1].revents & POLLOUT) && remoteFlush(w) != 0)
+				remoteDrop(w, tiles, &next, "went away");
+			if(w->fd < 0 || !(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+			/* One read per wakeup, so a worker that stops halfway through
+			 * a message holds up nobody but itself
+			 */
+			size_t want = w->got < sizeof(remoteHeader) ? sizeof(remoteHeader) :
+				sizeof(remoteHeader) + w->h.length;
+			ssize_t n = read(w->fd, w->buf + w->got, want - w->got);
+			if(n <= 0){
+				if(n < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+					continue;
+				remoteDrop(w, tiles, &next, "went away");
+				continue;
+			}
+			w->got += n;
+			if(w->got == sizeof(remoteHeader)){
+				memcpy(&w->h, w->buf, sizeof(remoteHeader));
+				if(w->h.type != REMOTE_MSG_PIXELS || w->h.length < sizeof(remoteTileMsg) ||
+						w->h.length > maxBody)
+					remoteDrop(w, tiles, &next, "sent a bad message");
+				continue;
+			}
+			if(w->got < sizeof(remoteHeader) + w->h.length) continue;
+			w->got = 0;
+
+			remoteTileMsg m;
+			memcpy(&m, w->buf + sizeof(remoteHeader), sizeof(m));
+			for(k = 0; k < w->ntiles && w->tiles[k] != m.id; k++)
+				;
+			if(k == w->ntiles || memcmp(&m.t, &tiles[m.id].t, sizeof(tile)) != 0 ||
+					w->h.length != sizeof(m) + (size_t)3 * (m.t.x1 - m.t.x0) * (m.t.y1 - m.t.y0)){
+				remoteDrop(w, tiles, &next, "sent a tile it was not given");
+				continue;
+			}
+			w->tiles[k] = w->tiles[--w->ntiles];
+			remoteTile *rt = &tiles[m.id];
+			rt->holders--;
+			if(rt->done){
+				w->late++;
+				continue;
+			}
+			rt->done = true;
+			remaining--;
+			w->first++;
+			spent += remoteNow() - rt->issued;
+			returned++;
+
+			unsigned char *src = w->buf + sizeof(remoteHeader) + sizeof(m);
+			int tw = m.t.x1 - m.t.x0, y;
+			for(y = m.t.y0; y < m.t.y1; y++, src += 3 * tw)
+				memcpy(img + ((size_t)y * width + m.t.x0) * 3, src, 3 * tw);
+		}
+		free(fds);
+	}
+
+	fprintf(stderr, "remote: %d tiles of %d pixels in %.3f s, %d handed out again\n", ntiles,
+		tileSize, remoteNow() - t0, reissued);
+	for(i = 0; i < nworkers; i++){
+		remoteWorker *w = &workers[i];
+		remoteHeader done = {REMOTE_MSG_DONE, 0};
+		fprintf(stderr, "remote: worker %s sent %d tiles first, %d late\n", w->name, w->first,
+			w->late);
+		/* What the socket does not take now is not waited for, the
+		 * worker takes the lost connection for the end of the frame.
+		 * One still getting the scene is only hung up on.
+		 */
+		if(w->fd >= 0){
+			if(w->scene == NULL){
+				remoteQueue(w, &done, sizeof(done));
+				remoteFlush(w);
+			}
+			close(w->fd);
+		}
+		free(w->buf);
+	}
+	free(workers);
+	free(tiles);
+}
+
+/* The next tile for a worker to render. Returns false when the frame is
+ * done.
+ */
+static bool remoteNextTile(int fd, remoteTileMsg *m){
+	remoteHeader h;
+
+	if(remoteReadTile(fd, &h, sizeof(h)) != 0) return false;
+	if(h.type == REMOTE_MSG_DONE) return false;
+	if(h.type != REMOTE_MSG_TILE || h.length != sizeof(*m))
+		err_quit("coordinator sent a bad message");
+	return remoteReadTile(fd, m, sizeof(*m)) == 0;
+}
+
+/* Send back the pixels of tile m, rows of 3 * its width bytes, which
+ * follow room for the headers at the start of buf. Returns -1 if the
+ * coordinator has hung up, the frame is done then.
+ */
+static int remoteSendPixels(int fd, remoteTileMsg *m, unsigned char *buf){
+	size_t n = (size_t)3 * (m->t.x1 - m->t.x0) * (m->t.y1 - m->t.y0);
+	remoteHeader h = {REMOTE_MSG_PIXELS, sizeof(*m) + n};
+
+	memcpy(buf, &h, sizeof(h));
+	memcpy(buf + sizeof(h), m, sizeof(*m));
+	if(remoteSend(fd, buf, sizeof(h) + sizeof(*m) + n) == 0) return 0;
+	if(errno != EPIPE && errno != ECONNRESET)
+		err_sys("worker: write to the coordinator");
+	return -1;
+}
+
+#endif
@@ -0,0 +1,401 @@
+/* scenec: convert a text scene into a binary scene file (see scenefile.h)
+ *
+ * The text format has one object per line, blank lines and lines
+ * starting with # are ignored:
+ *
+ *	material red green blue reflection
+ *	sphere x y z radius material
+ *	cube x y z length width height material
+ *	box xmin ymin zmin xmax ymax zmax material
+ *	light x y z red green blue [radius]
+ *	prototype
+ *	end
+ *	instance prototype x y z [scale [material [rx ry rz]]]
+ *
+ * Materials are numbered from 0 in the order they appear, and may come
+ * before or after the objects that use them. A cube is a box given by its
+ * centre and size, its bounds are computed here once.
+ *
+ * The spheres, cubes and boxes between prototype and end make up a
+ * prototype instead of being part of the scene. Prototypes are numbered
+ * from 0 like materials, and an instance places a copy of one, scaled by
+ * scale (1 if not given), turned by rx, ry and rz degrees about the x, y
+ * and z axes in that order and moved to x y z. Its material, if given and
+ * not -1, is used for all of the copy.
+ *
+ * The input is read twice, once to count the objects and once to store
+ * them straight into the mapped output file, so even scenes with millions
+ * of objects are converted without holding them in memory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include "geometry.h"
+#include "scenefile.h"
+
+#define LINE_MAX_LEN 1024
+
+/* Where the second pass stores the next object of each kind */
+typedef struct{
+	char *base;
+	sceneHeader *h;
+	uint32_t sphere, box, material, light;
+	uint32_t prototype, protoSphere, protoBox, instance;
+}sceneWriter;
+
+void fail(char *input, int line, char *msg){
+	fprintf(stderr, "%s:%d: %s\n", input, line, msg);
+}
+
+/* Split a line into its keyword and the numbers after it. Returns the
+ * number of values, 0 for a blank line or comment, -1 if a value is not
+ * a number.
+ */
+int parseLine(char *buf, char **keyword, float *values, int maxValues){
+	char *p = buf, *end;
+	int n = 0;
+
+	while(*p == ' ' || *p == '\t') p++;
+	if(*p == '#' || *p == '\n' || *p == '\r' || *p == '\0'){
+		*keyword = NULL;
+		return 0;
+	}
+	*keyword = p;
+	while(*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+	if(*p) *p++ = '\0';
+
+	for(;;){
+		while(*p == ' ' || *p == '\t') p++;
+		if(*p == '\0' || *p == '\n' || *p == '\r' || *p == '#') break;
+		if(n == maxValues) return -1;
+		values[n++] = strtof(p, &end);
+		if(end == p) return -1;
+		p = end;
+	}
+	return n;
+}
+
+/* The first pass counted every object, finding more in the second means
+ * the input changed under us
+ */
+int changed(uint32_t stored, uint32_t counted, char *input, int line){
+	if(stored < counted) return 0;
+	fail(input, line, "input changed while converting");
+	return 1;
+}
+
+/* Is v the number of a material of the scene? */
+bool isMaterial(sceneWriter *w, float v){
+	int mat = (int)v;
+	return mat == v && mat >= 0 && (uint32_t)mat < w->h->nmaterials;
+}
+
+/* One pass over the input. Without a writer the objects are only counted,
+ * with one they are stored. Returns 0 on success.
+ */
+int convert(FILE *in, char *input, sceneHeader *counts, sceneWriter *w){
+	char buf[LINE_MAX_LEN];
+	float v[9];
+	int line = 0;
+	int protoLine = 0;		/* where the open prototype started, 0 if none */
+	uint32_t protoObjects = 0;	/* in the open prototype so far */
+
+	while(fgets(buf, sizeof(buf), in) != NULL){
+		char *keyword;
+		int n;
+
+		line++;
+		if(strchr(buf, '\n') == NULL && !feof(in)){
+			fail(input, line, "line too long");
+			return -1;
+		}
+		n = parseLine(buf, &keyword, v, 9);
+		if(n < 0){
+			fail(input, line, "expected numbers after the keyword");
+			return -1;
+		}
+		if(keyword == NULL) continue;
+
+		if(strcmp(keyword, "material") == 0){
+			if(n != 4){
+				fail(input, line, "material needs red green blue reflection");
+				return -1;
+			}
+			if(w){
+				if(changed(w->material, w->h->nmaterials, input, line)) return -1;
+				material *m = (material *)(w->base + w->h->materials) + w->material++;
+				m->diffuse.red = v[0];
+				m->diffuse.green = v[1];
+				m->diffuse.blue = v[2];
+				m->reflection = v[3];
+			}else
+				counts->nmaterials++;
+		}else if(strcmp(keyword, "sphere") == 0){
+			if(n != 5){
+				fail(input, line, "sphere needs x y z radius material");
+				return -1;
+			}
+			if(v[3] <= 0){
+				fail(input, line, "sphere radius must be positive");
+				return -1;
+			}
+			if(w){
+				int mat = (int)v[4];
+				if(!isMaterial(w, v[4])){
+					fail(input, line, "no such material");
+					return -1;
+				}
+				sphere *s;
+				uint32_t i;
+				if(protoLine > 0){
+					if(changed(w->protoSphere, w->h->nprotoSpheres, input, line)) return -1;
+					i = w->protoSphere++;
+					s = (sphere *)(w->base + w->h->protoSpheres) + i;
+					protoObjects++;
+				}else{
+					if(changed(w->sphere, w->h->nspheres, input, line)) return -1;
+					i = w->sphere++;
+					s = (sphere *)(w->base + w->h->spheres) + i;
+				}
+				s->pos.x = v[0];
+				s->pos.y = v[1];
+				s->pos.z = v[2];
+				s->radius = v[3];
+				s->material = mat;
+				if(protoLine == 0){
+					((float *)(w->base + w->h->sphereX))[i] = v[0];
+					((float *)(w->base + w->h->sphereY))[i] = v[1];
+					((float *)(w->base + w->h->sphereZ))[i] = v[2];
+					((float *)(w->base + w->h->sphereRadius))[i] = v[3];
+					((int *)(w->base + w->h->sphereId))[i] = i;
+				}
+			}else if(protoLine > 0){
+				counts->nprotoSpheres++;
+				protoObjects++;
+			}else
+				counts->nspheres++;
+		}else if(strcmp(keyword, "cube") == 0 || strcmp(keyword, "box") == 0){
+			bool isCube = keyword[0] == 'c';
+			if(n != 7){
+				fail(input, line, isCube ? "cube needs x y z length width height material" :
+					"box needs xmin ymin zmin xmax ymax zmax material");
+				return -1;
+			}
+			if(isCube ? v[3] < 0 || v[4] < 0 || v[5] < 0 : v[0] > v[3] || v[1] > v[4] || v[2] > v[5]){
+				fail(input, line, isCube ? "cube size must not be negative" :
+					"box minimum must not be above its maximum");
+				return -1;
+			}
+			if(w){
+				int mat = (int)v[6];
+				if(!isMaterial(w, v[6])){
+					fail(input, line, "no such material");
+					return -1;
+				}
+				box *b;
+				if(protoLine > 0){
+					if(changed(w->protoBox, w->h->nprotoBoxes, input, line)) return -1;
+					b = (box *)(w->base + w->h->protoBoxes) + w->protoBox++;
+					protoObjects++;
+				}else{
+					if(changed(w->box, w->h->nboxes, input, line)) return -1;
+					b = (box *)(w->base + w->h->boxes) + w->box++;
+				}
+				if(isCube){
+					vector pos = {v[0], v[1], v[2]};
+					*b = boxFromCube(&pos, v[3], v[4], v[5], mat);
+				}else{
+					b->min.x = v[0];
+					b->min.y = v[1];
+					b->min.z = v[2];
+					b->max.x = v[3];
+					b->max.y = v[4];
+					b->max.z = v[5];
+					b->material = mat;
+				}
+			}else if(protoLine > 0){
+				counts->nprotoBoxes++;
+				protoObjects++;
+			}else
+				counts->nboxes++;
+		}else if(strcmp(keyword, "light") == 0){
+			if(n != 6 && n != 7){
+				fail(input, line, "light needs x y z red green blue and maybe a radius");
+				return -1;
+			}
+			if(n == 7 && !(v[6] >= 0)){
+				fail(input, line, "light radius must not be negative");
+				return -1;
+			}
+			if(protoLine > 0){
+				fail(input, line, "a prototype cannot hold lights");
+				return -1;
+			}
+			if(w){
+				if(changed(w->light, w->h->nlights, input, line)) return -1;
+				light *l = (light *)(w->base + w->h->lights) + w->light++;
+				l->pos.x = v[0];
+				l->pos.y = v[1];
+				l->pos.z = v[2];
+				l->intensity.red = v[3];
+				l->intensity.green = v[4];
+				l->intensity.blue = v[5];
+				l->radius = n == 7 ? v[6] : 0;
+			}else
+				counts->nlights++;
+		}else if(strcmp(keyword, "prototype") == 0){
+			if(n != 0){
+				fail(input, line, "prototype takes no numbers");
+				return -1;
+			}
+			if(protoLine > 0){
+				fail(input, line, "prototypes cannot be nested");
+				return -1;
+			}
+			protoLine = line;
+			protoObjects = 0;
+			if(w){
+				if(changed(w->prototype, w->h->nprototypes, input, line)) return -1;
+				prototype *p = (prototype *)(w->base + w->h->prototypes) + w->prototype;
+				p->firstSphere = w->protoSphere;
+				p->firstBox = w->protoBox;
+			}
+		}else if(strcmp(keyword, "end") == 0){
+			if(n != 0 || protoLine == 0){
+				fail(input, line, "end without a prototype");
+				return -1;
+			}
+			if(protoObjects == 0){
+				fail(input, line, "empty prototype");
+				return -1;
+			}
+			protoLine = 0;
+			if(w){
+				prototype *p = (prototype *)(w->base + w->h->prototypes) + w->prototype++;
+				p->nspheres = w->protoSphere - p->firstSphere;
+				p->nboxes = w->protoBox - p->firstBox;
+			}else
+				counts->nprototypes++;
+		}else if(strcmp(keyword, "instance") == 0){
+			if(n != 4 && n != 5 && n != 6 && n != 9){
+				fail(input, line, "instance needs prototype x y z and maybe scale, material and rx ry rz");
+				return -1;
+			}
+			if(protoLine > 0){
+				fail(input, line, "a prototype cannot hold instances");
+				return -1;
+			}
+			if(n >= 5 && !(v[4] > 0 && v[4] < INFINITY)){
+				fail(input, line, "instance scale must be positive");
+				return -1;
+			}
+			if(w){
+				int proto = (int)v[0];
+				if(proto != v[0] || proto < 0 || (uint32_t)proto >= w->h->nprototypes){
+					fail(input, line, "no such prototype");
+					return -1;
+				}
+				if(n >= 6 && v[5] != -1 && !isMaterial(w, v[5])){
+					fail(input, line, "no such material");
+					return -1;
+				}
+				if(changed(w->instance, w->h->ninstances, input, line)) return -1;
+				instance *in = (instance *)(w->base + w->h->instances) + w->instance++;
+				in->pos.x = v[1];
+				in->pos.y = v[2];
+				in->pos.z = v[3];
+				in->scale = n >= 5 ? v[4] : 1;
+				in->proto = proto;
+				in->material = n >= 6 ? (int)v[5] : -1;
+				instanceRotation(in->rot, n == 9 ? v[6] : 0, n == 9 ? v[7] : 0, n == 9 ? v[8] : 0);
+			}else
+				counts->ninstances++;
+		}else{
+			fail(input, line, "unknown keyword");
+			return -1;
+		}
+
+		if(!w && (counts->nspheres == INT_MAX || counts->nboxes == INT_MAX ||
+				counts->nmaterials == INT_MAX || counts->nlights == INT_MAX ||
+				counts->nprototypes == INT_MAX || counts->nprotoSpheres == INT_MAX ||
+				counts->nprotoBoxes == INT_MAX || counts->ninstances == INT_MAX)){
+			fail(input, line, "too many objects");
+			return -1;
+		}
+	}
+	if(ferror(in)){
+		perror(input);
+		return -1;
+	}
+	if(protoLine > 0){
+		fail(input, protoLine, "prototype without an end");
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]){
+	if(argc != 3){
+		fprintf(stderr, "usage: %s scene.txt scene.bin\n", argv[0]);
+		return 1;
+	}
+	char *input = argv[1], *output = argv[2];
+
+	FILE *in = fopen(input, "r");
+	if(in == NULL){
+		perror(input);
+		return 1;
+	}
+
+	sceneHeader counts;
+	memset(&counts, 0, sizeof(counts));
+	if(convert(in, input, &counts, NULL) != 0) return 1;
+
+	sceneHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+	sceneLayout(&h, counts.nspheres, counts.nboxes, counts.nmaterials, counts.nlights,
+		counts.nprototypes, counts.nprotoSpheres, counts.nprotoBoxes, counts.ninstances);
+
+	int fd = open(output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0 || ftruncate(fd, h.size) != 0){
+		perror(output);
+		return 1;
+	}
+	sceneWriter w;
+	w.base = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(w.base == MAP_FAILED){
+		perror(output);
+		return 1;
+	}
+	w.h = (sceneHeader *)w.base;
+	*w.h = h;
+	w.sphere = w.box = w.material = w.light = 0;
+	w.prototype = w.protoSphere = w.protoBox = w.instance = 0;
+
+	rewind(in);
+	if(convert(in, input, NULL, &w) != 0){
+		unlink(output);
+		return 1;
+	}
+	fclose(in);
+
+	if(msync(w.base, h.size, MS_SYNC) != 0){
+		perror(output);
+		unlink(output);
+		return 1;
+	}
+	munmap(w.base, h.size);
+
+	fprintf(stderr, "%s: %u spheres, %u boxes, %u materials, %u lights, %llu bytes\n",
+		output, h.nspheres, h.nboxes, h.nmaterials, h.nlights, (unsigned long long)h.size);
+	if(h.ninstances > 0 || h.nprototypes > 0)
+		fprintf(stderr, "%s: %u instances of %u prototypes of %u spheres and %u boxes\n",
+			output, h.ninstances, h.nprototypes, h.nprotoSpheres, h.nprotoBoxes);
+	return 0;
+}
@@ -0,0 +1,335 @@
+/* Binary scene files.
+ *
+ * A scene file holds the spheres, boxes, materials, lights, prototypes and
+ * instances of a scene
+ * in exactly the layout the renderer uses in memory, so it is mapped with
+ * mmap() and used in place: loading a scene costs no parsing and no
+ * copying, only the page faults of the parts that are touched. Files are
+ * made from the text format by scenec.
+ *
+ * The file starts with a sceneHeader followed by sections, each starting
+ * on a SCENE_ALIGN byte boundary:
+ *
+ *	spheres		sphere[nspheres]
+ *	sphere x	float[nspheres]	 \
+ *	sphere y	float[nspheres]	  | the spheres again as structure of
+ *	sphere z	float[nspheres]	  | arrays, ready for the packet kernels
+ *	sphere radius	float[nspheres]	  |
+ *	sphere id	int[nspheres]	 /
+ *	boxes		box[nboxes]
+ *	materials	material[nmaterials]
+ *	lights		light[nlights]
+ *	prototypes	prototype[nprototypes]
+ *	proto spheres	sphere[nprotoSpheres]	the spheres and boxes of all
+ *	proto boxes	box[nprotoBoxes]	prototypes, see instance.h
+ *	instances	instance[ninstances]
+ *
+ * The header records the byte order and the size of every record, so a
+ * file written on a machine with a different layout is rejected instead
+ * of being misread. The version changes whenever the layout does.
+ */
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "geometry.h"
+
+#define SCENE_MAGIC "RTSCENE"
+#define SCENE_VERSION 4
+#define SCENE_BYTE_ORDER 0x01020304
+#define SCENE_ALIGN 64
+
+/* A group of spheres and boxes that the scene places copies of, see
+ * instance.h. Its objects are ranges of the spheres and boxes of all
+ * prototypes.
+ */
+typedef struct{
+	int firstSphere, nspheres;
+	int firstBox, nboxes;
+}prototype;
+
+/* A copy of a prototype, turned by rot, scaled by scale and moved to pos */
+typedef struct{
+	vector pos;
+	float rot[3][3];	/* rows of the rotation from the prototype to the scene */
+	float scale;
+	int proto;
+	int material;		/* of all of the copy, -1 keeps those of the prototype */
+}instance;
+
+/* The rotation of rx, ry and rz degrees about x, then y, then z */
+static inline void instanceRotation(float rot[3][3], float rx, float ry, float rz){
+	float d = (float)M_PI / 180;
+	float cx = cosf(rx * d), sx = sinf(rx * d);
+	float cy = cosf(ry * d), sy = sinf(ry * d);
+	float cz = cosf(rz * d), sz = sinf(rz * d);
+
+	rot[0][0] = cz * cy; rot[0][1] = cz * sy * sx - sz * cx; rot[0][2] = cz * sy * cx + sz * sx;
+	rot[1][0] = sz * cy; rot[1][1] = sz * sy * sx + cz * cx; rot[1][2] = sz * sy * cx - cz * sx;
+	rot[2][0] = -sy;     rot[2][1] = cy * sx;                rot[2][2] = cy * cx;
+}
+
+typedef struct{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint32_t nspheres, nboxes, nmaterials, nlights;
+	uint32_t sphereSize, boxSize, materialSize, lightSize;
+	uint32_t nprototypes, nprotoSpheres, nprotoBoxes, ninstances;
+	uint32_t prototypeSize, instanceSize;
+
+	/* Offsets of the sections from the start of the file */
+	uint64_t spheres;
+	uint64_t sphereX, sphereY, sphereZ, sphereRadius, sphereId;
+	uint64_t boxes;
+	uint64_t materials;
+	uint64_t lights;
+	uint64_t prototypes, protoSpheres, protoBoxes, instances;
+	uint64_t size;		/* of the whole file */
+}sceneHeader;
+
+/* A mapped scene file, the pointers point into the mapping */
+typedef struct{
+	void *base;
+	size_t size;
+	sceneHeader *h;
+	sphere *spheres;
+	float *sphereX, *sphereY, *sphereZ, *sphereRadius;
+	int *sphereId;
+	box *boxes;
+	material *materials;
+	light *lights;
+	prototype *prototypes;
+	sphere *protoSpheres;
+	box *protoBoxes;
+	instance *instances;
+}sceneFile;
+
+static uint64_t sceneAlign(uint64_t off){
+	return (off + SCENE_ALIGN - 1) / SCENE_ALIGN * SCENE_ALIGN;
+}
+
+/* Fill in everything but the magic from the counts */
+static void sceneLayout(sceneHeader *h, uint32_t nspheres, uint32_t nboxes,
+		uint32_t nmaterials, uint32_t nlights, uint32_t nprototypes, uint32_t nprotoSpheres,
+		uint32_t nprotoBoxes, uint32_t ninstances){
+	uint64_t off;
+
+	h->version = SCENE_VERSION;
+	h->byteOrder = SCENE_BYTE_ORDER;
+	h->nspheres = nspheres;
+	h->nboxes = nboxes;
+	h->nmaterials = nmaterials;
+	h->nlights = nlights;
+	h->nprototypes = nprototypes;
+	h->nprotoSpheres = nprotoSpheres;
+	h->nprotoBoxes = nprotoBoxes;
+	h->ninstances = ninstances;
+	h->sphereSize = sizeof(sphere);
+	h->boxSize = sizeof(box);
+	h->materialSize = sizeof(material);
+	h->lightSize = sizeof(light);
+	h->prototypeSize = sizeof(prototype);
+	h->instanceSize = sizeof(instance);
+
+	off = sceneAlign(sizeof(sceneHeader));
+	h->spheres = off;	off = sceneAlign(off + (uint64_t)nspheres * sizeof(sphere));
+	h->sphereX = off;	off = sceneAlign(off + (uint64_t)nspheres * sizeof(float));
+	h->sphereY = off;	off = sceneAlign(off + (uint64_t)nspheres * sizeof(float));
+	h->sphereZ = off;	off = sceneAlign(off + (uint64_t)nspheres * sizeof(float));
+	h->sphereRadius = off;	off = sceneAlign(off + (uint64_t)nspheres * sizeof(float));
+	h->sphereId = off;	off = sceneAlign(off + (uint64_t)nspheres * sizeof(int));
+	h->boxes = off;		off = sceneAlign(off + (uint64_t)nboxes * sizeof(box));
+	h->materials = off;	off = sceneAlign(off + (uint64_t)nmaterials * sizeof(material));
+	h->lights = off;	off = sceneAlign(off + (uint64_t)nlights * sizeof(light));
+	h->prototypes = off;	off = sceneAlign(off + (uint64_t)nprototypes * sizeof(prototype));
+	h->protoSpheres = off;	off = sceneAlign(off + (uint64_t)nprotoSpheres * sizeof(sphere));
+	h->protoBoxes = off;	off = sceneAlign(off + (uint64_t)nprotoBoxes * sizeof(box));
+	h->instances = off;	off = sceneAlign(off + (uint64_t)ninstances * sizeof(instance));
+	h->size = off;
+}
+
+/* Point f at the sections of the scene image at f->base */
+static void sceneSections(sceneFile *f){
+	char *base = f->base;
+	sceneHeader *h = f->h = f->base;
+
+	f->spheres = (sphere *)(base + h->spheres);
+	f->sphereX = (float *)(base + h->sphereX);
+	f->sphereY = (float *)(base + h->sphereY);
+	f->sphereZ = (float *)(base + h->sphereZ);
+	f->sphereRadius = (float *)(base + h->sphereRadius);
+	f->sphereId = (int *)(base + h->sphereId);
+	f->boxes = (box *)(base + h->boxes);
+	f->materials = (material *)(base + h->materials);
+	f->lights = (light *)(base + h->lights);
+	f->prototypes = (prototype *)(base + h->prototypes);
+	f->protoSpheres = (sphere *)(base + h->protoSpheres);
+	f->protoBoxes = (box *)(base + h->protoBoxes);
+	f->instances = (instance *)(base + h->instances);
+}
+
+/* Whether every index in the sections of f refers to something that is
+ * there: materials, sphere ids, the ranges of prototypes and the
+ * prototypes of instances. Returns a message saying what is wrong, or
+ * NULL.
+ */
+static const char *sceneCheckIndices(sceneFile *f){
+	sceneHeader *h = f->h;
+	int64_t nmaterials = h->nmaterials;
+	uint32_t i;
+
+	for(i = 0; i < h->nspheres; i++){
+		if(f->spheres[i].material < 0 || f->spheres[i].material >= nmaterials)
+			return "a sphere has no such material";
+		if(f->sphereId[i] < 0 || f->sphereId[i] >= (int64_t)h->nspheres)
+			return "a sphere id is out of range";
+	}
+	for(i = 0; i < h->nboxes; i++)
+		if(f->boxes[i].material < 0 || f->boxes[i].material >= nmaterials)
+			return "a box has no such material";
+	for(i = 0; i < h->nprotoSpheres; i++)
+		if(f->protoSpheres[i].material < 0 || f->protoSpheres[i].material >= nmaterials)
+			return "a prototype sphere has no such material";
+	for(i = 0; i < h->nprotoBoxes; i++)
+		if(f->protoBoxes[i].material < 0 || f->protoBoxes[i].material >= nmaterials)
+			return "a prototype box has no such material";
+	for(i = 0; i < h->nprototypes; i++){
+		prototype *p = &f->prototypes[i];
+		if(p->firstSphere < 0 || p->nspheres < 0 ||
+				(int64_t)p->firstSphere + p->nspheres > h->nprotoSpheres ||
+				p->firstBox < 0 || p->nboxes < 0 ||
+				(int64_t)p->firstBox + p->nboxes > h->nprotoBoxes)
+			return "a prototype reaches past its spheres or boxes";
+	}
+	for(i = 0; i < h->ninstances; i++){
+		instance *in = &f->instances[i];
+		if(in->proto < 0 || in->proto >= (int64_t)h->nprototypes)
+			return "an instance has no such prototype";
+		if(in->material < -1 || in->material >= nmaterials)
+			return "an instance has no such material";
+	}
+	return NULL;
+}
+
+/* Check the scene image f->base of f->size bytes and point f at its
+ * sections. The header must match the layout of this build and every
+ * index in the sections must be in range, since the image may come from
+ * anywhere: a file a client names, or a coordinator over the network.
+ * name says where it came from in messages. Returns 0 on success,
+ * otherwise prints why it was rejected and returns -1.
+ */
+static inline int sceneCheck(sceneFile *f, char *name){
+	sceneHeader expect;
+	const char *why;
+
+	f->h = f->base;
+	sceneHeader *h = f->h;
+	if(f->size < sizeof(sceneHeader) || memcmp(h->magic, SCENE_MAGIC, sizeof(SCENE_MAGIC)) != 0){
+		fprintf(stderr, "%s: not a scene file\n", name);
+		return -1;
+	}
+	if(h->version != SCENE_VERSION){
+		fprintf(stderr, "%s: scene format version %u, expected %d\n", name,
+			h->version, SCENE_VERSION);
+		return -1;
+	}
+
+	/* Same counts must give the same layout, or it was not written by us */
+	sceneLayout(&expect, h->nspheres, h->nboxes, h->nmaterials, h->nlights, h->nprototypes,
+		h->nprotoSpheres, h->nprotoBoxes, h->ninstances);
+	memcpy(expect.magic, h->magic, sizeof(expect.magic));
+	if(memcmp(&expect, h, sizeof(sceneHeader)) != 0 || h->size > f->size){
+		fprintf(stderr, "%s: scene file was written with a different layout or is truncated\n", name);
+		return -1;
+	}
+
+	sceneSections(f);
+	if((why = sceneCheckIndices(f)) != NULL){
+		fprintf(stderr, "%s: %s\n", name, why);
+		return -1;
+	}
+	return 0;
+}
+
+/* Map a scene file read-only and check it with sceneCheck(). Returns 0
+ * on success, otherwise prints why the file was rejected and returns -1.
+ */
+static inline int sceneMap(sceneFile *f, char *path){
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0 || fstat(fd, &st) != 0){
+		perror(path);
+		if(fd >= 0) close(fd);
+		return -1;
+	}
+	if((size_t)st.st_size < sizeof(sceneHeader)){
+		fprintf(stderr, "%s: not a scene file\n", path);
+		close(fd);
+		return -1;
+	}
+
+	f->size = st.st_size;
+	f->base = mmap(NULL, f->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(f->base == MAP_FAILED){
+		perror(path);
+		return -1;
+	}
+	if(sceneCheck(f, path) != 0){
+		munmap(f->base, f->size);
+		return -1;
+	}
+	return 0;
+}
+
+/* Room for a scene image of size bytes that sceneUnmap() can free, like
+ * a mapped file. Returns 0 on success.
+ */
+static inline int sceneAllocate(sceneFile *f, size_t size){
+	f->size = size;
+	f->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return f->base == MAP_FAILED ? -1 : 0;
+}
+
+/* Build the scene image of a scene that is in memory, to send it
+ * elsewhere. Such a scene has no instances. Returns 0 on success.
+ */
+static inline int scenePack(sceneFile *f, sphere *spheres, int nspheres, box *boxes, int nboxes,
+		material *materials, int nmaterials, light *lights, int nlights){
+	sceneHeader h;
+	int i;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, SCENE_MAGIC, sizeof(SCENE_MAGIC));
+	sceneLayout(&h, nspheres, nboxes, nmaterials, nlights, 0, 0, 0, 0);
+	if(sceneAllocate(f, h.size) != 0) return -1;
+	*(sceneHeader *)f->base = h;
+	sceneSections(f);
+	memcpy(f->spheres, spheres, nspheres * sizeof(sphere));
+	for(i = 0; i < nspheres; i++){
+		f->sphereX[i] = spheres[i].pos.x;
+		f->sphereY[i] = spheres[i].pos.y;
+		f->sphereZ[i] = spheres[i].pos.z;
+		f->sphereRadius[i] = spheres[i].radius;
+		f->sphereId[i] = i;
+	}
+	memcpy(f->boxes, boxes, nboxes * sizeof(box));
+	memcpy(f->materials, materials, nmaterials * sizeof(material));
+	memcpy(f->lights, lights, nlights * sizeof(light));
+	return 0;
+}
+
+static inline void sceneUnmap(sceneFile *f){
+	munmap(f->base, f->size);
+}
+
+#endif
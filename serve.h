@@ -0,0 +1,365 @@
+/* A render daemon that keeps its scenes loaded.
+ *
+ * A daemon (--serve) listens on a Unix domain socket. Each connection
+ * sends one job, a serveRequest: the scene file, the camera with the
+ * size of the image, anti-aliasing and a time budget. The daemon loads
+ * a scene the first time a job asks for it and keeps it, its BVH and
+ * its light grid for the jobs after, so a small frame costs no more
+ * than tracing it. Up to SERVE_SCENES scene files stay loaded once no
+ * job uses them, the least recently used are let go first.
+ *
+ * Jobs are rendered in the order they came, a given number at a time,
+ * each on its share of the threads. The others wait their turn; past
+ * the length of the queue a job is turned away at once. The frame goes
+ * back over the same connection as it is rendered: a serveFrame, then
+ * the tone mapped rows band by band, then a serveDone. A job that fails
+ * gets a message saying why instead, at any point.
+ *
+ * Messages are framed like those of remote.h, a remoteHeader followed
+ * by length bytes, and records are sent as they are laid out in memory,
+ * so the client (--submit) must be the same build as the daemon.
+ */
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "camera.h"
+#include "image.h"
+#include "remote.h"
+
+/* Jobs waiting for their turn, more are turned away */
+#define SERVE_QUEUE 64
+
+/* Scene files kept loaded when no job is using them */
+#define SERVE_SCENES 8
+
+/* Longest path of a scene file a job can name */
+#define SERVE_NAME 1024
+
+/* Largest image a job can ask for, on either side */
+#define SERVE_SIZE 16384
+
+/* Seconds the daemon waits for a job to arrive on a new connection, or
+ * for a client to take more of its frame, before it hangs up
+ */
+#define SERVE_TIMEOUT 10
+
+enum{
+	SERVE_MSG_JOB,		/* client to daemon: serveRequest */
+	SERVE_MSG_FRAME,	/* daemon to client: serveFrame, the job has started */
+	SERVE_MSG_ROWS,		/* daemon to client: serveRows, then 3 bytes per pixel of the rows */
+	SERVE_MSG_DONE,		/* daemon to client: serveDone, every row was sent */
+	SERVE_MSG_ERROR		/* daemon to client: why the job failed, as text */
+};
+
+/* What a job sees and how finely. How it is traced and tone mapped is
+ * up to the daemon.
+ */
+typedef struct{
+	uint32_t byteOrder;
+	uint32_t size;		/* sizeof(serveRequest) */
+	char scene[SERVE_NAME];	/* scene file, empty for the scene the daemon was started with */
+	camera cam;		/* and the size of the image */
+	int32_t aa;		/* 0 for the daemon's default */
+	float budget;		/* ms to render for, 0 to finish the frame */
+}serveRequest;
+
+typedef struct{
+	int32_t width, height;
+	int32_t ahead;		/* jobs that were queued or rendering when it arrived */
+}serveFrame;
+
+typedef struct{
+	int32_t y0, y1;
+}serveRows;
+
+typedef struct{
+	double waited;		/* seconds in the queue */
+	double seconds;		/* spent loading the scene and rendering */
+	int32_t passes;		/* progressive passes finished, for a budget */
+	int64_t rays;
+}serveDone;
+
+/* Jobs taken in the order they come, at most limit at once. Tickets are
+ * handed out as jobs arrive and called in turn.
+ */
+typedef struct{
+	pthread_mutex_t lock;
+	pthread_cond_t turn;
+	int limit;		/* jobs rendering at once */
+	int length;		/* jobs waiting, beyond those */
+	int admitted;		/* jobs let in and not finished */
+	int running;
+	unsigned long next;	/* ticket of the next job to arrive */
+	unsigned long called;	/* ticket of the next job to start */
+}serveQueue;
+
+/* Socket the daemon listens on, removed when it is stopped */
+static char serveSocket[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static void serveQueueInit(serveQueue *q, int limit, int length){
+	memset(q, 0, sizeof(*q));
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->turn, NULL);
+	q->limit = limit;
+	q->length = length;
+}
+
+/* Let a job in unless the queue is full. Returns the number of jobs
+ * ahead of it, or -1 if it was turned away.
+ */
+static int serveQueueAdmit(serveQueue *q){
+	int ahead;
+
+	pthread_mutex_lock(&q->lock);
+	ahead = q->admitted;
+	if(q->admitted >= q->limit + q->length)
+		ahead = -1;
+	else
+		q->admitted++;
+	pthread_mutex_unlock(&q->lock);
+	return ahead;
+}
+
+/* Wait until it is the turn of a job that was let in */
+static void serveQueueEnter(serveQueue *q){
+	pthread_mutex_lock(&q->lock);
+	unsigned long ticket = q->next++;
+	while(ticket != q->called || q->running >= q->limit)
+		pthread_cond_wait(&q->turn, &q->lock);
+	q->called++;
+	q->running++;
+	pthread_cond_broadcast(&q->turn);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* A job is finished. running says whether it got its turn. */
+static void serveQueueLeave(serveQueue *q, bool running){
+	pthread_mutex_lock(&q->lock);
+	q->admitted--;
+	if(running) q->running--;
+	pthread_cond_broadcast(&q->turn);
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Fill in the address of the socket at path */
+static void serveAddress(struct sockaddr_un *sa, char *path){
+	if(strlen(path) >= sizeof(sa->sun_path))
+		err_quit("%s: socket path too long", path);
+	memset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	strcpy(sa->sun_path, path);
+}
+
+static void serveStop(int signo){
+	(void)signo;
+	unlink(serveSocket);
+	_exit(0);
+}
+
+/* Listen on the socket at path. A socket left there by a daemon that is
+ * gone is replaced, one with a daemon behind it is not. The socket is
+ * removed when the daemon is interrupted or terminated.
+ */
+static int serveListen(char *path){
+	struct sockaddr_un sa;
+	struct stat st;
+	int fd;
+
+	serveAddress(&sa, path);
+	if(stat(path, &st) == 0 && S_ISSOCK(st.st_mode)){
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd >= 0 && connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == 0)
+			err_quit("%s: another daemon is listening there", path);
+		if(fd >= 0) close(fd);
+		unlink(path);
+	}
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		err_sys("cannot listen on %s", path);
+	Bind(fd, (struct sockaddr *)&sa, sizeof(sa));
+	if(listen(fd, SERVE_QUEUE) < 0)
+		err_sys("listen on %s", path);
+	strcpy(serveSocket, path);
+	Signal(SIGINT, serveStop);
+	Signal(SIGTERM, serveStop);
+	return fd;
+}
+
+/* Connect to the daemon at path */
+static int serveConnect(char *path){
+	struct sockaddr_un sa;
+	int fd;
+
+	serveAddress(&sa, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+		err_sys("cannot connect to %s", path);
+	return fd;
+}
+
+/* Read exactly n bytes. Returns 0 on success, -1 if the connection
+ * ended, failed or timed out first.
+ */
+static int serveRead(int fd, void *p, size_t n){
+	char *c = p;
+
+	while(n > 0){
+		ssize_t got = read(fd, c, n);
+		if(got < 0 && errno == EINTR) continue;
+		if(got <= 0) return -1;
+		c += got;
+		n -= got;
+	}
+	return 0;
+}
+
+/* Send a message of type with the record p of n bytes */
+static int serveSend(int fd, uint32_t type, void *p, size_t n){
+	remoteHeader h = {type, n};
+
+	if(remoteSend(fd, &h, sizeof(h)) != 0) return -1;
+	return remoteSend(fd, p, n);
+}
+
+/* Tell the client why its job failed */
+static int serveFail(int fd, char *why){
+	return serveSend(fd, SERVE_MSG_ERROR, why, strlen(why));
+}
+
+/* Send rows y0 to y1 of the frame, 3 bytes per pixel at img */
+static int serveSendRows(int fd, unsigned char *img, int width, int y0, int y1){
+	size_t n = (size_t)3 * width * (y1 - y0);
+	remoteHeader h = {SERVE_MSG_ROWS, sizeof(serveRows) + n};
+	serveRows rows = {y0, y1};
+
+	if(remoteSend(fd, &h, sizeof(h)) != 0 || remoteSend(fd, &rows, sizeof(rows)) != 0)
+		return -1;
+	return remoteSend(fd, img, n);
+}
+
+/* Receive the job of a new connection into q. Returns 0 on success,
+ * otherwise -1 with why in why.
+ */
+static int serveReceiveJob(int fd, serveRequest *q, char **why){
+	remoteHeader h;
+
+	if(serveRead(fd, &h, sizeof(h)) != 0 || h.type != SERVE_MSG_JOB){
+		*why = "expected a job";
+		return -1;
+	}
+	if(h.length != sizeof(serveRequest) || serveRead(fd, q, sizeof(*q)) != 0 ||
+			q->byteOrder != REMOTE_BYTE_ORDER || q->size != sizeof(serveRequest)){
+		*why = "client was built differently from this daemon";
+		return -1;
+	}
+	if(memchr(q->scene, '\0', sizeof(q->scene)) == NULL){
+		*why = "scene name too long";
+		return -1;
+	}
+	if(q->cam.width < 1 || q->cam.height < 1 || q->cam.width > SERVE_SIZE ||
+			q->cam.height > SERVE_SIZE || !(q->budget >= 0 && q->budget < INFINITY) || q->aa < 0){
+		*why = "bad size, anti-aliasing or budget";
+		return -1;
+	}
+	return 0;
+}
+
+/* Send job q to the daemon at path and write the frame it streams back
+ * to output as it arrives, encoded on up to threads threads. Returns 0
+ * on success, otherwise prints why and returns -1.
+ */
+static int serveSubmit(char *path, serveRequest *q, char *output, int threads){
+	int fd = serveConnect(path);
+	unsigned char *rows = NULL;
+	imageStream out;
+	bool started = false;
+	int next = 0, status = -1;
+	remoteHeader h;
+	serveFrame frame = {0};
+	serveRows r;
+	serveDone done;
+
+	q->byteOrder = REMOTE_BYTE_ORDER;
+	q->size = sizeof(serveRequest);
+	/* A daemon that turns the job away says why and hangs up before
+	 * reading it, the reply is still there to read
+	 */
+	Signal(SIGPIPE, SIG_IGN);
+	serveSend(fd, SERVE_MSG_JOB, q, sizeof(*q));
+	for(;;){
+		if(serveRead(fd, &h, sizeof(h)) != 0){
+			fprintf(stderr, "%s: daemon closed the connection\n", path);
+			break;
+		}
+		if(h.type == SERVE_MSG_ERROR){
+			char why[256];
+			size_t n = h.length < sizeof(why) ? h.length : sizeof(why) - 1;
+			if(serveRead(fd, why, n) != 0) n = 0;
+			why[n] = '\0';
+			fprintf(stderr, "%s: %s\n", path, why);
+			break;
+		}
+		if(h.type == SERVE_MSG_FRAME && !started && h.length == sizeof(frame) &&
+				serveRead(fd, &frame, sizeof(frame)) == 0){
+			if(frame.width != q->cam.width || frame.height != q->cam.height)
+				err_quit("%s: sent a frame of the wrong size", path);
+			if(imageBegin(&out, output, frame.width, frame.height, threads) != 0){
+				perror(output);
+				break;
+			}
+			started = true;
+			fprintf(stderr, "serve: job started after %d others\n", frame.ahead);
+			continue;
+		}
+		if(h.type == SERVE_MSG_ROWS && started && h.length >= sizeof(r) &&
+				serveRead(fd, &r, sizeof(r)) == 0){
+			size_t n = (size_t)3 * frame.width * (r.y1 - r.y0);
+			if(r.y0 != next || r.y1 <= r.y0 || r.y1 > frame.height || h.length != sizeof(r) + n)
+				err_quit("%s: sent rows out of order", path);
+			rows = realloc(rows, n);
+			if(rows == NULL)
+				err_sys("serve: out of memory");
+			if(serveRead(fd, rows, n) != 0){
+				fprintf(stderr, "%s: daemon closed the connection\n", path);
+				break;
+			}
+			if(imageWriteRows(&out, rows, r.y1 - r.y0) != 0){
+				perror(output);
+				break;
+			}
+			next = r.y1;
+			continue;
+		}
+		if(h.type == SERVE_MSG_DONE && started && next == frame.height && h.length == sizeof(done) &&
+				serveRead(fd, &done, sizeof(done)) == 0){
+			if(imageEnd(&out) != 0){
+				perror(output);
+				started = false;
+				break;
+			}
+			started = false;
+			fprintf(stderr, "serve: %dx%d waited %.3f s, rendered in %.3f s, %lld rays",
+				frame.width, frame.height, done.waited, done.seconds, (long long)done.rays);
+			if(q->budget > 0) fprintf(stderr, ", %d passes", done.passes);
+			fprintf(stderr, "\n");
+			status = 0;
+			break;
+		}
+		err_quit("%s: sent a message out of turn", path);
+	}
+	if(started) imageAbort(&out);
+	free(rows);
+	close(fd);
+	return status;
+}
+
+#endif
@@ -0,0 +1,95 @@
+/* Render statistics and debug tracing
+ *
+ * Every render thread counts into its own renderStats, padded to whole
+ * cache lines so threads never write to the same line. The counters are
+ * plain increments in the hot loops and are only added up once the image
+ * is done.
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <string.h>
+
+/* Bounces a path can make, the renderers stop after STATS_DEPTHS - 1 */
+#define STATS_DEPTHS 16
+
+/* Stages of a wavefront render, timed separately */
+enum{ STAGE_GENERATE, STAGE_INTERSECT, STAGE_GROUP, STAGE_SHADE, STATS_STAGES };
+
+typedef struct{
+	long samples;		/* primary rays, one per pixel without anti-aliasing */
+	long refined;		/* pixels anti-aliasing had to sample again */
+	long skipped;		/* tiles left out because the deadline had passed */
+	long culled;		/* tiles whose frustum holds nothing to hit */
+	long rays;		/* closest hit queries */
+	long tests;		/* ray/primitive intersection tests */
+	long hits;		/* queries that hit something */
+	long lights;		/* iterations of the light loop */
+	long shadowRays;	/* any hit queries towards a light */
+	long shadowed;		/* shadow rays that were blocked */
+	long cut;		/* paths ended because nothing they add would show */
+	long roulette;		/* paths ended by Russian roulette */
+	long depth[STATS_DEPTHS];	/* paths ending after this many bounces */
+	double stage[STATS_STAGES];	/* seconds spent in each wavefront stage */
+}__attribute__((aligned(64))) renderStats;
+
+/* Add up the counters of n threads */
+static void statsMerge(renderStats *total, renderStats *threads, int n){
+	int i, d;
+	memset(total, 0, sizeof(*total));
+	for(i = 0; i < n; i++){
+		total->samples += threads[i].samples;
+		total->refined += threads[i].refined;
+		total->skipped += threads[i].skipped;
+		total->culled += threads[i].culled;
+		total->rays += threads[i].rays;
+		total->tests += threads[i].tests;
+		total->hits += threads[i].hits;
+		total->lights += threads[i].lights;
+		total->shadowRays += threads[i].shadowRays;
+		total->shadowed += threads[i].shadowed;
+		total->cut += threads[i].cut;
+		total->roulette += threads[i].roulette;
+		for(d = 0; d < STATS_DEPTHS; d++)
+			total->depth[d] += threads[i].depth[d];
+		for(d = 0; d < STATS_STAGES; d++)
+			total->stage[d] += threads[i].stage[d];
+	}
+}
+
+static void statsPrint(FILE *f, renderStats *s){
+	int d, last = 0;
+
+	fprintf(f, "stats: %ld rays, %ld tests (%.1f per ray), %ld hits (%.1f%%), %ld light iterations\n",
+		s->rays, s->tests, s->rays ? (double)s->tests / s->rays : 0.0,
+		s->hits, s->rays ? 100.0 * s->hits / s->rays : 0.0, s->lights);
+	if(s->shadowRays > 0)
+		fprintf(f, "stats: %ld shadow rays, %ld blocked (%.1f%%)\n", s->shadowRays,
+			s->shadowed, 100.0 * s->shadowed / s->shadowRays);
+	if(s->culled > 0)
+		fprintf(f, "stats: %ld tiles culled, their primary rays hit nothing\n", s->culled);
+	if(s->cut > 0 || s->roulette > 0)
+		fprintf(f, "stats: %ld paths cut short, %ld ended by roulette\n", s->cut, s->roulette);
+	for(d = 0; d < STATS_DEPTHS; d++)
+		if(s->depth[d] > 0) last = d;
+	fprintf(f, "stats: paths by bounces:");
+	for(d = 0; d <= last; d++)
+		fprintf(f, " %d:%ld", d, s->depth[d]);
+	fprintf(f, "\n");
+	if(s->stage[STAGE_GENERATE] > 0)
+		fprintf(f, "stats: wavefront stages (thread time): generate %.1f ms, intersect %.1f ms, group %.1f ms, shade %.1f ms\n",
+			s->stage[STAGE_GENERATE] * 1e3, s->stage[STAGE_INTERSECT] * 1e3,
+			s->stage[STAGE_GROUP] * 1e3, s->stage[STAGE_SHADE] * 1e3);
+}
+
+/* Per-hit debug output. Compiled in only with -DRENDER_TRACE, otherwise
+ * the arguments are not even evaluated.
+ */
+#ifdef RENDER_TRACE
+#define TRACE(...) printf(__VA_ARGS__)
+#else
+#define TRACE(...) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,154 @@
+/* When a path stops bouncing.
+ *
+ * Every hit adds the light reaching it, times the weight of the path,
+ * and multiplies the weight by the reflection of its material. A path
+ * ends when it leaves the scene, when the weight is 0 or, with the fixed
+ * policy, after TERMINATE_DEPTH bounces. Reflective materials keep the
+ * weight well above 0, so most paths that stay in the scene make all of
+ * them even when what they add is long past anything the image shows.
+ *
+ * No hit can add more to a channel than the weight times the sum of the
+ * intensities of the lights and the largest diffuse colour of a
+ * material, and the weight falls at least by the largest reflection at
+ * every hit. That bounds what the rest of a path can add. The policies:
+ *
+ *	fixed		TERMINATE_DEPTH bounces, as it always was
+ *	cut		also end a path when tone mapping its colour and its
+ *			colour plus the bound give the same byte in every channel:
+ *			nothing it could still add would show
+ *	roulette	also, once the bound is below threshold steps of the
+ *			output, go on with probability bound / threshold and
+ *			divide the weight by it, which keeps the expected colour
+ *
+ * The cut is exact for an 8-bit image of one ray per pixel that shades
+ * every light. With anti-aliasing a pixel is the average of samples that
+ * are tested one by one, and sampled lights are weighted to be right on
+ * average only, so the bound holds only on average too; the image can
+ * then differ in a few pixels by a step. Float images are not quantized
+ * and nothing is cut from them; their roulette counts steps of 1/255.
+ * The coin of the roulette is a hash of the hit point, so every thread
+ * and every machine makes the same choice.
+ */
+#ifndef TERMINATE_H
+#define TERMINATE_H
+
+#include <stdbool.h>
+#include <string.h>
+#include "geometry.h"
+#include "lights.h"
+#include "tonemap.h"
+#include "stats.h"
+
+/* Most bounces of a path */
+#define TERMINATE_DEPTH (STATS_DEPTHS - 1)
+
+/* Default threshold of the roulette, in steps of the output */
+#define TERMINATE_ROULETTE_STEPS 4.0f
+
+/* The bound is widened by this much for the rounding of the sums it
+ * is compared to
+ */
+#define TERMINATE_MARGIN 1.001f
+
+typedef enum{
+	TERMINATE_FIXED,
+	TERMINATE_CUT,
+	TERMINATE_ROULETTE
+}terminateMode;
+
+typedef struct{
+	terminateMode mode;
+	colour most;		/* the most one hit adds for a weight of 1 */
+	float tail[TERMINATE_DEPTH + 1];	/* how many times that a path that makes its
+						 * bounce level next can still add */
+	float threshold;	/* roulette below this many steps of the output */
+	float steps;		/* steps of the output a colour of 1 makes */
+	tonemap *tm;		/* how colours become bytes, NULL for floats */
+}terminatePolicy;
+
+static const char *terminateModeNames[] = {"fixed", "cut", "roulette"};
+
+/* Set up p for the materials and lights of a scene, tm NULL if the image
+ * is not quantized. Returns -1 if mode is not the name of a policy.
+ */
+static int terminateInit(terminatePolicy *p, const char *mode, float threshold,
+		material *materials, int nmaterials, light *lights, int nlights, tonemap *tm){
+	colour diffuse = {0, 0, 0}, bright = {0, 0, 0};
+	float reflect = 0, sum = 0, power = 1;
+	int i;
+
+	for(i = 0; i <= TERMINATE_ROULETTE; i++)
+		if(strcmp(mode, terminateModeNames[i]) == 0) break;
+	if(i > TERMINATE_ROULETTE) return -1;
+	p->mode = i;
+	p->threshold = threshold;
+	p->tm = tm;
+	p->steps = 255 * (tm != NULL ? tm->scale : 1);
+
+	for(i = 0; i < nmaterials; i++){
+		diffuse.red = max(diffuse.red, materials[i].diffuse.red);
+		diffuse.green = max(diffuse.green, materials[i].diffuse.green);
+		diffuse.blue = max(diffuse.blue, materials[i].diffuse.blue);
+		reflect = max(reflect, materials[i].reflection);
+	}
+	for(i = 0; i < nlights; i++){
+		bright.red += max(lights[i].intensity.red, 0);
+		bright.green += max(lights[i].intensity.green, 0);
+		bright.blue += max(lights[i].intensity.blue, 0);
+	}
+	p->most.red = diffuse.red * bright.red * TERMINATE_MARGIN;
+	p->most.green = diffuse.green * bright.green * TERMINATE_MARGIN;
+	p->most.blue = diffuse.blue * bright.blue * TERMINATE_MARGIN;
+
+	/* A path that makes bounce level next has TERMINATE_DEPTH - level
+	 * hits left, the k-th of them weighted by at most reflect^k
+	 */
+	p->tail[TERMINATE_DEPTH] = 0;
+	for(i = TERMINATE_DEPTH - 1; i >= 0; i--){
+		sum += power;
+		power *= reflect;
+		p->tail[i] = sum;
+	}
+	return 0;
+}
+
+/* Does one channel show the same whatever up to bound is added to v? */
+static inline bool terminateSame(tonemap *tm, float v, float bound, float d){
+	return tonemapOne(tm, v, d) == tonemapOne(tm, v + bound, d);
+}
+
+/* Called after a path of colour c with weight *coef has made level
+ * bounces, last at hit point at, for pixel (x, y). Returns true if it
+ * ends there, counting why in st; a path that goes on through the
+ * roulette has its weight raised to make up for those that did not.
+ */
+static inline bool terminatePath(terminatePolicy *p, float *coef, int level, colour *c,
+		int x, int y, vector *at, renderStats *st){
+	if(*coef <= 0.0f || level >= TERMINATE_DEPTH) return true;
+	if(p->mode == TERMINATE_FIXED) return false;
+
+	float w = *coef * p->tail[level];
+	colour bound = {w * p->most.red, w * p->most.green, w * p->most.blue};
+	if(p->tm != NULL){
+		float d = p->tm->dither ? (tonemapBayer[y & 7][x & 7] + 0.5f) / 64 : 0;
+		if(terminateSame(p->tm, c->red, bound.red, d) && terminateSame(p->tm, c->green, bound.green, d) &&
+				terminateSame(p->tm, c->blue, bound.blue, d)){
+			st->cut++;
+			return true;
+		}
+	}
+	if(p->mode != TERMINATE_ROULETTE) return false;
+
+	float steps = max(bound.red, max(bound.green, bound.blue)) * p->steps;
+	if(steps >= p->threshold) return false;
+	float q = steps / p->threshold;
+	/* Not the numbers lightShade() draws at the same point */
+	if(lightRandom(lightSeed(at) ^ 0x5bd1e995u, level) >= q){
+		st->roulette++;
+		return true;
+	}
+	*coef /= q;
+	return false;
+}
+
+#endif
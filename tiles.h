@@ -0,0 +1,190 @@
+/* Tile scheduler for the render loop.
+ *
+ * The image is cut into square tiles which are rendered by a pool of
+ * worker threads. Every worker owns a deque of tiles: it pops work from
+ * the bottom of its own deque and, once that runs dry, steals from the
+ * top of the other workers' deques. Tiles that hit reflective objects
+ * cost far more than background tiles, so stealing keeps every core busy
+ * until the whole image is done.
+ *
+ * Tiles never overlap, so the tile function can write its pixels straight
+ * into a shared image buffer without any locking.
+ */
+#ifndef TILES_H
+#define TILES_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* Default edge length of a tile in pixels */
+#define TILE_SIZE 32
+
+/* A rectangle of pixels, x1 and y1 are exclusive */
+typedef struct{
+	int x0, y0;
+	int x1, y1;
+}tile;
+
+/* Called once per tile, worker is the index of the calling thread */
+typedef void tileFunc(void *ctx, tile *t, int worker);
+
+/* Per worker deque. The owner takes from the bottom, thieves from the top. */
+typedef struct{
+	pthread_mutex_t lock;
+	tile *tiles;
+	int top;
+	int bottom;
+}tileDeque;
+
+typedef struct{
+	tileDeque *deques;
+	int nworkers;
+	tileFunc *func;
+	void *ctx;
+}tilePool;
+
+typedef struct{
+	tilePool *pool;
+	int id;
+}tileWorker;
+
+/* Number of CPUs we can run on, used when no thread count is given */
+static int tileDefaultThreads(void){
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int)n : 1;
+}
+
+/* Take the next tile from our own deque */
+static int tilePop(tileDeque *d, tile *t){
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top){
+		*t = d->tiles[--d->bottom];
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+/* Take the oldest tile from somebody else's deque */
+static int tileSteal(tileDeque *d, tile *t){
+	int found = 0;
+	pthread_mutex_lock(&d->lock);
+	if(d->bottom > d->top){
+		*t = d->tiles[d->top++];
+		found = 1;
+	}
+	pthread_mutex_unlock(&d->lock);
+	return found;
+}
+
+static void *tileWorkerMain(void *arg){
+	tileWorker *w = arg;
+	tilePool *p = w->pool;
+	tile t;
+
+	for(;;){
+		if(tilePop(&p->deques[w->id], &t)){
+			p->func(p->ctx, &t, w->id);
+			continue;
+		}
+
+		/* Our deque is empty, walk the other workers looking for work.
+		 * No new tiles are created while rendering, so once a full sweep
+		 * comes back empty every tile has been handed out.
+		 */
+		int i, stolen = 0;
+		for(i = 1; i < p->nworkers && !stolen; i++){
+			int victim = (w->id + i) % p->nworkers;
+			stolen = tileSteal(&p->deques[victim], &t);
+		}
+		if(!stolen) break;
+		p->func(p->ctx, &t, w->id);
+	}
+	return NULL;
+}
+
+/* Render the rectangle [x0,x1) x [y0,y1) in tiles of tileSize pixels
+ * using nthreads workers. The calling thread acts as worker 0. Returns
+ * once every tile has been rendered.
+ */
+static void renderTiles(int x0, int y0, int x1, int y1, int tileSize,
+		int nthreads, tileFunc *func, void *ctx){
+	if(tileSize < 1) tileSize = TILE_SIZE;
+	if(nthreads < 1) nthreads = 1;
+
+	int tilesX = (x1 - x0 + tileSize - 1) / tileSize;
+	int tilesY = (y1 - y0 + tileSize - 1) / tileSize;
+	int ntiles = tilesX * tilesY;
+	if(ntiles <= 0) return;
+	if(nthreads > ntiles) nthreads = ntiles;
+
+	tilePool pool;
+	pool.nworkers = nthreads;
+	pool.func = func;
+	pool.ctx = ctx;
+	pool.deques = calloc(nthreads, sizeof(tileDeque));
+	tile *all = malloc(ntiles * sizeof(tile));
+	if(pool.deques == NULL || all == NULL){
+		fprintf(stderr, "renderTiles: out of memory\n");
+		exit(1);
+	}
+
+	/* Hand every worker a contiguous run of tiles so neighbouring tiles,
+	 * which tend to touch the same objects, end up on the same core.
+	 * The deques are filled in reverse so the owner starts at the top of
+	 * its run and thieves take from the far end.
+	 */
+	int i, n = 0;
+	for(i = 0; i < nthreads; i++){
+		int first = (int)((long)ntiles * i / nthreads);
+		int last = (int)((long)ntiles * (i + 1) / nthreads);
+		int k;
+
+		tileDeque *d = &pool.deques[i];
+		pthread_mutex_init(&d->lock, NULL);
+		d->tiles = all + n;
+		d->top = 0;
+		d->bottom = last - first;
+
+		for(k = last - 1; k >= first; k--){
+			tile *t = &all[n++];
+			t->x0 = x0 + (k % tilesX) * tileSize;
+			t->y0 = y0 + (k / tilesX) * tileSize;
+			t->x1 = t->x0 + tileSize < x1 ? t->x0 + tileSize : x1;
+			t->y1 = t->y0 + tileSize < y1 ? t->y0 + tileSize : y1;
+		}
+	}
+
+	tileWorker *workers = malloc(nthreads * sizeof(tileWorker));
+	pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+	if(workers == NULL || threads == NULL){
+		fprintf(stderr, "renderTiles: out of memory\n");
+		exit(1);
+	}
+
+	for(i = 0; i < nthreads; i++){
+		workers[i].pool = &pool;
+		workers[i].id = i;
+	}
+	for(i = 1; i < nthreads; i++){
+		if(pthread_create(&threads[i], NULL, tileWorkerMain, &workers[i]) != 0){
+			fprintf(stderr, "renderTiles: cannot start worker thread\n");
+			exit(1);
+		}
+	}
+	tileWorkerMain(&workers[0]);
+	for(i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	for(i = 0; i < nthreads; i++)
+		pthread_mutex_destroy(&pool.deques[i].lock);
+	free(threads);
+	free(workers);
+	free(all);
+	free(pool.deques);
+}
+
+#endif
@@ -0,0 +1,250 @@
+/* Tone mapping: from the linear colours the renderer accumulates to the
+ * bytes of an image.
+ *
+ * Every channel of every pixel goes through the same steps:
+ *
+ *	exposure	scale by 2^stops
+ *	curve		bring [0, inf) into [0, 1]: clamp, Reinhard's
+ *			x / (1 + x), or Narkowicz's fit of the ACES filmic curve
+ *	transfer	the sRGB encoding, or none
+ *	quantize	floor(255 v + d), d 0 or the threshold of an 8x8
+ *			ordered dither, clamped to [0, 255]
+ *
+ * No step depends on the channel, so the kernels run over the RGB floats
+ * of a row as one flat array, 4 or 8 at a time. The sRGB encoding is a
+ * table interpolated linearly, which the AVX2 kernel reads with gathers;
+ * every kernel does the same arithmetic and makes the same bytes. With
+ * the defaults, clamp, no encoding and no dither, the bytes are exactly
+ * those of min(255 v, 255).
+ */
+#ifndef TONEMAP_H
+#define TONEMAP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TONEMAP_X86 1
+#include <immintrin.h>
+#endif
+
+/* Intervals of the sRGB table over [0, 1]. Interpolated, it is within
+ * 0.07 of a step of 255 of the exact encoding.
+ */
+#define TONEMAP_SRGB_STEPS 1024
+
+/* Edge of the tiles the tone mapping pass is cut into for the threads */
+#define TONEMAP_TILE 256
+
+typedef enum{
+	TONEMAP_CLAMP,
+	TONEMAP_REINHARD,
+	TONEMAP_ACES
+}tonemapCurve;
+
+typedef struct{
+	tonemapCurve curve;
+	float stops;		/* exposure */
+	float scale;		/* 2^stops, times what the curve expects */
+	bool srgb;		/* sRGB encoding, or linear values */
+	bool dither;
+	float base[TONEMAP_SRGB_STEPS + 1];	/* encoding at the start of each interval */
+	float slope[TONEMAP_SRGB_STEPS + 1];	/* and its rise over the interval */
+}tonemap;
+
+/* Tone map n pixels of row y from column x, 3n floats of in, into the
+ * 3n bytes of out
+ */
+typedef void tonemapKernel(tonemap *tm, const float *in, unsigned char *out, int n, int x, int y);
+
+/* Thresholds of the ordered dither, out of 64 */
+static const unsigned char tonemapBayer[8][8] = {
+	{ 0, 32,  8, 40,  2, 34, 10, 42},
+	{48, 16, 56, 24, 50, 18, 58, 26},
+	{12, 44,  4, 36, 14, 46,  6, 38},
+	{60, 28, 52, 20, 62, 30, 54, 22},
+	{ 3, 35, 11, 43,  1, 33,  9, 41},
+	{51, 19, 59, 27, 49, 17, 57, 25},
+	{15, 47,  7, 39, 13, 45,  5, 37},
+	{63, 31, 55, 23, 61, 29, 53, 21}
+};
+
+static const char *tonemapCurveNames[] = {"clamp", "reinhard", "aces"};
+
+static float srgbEncode(float v){
+	return v <= 0.0031308f ? 12.92f * v : 1.055f * powf(v, 1 / 2.4f) - 0.055f;
+}
+
+/* Set up tm, returns -1 if curve is not the name of one */
+static int tonemapInit(tonemap *tm, const char *curve, float stops, bool srgb, bool dither){
+	int i;
+
+	for(i = 0; i <= TONEMAP_ACES; i++)
+		if(strcmp(curve, tonemapCurveNames[i]) == 0) break;
+	if(i > TONEMAP_ACES) return -1;
+	tm->curve = i;
+	tm->stops = stops;
+	tm->scale = exp2f(stops);
+	/* The fit takes 0.6 for what the ACES curve takes as 1 */
+	if(tm->curve == TONEMAP_ACES) tm->scale *= 0.6f;
+	tm->srgb = srgb;
+	tm->dither = dither;
+	for(i = 0; i <= TONEMAP_SRGB_STEPS; i++){
+		tm->base[i] = srgbEncode((float)i / TONEMAP_SRGB_STEPS);
+		tm->slope[i] = i < TONEMAP_SRGB_STEPS ? srgbEncode((float)(i + 1) / TONEMAP_SRGB_STEPS) - tm->base[i] : 0;
+	}
+	return 0;
+}
+
+/* Dither thresholds for the flat floats of row y from column x, which
+ * repeat every 24: eight pixels of three channels
+ */
+static void tonemapDitherRow(tonemap *tm, int x, int y, float *d){
+	int j;
+
+	for(j = 0; j < 24; j++)
+		d[j] = tm->dither ? (tonemapBayer[y & 7][(x + j / 3) & 7] + 0.5f) / 64 : 0;
+}
+
+/* One channel, d its dither threshold */
+static inline unsigned char tonemapOne(tonemap *tm, float v, float d){
+	v = v * tm->scale;
+	if(tm->curve == TONEMAP_REINHARD)
+		v = v / (1.0f + v);
+	else if(tm->curve == TONEMAP_ACES)
+		v = v * (2.51f * v + 0.03f) / (v * (2.43f * v + 0.59f) + 0.14f);
+	v = v < 1.0f ? v : 1.0f;
+	if(tm->srgb){
+		v = v > 0.0f ? v : 0.0f;
+		float f = v * TONEMAP_SRGB_STEPS;
+		int i = (int)f;
+		v = tm->base[i] + tm->slope[i] * (f - i);
+	}
+	v = v * 255.0f + d;
+	v = v < 255.0f ? v : 255.0f;
+	v = v > 0.0f ? v : 0.0f;
+	return (unsigned char)v;
+}
+
+static void tonemapScalar(tonemap *tm, const float *in, unsigned char *out, int n, int x, int y){
+	float d[24];
+	int i;
+
+	tonemapDitherRow(tm, x, y, d);
+	for(i = 0; i < 3 * n; i++)
+		out[i] = tonemapOne(tm, in[i], d[i % 24]);
+}
+
+#ifdef TONEMAP_X86
+
+/* Four floats at a time, the sRGB table read one lane at a time */
+__attribute__((target("sse2")))
+static void tonemapSSE(tonemap *tm, const float *in, unsigned char *out, int n, int x, int y){
+	float d[24];
+	int i, k, m = 3 * n;
+	__m128 scale = _mm_set1_ps(tm->scale), one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+
+	tonemapDitherRow(tm, x, y, d);
+	for(i = 0; i + 4 <= m; i += 4){
+		__m128 v = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+		if(tm->curve == TONEMAP_REINHARD)
+			v = _mm_div_ps(v, _mm_add_ps(one, v));
+		else if(tm->curve == TONEMAP_ACES)
+			v = _mm_div_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.51f), v), _mm_set1_ps(0.03f))),
+				_mm_add_ps(_mm_mul_ps(v, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.43f), v),
+					_mm_set1_ps(0.59f))), _mm_set1_ps(0.14f)));
+		/* _mm_min_ps(a, b) is a < b ? a : b, so NaN goes the way it
+		 * does in tonemapOne()
+		 */
+		v = _mm_min_ps(v, one);
+		if(tm->srgb){
+			v = _mm_max_ps(v, zero);
+			__m128 f = _mm_mul_ps(v, _mm_set1_ps(TONEMAP_SRGB_STEPS));
+			__m128i idx = _mm_cvttps_epi32(f);
+			int j[4] __attribute__((aligned(16)));
+			_mm_store_si128((__m128i *)j, idx);
+			__m128 base = _mm_set_ps(tm->base[j[3]], tm->base[j[2]], tm->base[j[1]], tm->base[j[0]]);
+			__m128 slope = _mm_set_ps(tm->slope[j[3]], tm->slope[j[2]], tm->slope[j[1]], tm->slope[j[0]]);
+			v = _mm_add_ps(base, _mm_mul_ps(slope, _mm_sub_ps(f, _mm_cvtepi32_ps(idx))));
+		}
+		v = _mm_add_ps(_mm_mul_ps(v, _mm_set1_ps(255.0f)), _mm_loadu_ps(d + i % 24));
+		v = _mm_min_ps(v, _mm_set1_ps(255.0f));
+		v = _mm_max_ps(v, zero);
+		__m128i b = _mm_cvttps_epi32(v);
+		b = _mm_packs_epi32(b, b);
+		b = _mm_packus_epi16(b, b);
+		int word = _mm_cvtsi128_si32(b);
+		memcpy(out + i, &word, 4);
+	}
+	for(k = i; k < m; k++)
+		out[k] = tonemapOne(tm, in[k], d[k % 24]);
+}
+
+/* Eight floats at a time, the sRGB table read with gathers */
+__attribute__((target("avx2")))
+static void tonemapAVX2(tonemap *tm, const float *in, unsigned char *out, int n, int x, int y){
+	float d[24];
+	int i, k, m = 3 * n;
+	__m256 scale = _mm256_set1_ps(tm->scale), one = _mm256_set1_ps(1.0f), zero = _mm256_setzero_ps();
+
+	tonemapDitherRow(tm, x, y, d);
+	for(i = 0; i + 8 <= m; i += 8){
+		__m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+		if(tm->curve == TONEMAP_REINHARD)
+			v = _mm256_div_ps(v, _mm256_add_ps(one, v));
+		else if(tm->curve == TONEMAP_ACES)
+			v = _mm256_div_ps(_mm256_mul_ps(v, _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.51f), v),
+				_mm256_set1_ps(0.03f))), _mm256_add_ps(_mm256_mul_ps(v,
+				_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(2.43f), v), _mm256_set1_ps(0.59f))),
+				_mm256_set1_ps(0.14f)));
+		v = _mm256_min_ps(v, one);
+		if(tm->srgb){
+			v = _mm256_max_ps(v, zero);
+			__m256 f = _mm256_mul_ps(v, _mm256_set1_ps(TONEMAP_SRGB_STEPS));
+			__m256i idx = _mm256_cvttps_epi32(f);
+			__m256 base = _mm256_i32gather_ps(tm->base, idx, 4);
+			__m256 slope = _mm256_i32gather_ps(tm->slope, idx, 4);
+			v = _mm256_add_ps(base, _mm256_mul_ps(slope, _mm256_sub_ps(f, _mm256_cvtepi32_ps(idx))));
+		}
+		v = _mm256_add_ps(_mm256_mul_ps(v, _mm256_set1_ps(255.0f)), _mm256_loadu_ps(d + i % 24));
+		v = _mm256_min_ps(v, _mm256_set1_ps(255.0f));
+		v = _mm256_max_ps(v, zero);
+		__m256i b = _mm256_cvttps_epi32(v);
+		__m128i w = _mm_packs_epi32(_mm256_castsi256_si128(b), _mm256_extracti128_si256(b, 1));
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(w, w));
+	}
+	for(k = i; k < m; k++)
+		out[k] = tonemapOne(tm, in[k], d[k % 24]);
+}
+
+#endif
+
+/* Pick the kernel like packetSelect(), "off" takes the scalar one.
+ * Returns NULL if the requested kernel is not available.
+ */
+static tonemapKernel *tonemapSelect(const char *name, const char **chosen){
+	tonemapKernel *k = tonemapScalar;
+	const char *kname = "scalar";
+	int automatic = (name == NULL || strcmp(name, "auto") == 0);
+
+	if(name != NULL && strcmp(name, "off") == 0) name = "scalar";
+#ifdef TONEMAP_X86
+	__builtin_cpu_init();
+	if((automatic || strcmp(name, "avx2") == 0) && __builtin_cpu_supports("avx2")){
+		k = tonemapAVX2;
+		kname = "avx2";
+	}else if((automatic || strcmp(name, "sse") == 0) && __builtin_cpu_supports("sse2")){
+		k = tonemapSSE;
+		kname = "sse";
+	}
+#endif
+	if(!automatic && strcmp(name, kname) != 0)
+		return NULL;
+	if(chosen != NULL) *chosen = kname;
+	return k;
+}
+
+#endif
@@ -0,0 +1,227 @@
+/* The wrappers declared in util.h: each one calls the system function
+ * and gives up with a message if it fails, so callers need no error
+ * handling of their own. Used where an error leaves nothing sensible to
+ * do but stop, like a render worker that lost its coordinator.
+ *
+ * Built with the programs that use it:
+ *
+ *	gcc -O2 -o raytracer raytracer.c util.c -lm -lz -pthread
+ */
+#include <string.h>
+#include "util.h"
+
+/* Print the message, with the error of the last call if errnoflag is
+ * set, and either return or exit
+ */
+static void err_doit(int errnoflag, char *fmt, va_list ap){
+	int errno_save = errno;
+	char buf[MAXLINE];
+
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	if(errnoflag)
+		snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), ": %s", strerror(errno_save));
+	fflush(stdout);
+	fprintf(stderr, "%s\n", buf);
+	fflush(stderr);
+}
+
+/* Fatal error related to a system call */
+void err_sys(char *fmt, ...){
+	va_list ap;
+
+	va_start(ap, fmt);
+	err_doit(1, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+/* Fatal error unrelated to a system call */
+void err_quit(char *fmt, ...){
+	va_list ap;
+
+	va_start(ap, fmt);
+	err_doit(0, fmt, ap);
+	va_end(ap);
+	exit(1);
+}
+
+/* signal() with the same reliable semantics everywhere */
+Sigfunc *Signal(int signo, Sigfunc *func){
+	struct sigaction act, oact;
+
+	act.sa_handler = func;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = signo == SIGALRM ? 0 : SA_RESTART;
+	if(sigaction(signo, &act, &oact) < 0)
+		err_sys("signal error");
+	return oact.sa_handler;
+}
+
+/* The addresses of host and serv, host may be NULL for a passive socket */
+struct addrinfo *Host_serv(const char *host, const char *serv, int family, int socktype){
+	struct addrinfo hints, *res;
+	int n;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = host == NULL ? AI_PASSIVE : AI_CANONNAME;
+	hints.ai_family = family;
+	hints.ai_socktype = socktype;
+	if((n = getaddrinfo(host, serv, &hints, &res)) != 0)
+		err_quit("host_serv error for %s, %s: %s", host == NULL ? "(no hostname)" : host,
+			serv == NULL ? "(no service name)" : serv, gai_strerror(n));
+	return res;
+}
+
+/* One read(), which may return less than nbytes, and 0 at end of file */
+ssize_t Read(int fd, void *ptr, size_t nbytes){
+	ssize_t n;
+
+	do
+		n = read(fd, ptr, nbytes);
+	while(n < 0 && errno == EINTR);
+	if(n < 0)
+		err_sys("read error");
+	return n;
+}
+
+/* Write all of nbytes, however many calls it takes */
+void Write(int fd, void *ptr, size_t nbytes){
+	char *p = ptr;
+
+	while(nbytes > 0){
+		ssize_t n = write(fd, p, nbytes);
+		if(n < 0 && errno == EINTR) continue;
+		if(n <= 0)
+			err_sys("write error");
+		p += n;
+		nbytes -= n;
+	}
+}
+
+ssize_t Recvfrom(int fd, void *ptr, size_t nbytes, int flags, struct sockaddr *sa,
+		socklen_t *salenptr){
+	ssize_t n;
+
+	if((n = recvfrom(fd, ptr, nbytes, flags, sa, salenptr)) < 0)
+		err_sys("recvfrom error");
+	return n;
+}
+
+/* The address part of sa as text, in a static buffer */
+char *Sock_ntop_host(const struct sockaddr *sa, socklen_t salen){
+	static char str[128];
+
+	(void)salen;
+	switch(sa->sa_family){
+	case AF_INET:
+		if(inet_ntop(AF_INET, &((struct sockaddr_in *)sa)->sin_addr, str, sizeof(str)) != NULL)
+			return str;
+		break;
+	case AF_INET6:
+		if(inet_ntop(AF_INET6, &((struct sockaddr_in6 *)sa)->sin6_addr, str, sizeof(str)) != NULL)
+			return str;
+		break;
+	case AF_UNIX:
+		snprintf(str, sizeof(str), "%s", ((struct sockaddr_un *)sa)->sun_path);
+		return str;
+	default:
+		snprintf(str, sizeof(str), "sock_ntop_host: unknown AF_xxx: %d", sa->sa_family);
+		return str;
+	}
+	err_sys("sock_ntop_host error");
+	return NULL;
+}
+
+void sock_set_port(struct sockaddr *sa, socklen_t salen, int port){
+	(void)salen;
+	switch(sa->sa_family){
+	case AF_INET:
+		((struct sockaddr_in *)sa)->sin_port = port;
+		return;
+	case AF_INET6:
+		((struct sockaddr_in6 *)sa)->sin6_port = port;
+		return;
+	}
+}
+
+/* 0 if the two sockets have the same address, ports are not compared */
+int sock_cmp_addr(const struct sockaddr *sa1, const struct sockaddr *sa2, socklen_t salen){
+	(void)salen;
+	if(sa1->sa_family != sa2->sa_family)
+		return -1;
+	switch(sa1->sa_family){
+	case AF_INET:
+		return memcmp(&((struct sockaddr_in *)sa1)->sin_addr,
+			&((struct sockaddr_in *)sa2)->sin_addr, sizeof(struct in_addr));
+	case AF_INET6:
+		return memcmp(&((struct sockaddr_in6 *)sa1)->sin6_addr,
+			&((struct sockaddr_in6 *)sa2)->sin6_addr, sizeof(struct in6_addr));
+	case AF_UNIX:
+		return strcmp(((struct sockaddr_un *)sa1)->sun_path,
+			((struct sockaddr_un *)sa2)->sun_path);
+	}
+	return -1;
+}
+
+/* out -= in */
+void tv_sub(struct timeval *out, struct timeval *in){
+	if((out->tv_usec -= in->tv_usec) < 0){
+		--out->tv_sec;
+		out->tv_usec += 1000000;
+	}
+	out->tv_sec -= in->tv_sec;
+}
+
+char *icmpcode_v4(int code){
+	static char errbuf[100];
+
+	switch(code){
+	case 0: return "network unreachable";
+	case 1: return "host unreachable";
+	case 2: return "protocol unreachable";
+	case 3: return "port unreachable";
+	case 4: return "fragmentation required but DF bit set";
+	case 5: return "source route failed";
+	case 6: return "destination network unknown";
+	case 7: return "destination host unknown";
+	case 8: return "source host isolated (obsolete)";
+	case 9: return "destination network administratively prohibited";
+	case 10: return "destination host administratively prohibited";
+	case 11: return "network unreachable for TOS";
+	case 12: return "host unreachable for TOS";
+	case 13: return "communication administratively prohibited by filtering";
+	case 14: return "host precedence violation";
+	case 15: return "precedence cutoff in effect";
+	}
+	snprintf(errbuf, sizeof(errbuf), "[unknown code %d]", code);
+	return errbuf;
+}
+
+void *Calloc(size_t n, size_t size){
+	void *ptr;
+
+	if((ptr = calloc(n, size)) == NULL)
+		err_sys("calloc error");
+	return ptr;
+}
+
+void Gettimeofday(struct timeval *tv, void *foo){
+	(void)foo;
+	if(gettimeofday(tv, NULL) == -1)
+		err_sys("gettimeofday error");
+}
+
+void Pipe(int *fds){
+	if(pipe(fds) < 0)
+		err_sys("pipe error");
+}
+
+void Bind(int fd, const struct sockaddr *sa, socklen_t salen){
+	if(bind(fd, sa, salen) < 0)
+		err_sys("bind error");
+}
+
+void Setsockopt(int fd, int level, int optname, const void *optval, socklen_t optlen){
+	if(setsockopt(fd, level, optname, optval, optlen) < 0)
+		err_sys("setsockopt error");
+}
@@ -0,0 +1,282 @@
+/* Buffers for wavefront rendering.
+ *
+ * Instead of following the path of one pixel to its end before starting
+ * the next, a wavefront renderer moves all the rays of a tile through one
+ * stage at a time: the camera makes the primary rays, they are all
+ * intersected, the hits are grouped by the kind of primitive and the
+ * material they hit, and shading them makes the reflected rays of the
+ * next bounce in a new queue. Each stage is a short loop over arrays that
+ * stays in the caches, rather than one long loop that goes through all
+ * the code of the renderer for every ray.
+ *
+ * The queues are in structure-of-arrays form like the packets, so
+ * PACKET_SIZE rays that follow each other can be copied straight into a
+ * rayPacket.
+ *
+ * Reflected rays leave in every direction, so rays of neighbouring
+ * pixels soon have little in common. wavefrontSort() puts them back in
+ * an order where rays that follow each other start close together and
+ * head the same way: by the octant of their direction, then along a
+ * Morton curve through their origins. Packets of those rays mostly visit
+ * the same BVH nodes, and rays that follow each other touch memory the
+ * last one touched.
+ */
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "geometry.h"
+#include "packet.h"
+
+/* Default edge of the tiles of a wavefront render, so a queue holds up
+ * to 64k rays
+ */
+#define WAVEFRONT_TILE 256
+
+/* Sorted rays go through the packet kernel together only if their keys
+ * agree above this bit: same octant, and origins in the same of 2^13
+ * Morton cells. Packets of rays further apart visit so many more nodes
+ * than each ray would alone that they are slower than tracing the rays
+ * one at a time.
+ */
+#define WAVEFRONT_COHERENT_SHIFT 16
+
+/* Rays waiting for the next stage */
+typedef struct{
+	float *ox, *oy, *oz;
+	float *dx, *dy, *dz;
+	float *coef;	/* how much what the ray finds adds to its pixel */
+	int *pixel;	/* pixel of the tile the ray belongs to */
+	float *t;	/* closest hit, once intersected */
+	int *hit;	/* primitive hit, PRIM_REF(), or -1 */
+	int count;
+}rayQueue;
+
+/* What a worker needs to render tiles of up to capacity pixels */
+typedef struct{
+	rayQueue cur, next;
+	colour *pixels;	/* colours of the pixels of the tile so far */
+	int *key;	/* group of every ray in cur */
+	int *order;	/* rays of cur, grouped or sorted */
+	uint32_t *sortKey, *sortTmp;	/* scratch of wavefrontSort() */
+	int *orderTmp;
+	int capacity;
+	arena *mem;	/* all of the above, and the counts of wavefrontGroup() */
+}wavefront;
+
+static void rayQueueInit(rayQueue *q, int capacity, arena *mem){
+	int padded = (capacity + PACKET_SIZE - 1) / PACKET_SIZE * PACKET_SIZE;
+	q->ox = soaAlloc(padded, mem);
+	q->oy = soaAlloc(padded, mem);
+	q->oz = soaAlloc(padded, mem);
+	q->dx = soaAlloc(padded, mem);
+	q->dy = soaAlloc(padded, mem);
+	q->dz = soaAlloc(padded, mem);
+	q->coef = soaAlloc(padded, mem);
+	q->pixel = (int *)soaAlloc(padded, mem);
+	q->t = soaAlloc(padded, mem);
+	q->hit = (int *)soaAlloc(padded, mem);
+	q->count = 0;
+}
+
+static inline void rayQueuePush(rayQueue *q, ray *r, float coef, int pixel){
+	int i = q->count++;
+	q->ox[i] = r->start.x;
+	q->oy[i] = r->start.y;
+	q->oz[i] = r->start.z;
+	q->dx[i] = r->dir.x;
+	q->dy[i] = r->dir.y;
+	q->dz[i] = r->dir.z;
+	q->coef[i] = coef;
+	q->pixel[i] = pixel;
+}
+
+static inline void rayQueueGet(rayQueue *q, int i, ray *r){
+	r->start.x = q->ox[i];
+	r->start.y = q->oy[i];
+	r->start.z = q->oz[i];
+	r->dir.x = q->dx[i];
+	r->dir.y = q->dy[i];
+	r->dir.z = q->dz[i];
+}
+
+/* Copy up to PACKET_SIZE rays of q from first on, but not from end on,
+ * into a packet. Lanes past the last one repeat it.
+ */
+static void rayQueuePacket(rayQueue *q, int first, int end, rayPacket *p){
+	int k;
+
+	p->count = end - first < PACKET_SIZE ? end - first : PACKET_SIZE;
+	for(k = 0; k < PACKET_SIZE; k++){
+		int i = first + (k < p->count ? k : p->count - 1);
+		p->ox[k] = q->ox[i];
+		p->oy[k] = q->oy[i];
+		p->oz[k] = q->oz[i];
+		p->dx[k] = q->dx[i];
+		p->dy[k] = q->dy[i];
+		p->dz[k] = q->dz[i];
+	}
+}
+
+/* Like rayQueuePacket(), but the rays are order[first] and on */
+static void rayQueueGather(rayQueue *q, int *order, int first, int end, rayPacket *p){
+	int k;
+
+	p->count = end - first < PACKET_SIZE ? end - first : PACKET_SIZE;
+	for(k = 0; k < PACKET_SIZE; k++){
+		int i = order[first + (k < p->count ? k : p->count - 1)];
+		p->ox[k] = q->ox[i];
+		p->oy[k] = q->oy[i];
+		p->oz[k] = q->oz[i];
+		p->dx[k] = q->dx[i];
+		p->dy[k] = q->dy[i];
+		p->dz[k] = q->dz[i];
+	}
+}
+
+/* Allocate the buffers for tiles of up to capacity pixels from mem, the
+ * arena of the thread that uses them
+ */
+static void wavefrontInit(wavefront *w, int capacity, arena *mem){
+	rayQueueInit(&w->cur, capacity, mem);
+	rayQueueInit(&w->next, capacity, mem);
+	w->pixels = arenaAlloc(mem, capacity * sizeof(colour));
+	w->key = arenaAlloc(mem, capacity * sizeof(int));
+	w->order = arenaAlloc(mem, capacity * sizeof(int));
+	w->sortKey = arenaAlloc(mem, capacity * sizeof(uint32_t));
+	w->sortTmp = arenaAlloc(mem, capacity * sizeof(uint32_t));
+	w->orderTmp = arenaAlloc(mem, capacity * sizeof(int));
+	w->capacity = capacity;
+	w->mem = mem;
+	if(w->pixels == NULL || w->key == NULL || w->order == NULL || w->sortKey == NULL ||
+			w->sortTmp == NULL || w->orderTmp == NULL){
+		fprintf(stderr, "wavefrontInit: out of memory\n");
+		exit(1);
+	}
+}
+
+/* Put the rays of cur in order of their key, which must be set and lie
+ * in [0, nkeys), keeping the order of the queue within a group. A
+ * counting sort, so it costs two passes over the rays.
+ */
+static void wavefrontGroup(wavefront *w, int nkeys){
+	arenaMark mark = arenaGetMark(w->mem);
+	int *counts = arenaCalloc(w->mem, nkeys * sizeof(int));
+	int i, sum = 0;
+
+	if(counts == NULL){
+		fprintf(stderr, "wavefrontGroup: out of memory\n");
+		exit(1);
+	}
+	for(i = 0; i < w->cur.count; i++)
+		counts[w->key[i]]++;
+	for(i = 0; i < nkeys; i++){
+		int c = counts[i];
+		counts[i] = sum;
+		sum += c;
+	}
+	for(i = 0; i < w->cur.count; i++)
+		w->order[counts[w->key[i]]++] = i;
+	arenaRelease(w->mem, mark);
+}
+
+/* Spread the low 10 bits of v out to every third bit */
+static inline uint32_t mortonSpread(uint32_t v){
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+/* Order the rays of cur for coherence into order: by direction octant,
+ * then by the Morton code of the origin on a 1024^3 grid over the box
+ * the origins span. sortKey[j] is the key of ray order[j]. A radix sort,
+ * four passes of eight bits.
+ */
+static void wavefrontSort(wavefront *w){
+	rayQueue *q = &w->cur;
+	vector lo = {INFINITY, INFINITY, INFINITY}, hi = {-INFINITY, -INFINITY, -INFINITY};
+	uint32_t *key = w->sortKey, *keyTmp = w->sortTmp;
+	int *order = w->order, *orderTmp = w->orderTmp;
+	int n = q->count, i, pass;
+
+	for(i = 0; i < n; i++){
+		lo.x = fminf(lo.x, q->ox[i]); hi.x = fmaxf(hi.x, q->ox[i]);
+		lo.y = fminf(lo.y, q->oy[i]); hi.y = fmaxf(hi.y, q->oy[i]);
+		lo.z = fminf(lo.z, q->oz[i]); hi.z = fmaxf(hi.z, q->oz[i]);
+	}
+	float sx = hi.x > lo.x ? 1023.0f / (hi.x - lo.x) : 0;
+	float sy = hi.y > lo.y ? 1023.0f / (hi.y - lo.y) : 0;
+	float sz = hi.z > lo.z ? 1023.0f / (hi.z - lo.z) : 0;
+	for(i = 0; i < n; i++){
+		uint32_t octant = (q->dx[i] < 0) | (q->dy[i] < 0) << 1 | (q->dz[i] < 0) << 2;
+		uint32_t mx = mortonSpread((uint32_t)fminf((q->ox[i] - lo.x) * sx, 1023));
+		uint32_t my = mortonSpread((uint32_t)fminf((q->oy[i] - lo.y) * sy, 1023));
+		uint32_t mz = mortonSpread((uint32_t)fminf((q->oz[i] - lo.z) * sz, 1023));
+		key[i] = octant << 29 | (mx << 2 | my << 1 | mz) >> 1;
+		order[i] = i;
+	}
+
+	for(pass = 0; pass < 32; pass += 8){
+		int counts[256] = {0};
+		int sum = 0;
+		for(i = 0; i < n; i++)
+			counts[key[i] >> pass & 0xff]++;
+		for(i = 0; i < 256; i++){
+			int c = counts[i];
+			counts[i] = sum;
+			sum += c;
+		}
+		for(i = 0; i < n; i++){
+			int slot = counts[key[i] >> pass & 0xff]++;
+			keyTmp[slot] = key[i];
+			orderTmp[slot] = order[i];
+		}
+		uint32_t *kt = key; key = keyTmp; keyTmp = kt;
+		int *ot = order; order = orderTmp; orderTmp = ot;
+	}
+	/* An even number of passes leaves the result where it started */
+}
+
+/* Whether the sorted rays first to last are close enough for a packet */
+static inline bool wavefrontCoherent(wavefront *w, int first, int last){
+	return w->sortKey[first] >> WAVEFRONT_COHERENT_SHIFT == w->sortKey[last] >> WAVEFRONT_COHERENT_SHIFT;
+}
+
+/* Move the rays i of q with keep[i] set to the front, in order, and
+ * return how many there are
+ */
+static int wavefrontCompact(rayQueue *q, int *keep, int n){
+	int i, k = 0;
+
+	for(i = 0; i < n; i++){
+		if(!keep[i]) continue;
+		q->ox[k] = q->ox[i];
+		q->oy[k] = q->oy[i];
+		q->oz[k] = q->oz[i];
+		q->dx[k] = q->dx[i];
+		q->dy[k] = q->dy[i];
+		q->dz[k] = q->dz[i];
+		q->coef[k] = q->coef[i];
+		q->pixel[k] = q->pixel[i];
+		k++;
+	}
+	return k;
+}
+
+/* Swap the queues once the next bounce has been made */
+static void wavefrontSwap(wavefront *w){
+	rayQueue tmp = w->cur;
+	w->cur = w->next;
+	w->next = tmp;
+	w->next.count = 0;
+}
+
+#endif